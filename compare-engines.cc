@@ -0,0 +1,374 @@
+/*
+ * Copyright (C) 2020 Robert Ancell.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "elf-io.h"
+
+// Runs every program with each way Elf can execute it, checks they all give
+// the same result and reports how long each took and how much memory it used
+
+struct RunResult {
+  std::string stdout_data;
+  int exit_status;
+  double duration_ms;
+
+  // Peak resident set size of the process
+  long max_rss_kb;
+
+  RunResult() : exit_status(0), duration_ms(0), max_rss_kb(0) {}
+};
+
+typedef enum {
+  // Same stdout and exit status as the first engine
+  ENGINE_STATUS_MATCH,
+  ENGINE_STATUS_MISMATCH,
+  // The compiler doesn't support everything the program uses
+  ENGINE_STATUS_UNSUPPORTED,
+  // Only differs in when an error in a function body was reported
+  ENGINE_STATUS_ERROR_ORDER,
+} EngineStatus;
+
+struct EngineResult {
+  std::string program;
+  std::string engine;
+  RunResult result;
+  EngineStatus status;
+};
+
+static const char *engine_status_to_string(EngineStatus status) {
+  switch (status) {
+  case ENGINE_STATUS_MATCH:
+    return "match";
+  case ENGINE_STATUS_MISMATCH:
+    return "mismatch";
+  case ENGINE_STATUS_UNSUPPORTED:
+    return "unsupported";
+  case ENGINE_STATUS_ERROR_ORDER:
+    return "error-order";
+  }
+  return "";
+}
+
+static bool copy_file(const std::string &source, const std::string &dest) {
+  auto source_fd = open(source.c_str(), O_RDONLY);
+  if (source_fd < 0)
+    return false;
+  std::string data;
+  auto result = elf_read_fd(source_fd, data);
+  close(source_fd);
+  if (!result)
+    return false;
+
+  auto dest_fd = open(dest.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU);
+  if (dest_fd < 0)
+    return false;
+  result = write(dest_fd, data.data(), data.size()) == (ssize_t)data.size();
+  close(dest_fd);
+  return result;
+}
+
+// Runs a command capturing stdout. Processes killed by a signal get an exit
+// status of 128 + signal, like the shell
+static bool run_command(std::vector<std::string> &args, RunResult &result) {
+  int stdout_pipe[2];
+  if (pipe(stdout_pipe) < 0) {
+    printf("Failed to make pipe\n");
+    return false;
+  }
+
+  auto start_time = std::chrono::steady_clock::now();
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(stdout_pipe[0]);
+    dup2(stdout_pipe[1], STDOUT_FILENO);
+    std::vector<char *> argv;
+    for (auto i = args.begin(); i != args.end(); i++)
+      argv.push_back(const_cast<char *>(i->c_str()));
+    argv.push_back(nullptr);
+    execv(argv[0], argv.data());
+    exit(127);
+  }
+  close(stdout_pipe[1]);
+
+  auto read_result = elf_read_fd(stdout_pipe[0], result.stdout_data);
+  close(stdout_pipe[0]);
+  if (!read_result)
+    printf("Failed to read output of %s\n", args[0].c_str());
+
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) < 0) {
+    printf("Failed to wait for %s to exit\n", args[0].c_str());
+    return false;
+  }
+  auto end_time = std::chrono::steady_clock::now();
+
+  result.duration_ms =
+      std::chrono::duration<double, std::milli>(end_time - start_time).count();
+  result.max_rss_kb = usage.ru_maxrss;
+  if (WIFEXITED(status))
+    result.exit_status = WEXITSTATUS(status);
+  else if (WIFSIGNALED(status))
+    result.exit_status = 128 + WTERMSIG(status);
+
+  return read_result;
+}
+
+// Compiles the program to an executable and runs that. The source is copied
+// into a temporary directory, as elf compile writes the binary next to it.
+// If elf compile fails result has its output. unsupported is set if it failed
+// because the compiler can't handle the program yet
+static bool run_compiled(const std::string &elf_path,
+                         const std::string &program,
+                         const std::string &work_dir, bool stack_only,
+                         RunResult &result, bool &unsupported) {
+  auto slash = program.rfind('/');
+  auto name = slash == std::string::npos ? program : program.substr(slash + 1);
+  auto source_path = work_dir + "/" + name;
+  auto binary_path = source_path.substr(0, source_path.size() - 4);
+  if (!copy_file(program, source_path)) {
+    printf("Failed to copy %s\n", program.c_str());
+    return false;
+  }
+
+  std::vector<std::string> compile_args = {elf_path, "compile"};
+  if (stack_only)
+    compile_args.push_back("--stack-only");
+  compile_args.push_back(source_path);
+  RunResult compile_result;
+  auto ran = run_command(compile_args, compile_result);
+  unlink(source_path.c_str());
+  if (!ran)
+    return false;
+
+  // A program that fails to compile is reported with the compiler's output.
+  // Failures other than an unsupported feature, such as the compiler crashing,
+  // are compared as normal so they show up as mismatches
+  if (compile_result.exit_status != 0) {
+    auto &output = compile_result.stdout_data;
+    unsupported = compile_result.exit_status == 1 &&
+                  output.compare(0, 14, "Can't compile ") == 0;
+    result = compile_result;
+    return true;
+  }
+
+  std::vector<std::string> args = {binary_path};
+  ran = run_command(args, result);
+  unlink(binary_path.c_str());
+  return ran;
+}
+
+static void add_programs(const std::string &path,
+                         std::vector<std::string> &programs) {
+  auto dir = opendir(path.c_str());
+  if (dir == nullptr) {
+    programs.push_back(path);
+    return;
+  }
+
+  std::vector<std::string> names;
+  while (true) {
+    auto entry = readdir(dir);
+    if (entry == nullptr)
+      break;
+    std::string name = entry->d_name;
+    if (name.size() > 4 && name.compare(name.size() - 4, 4, ".elf") == 0)
+      names.push_back(name);
+  }
+  closedir(dir);
+  std::sort(names.begin(), names.end());
+
+  for (auto i = names.begin(); i != names.end(); i++)
+    programs.push_back(path + "/" + *i);
+}
+
+static std::string csv_escape(const std::string &text) {
+  if (text.find_first_of(",\"\n") == std::string::npos)
+    return text;
+
+  std::string escaped = "\"";
+  for (auto i = text.begin(); i != text.end(); i++) {
+    if (*i == '"')
+      escaped += '"';
+    escaped += *i;
+  }
+  return escaped + "\"";
+}
+
+static bool ends_with(const std::string &text, const std::string &suffix) {
+  return text.size() >= suffix.size() &&
+         text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// The interpreter parses function bodies when they are first called, every
+// other engine parses them before running. So an error in a body stops an eager
+// engine before it prints anything, while the lazy one prints the same error
+// after any earlier output, or runs successfully if the function isn't called
+static bool is_error_order_difference(const RunResult &lazy,
+                                      const RunResult &eager) {
+  if (eager.exit_status != 1 || eager.stdout_data.compare(0, 5, "Line ") != 0)
+    return false;
+  if (lazy.exit_status == 0)
+    return true;
+  return lazy.exit_status == 1 &&
+         ends_with(lazy.stdout_data, eager.stdout_data);
+}
+
+static void print_csv(std::vector<EngineResult> &results) {
+  printf("program,engine,exit_status,status,time_ms,max_rss_kb\n");
+  for (auto i = results.begin(); i != results.end(); i++)
+    printf("%s,%s,%d,%s,%.3f,%ld\n", csv_escape(i->program).c_str(),
+           i->engine.c_str(), i->result.exit_status,
+           engine_status_to_string(i->status), i->result.duration_ms,
+           i->result.max_rss_kb);
+}
+
+static void print_json(std::vector<EngineResult> &results) {
+  printf("[\n");
+  for (auto i = results.begin(); i != results.end(); i++)
+    printf("  {\"program\": \"%s\", \"engine\": \"%s\", \"exit_status\": %d, "
+           "\"status\": \"%s\", \"time_ms\": %.3f, \"max_rss_kb\": %ld}%s\n",
+           elf_json_escape(i->program).c_str(), i->engine.c_str(),
+           i->result.exit_status, engine_status_to_string(i->status),
+           i->result.duration_ms, i->result.max_rss_kb,
+           i + 1 != results.end() ? "," : "");
+  printf("]\n");
+}
+
+int main(int argc, char **argv) {
+  bool json = false;
+  std::string elf_path;
+  std::vector<std::string> programs;
+
+  // The first engine is the reference the others are checked against
+  std::vector<std::string> engines = {"interpreter", "interpreter-eager",
+                                      "compiled", "compiled-stack-only"};
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--json") == 0)
+      json = true;
+    else if (strncmp(argv[i], "--engines=", 10) == 0) {
+      engines.clear();
+      std::string list = argv[i] + 10;
+      size_t start = 0;
+      while (start <= list.size()) {
+        auto end = list.find(',', start);
+        if (end == std::string::npos)
+          end = list.size();
+        engines.push_back(list.substr(start, end - start));
+        start = end + 1;
+      }
+    } else if (elf_path.empty())
+      elf_path = argv[i];
+    else
+      add_programs(argv[i], programs);
+  }
+  if (elf_path.empty() || programs.empty()) {
+    printf("Usage: compare-engines [--json] [--engines=<engine>,...] "
+           "<path-to-elf> <file-or-directory> ...\n"
+           "Engines: interpreter, interpreter-eager, "
+           "interpreter-eager-no-inline, compiled, compiled-stack-only\n");
+    return EXIT_FAILURE;
+  }
+
+  char work_dir_template[] = "/tmp/elf-compare-XXXXXX";
+  if (mkdtemp(work_dir_template) == nullptr) {
+    printf("Failed to make temporary directory\n");
+    return EXIT_FAILURE;
+  }
+  std::string work_dir = work_dir_template;
+
+  std::vector<EngineResult> results;
+  size_t n_mismatches = 0, n_unsupported = 0, n_error_order = 0;
+  for (auto program = programs.begin(); program != programs.end();
+       program++) {
+    RunResult reference;
+    for (size_t i = 0; i < engines.size(); i++) {
+      EngineResult result;
+      result.program = *program;
+      result.engine = engines[i];
+
+      bool ran, unsupported = false;
+      if (result.engine == "compiled" ||
+          result.engine == "compiled-stack-only") {
+        ran = run_compiled(elf_path, *program, work_dir,
+                           result.engine == "compiled-stack-only",
+                           result.result, unsupported);
+      } else if (result.engine == "interpreter" ||
+                 result.engine == "interpreter-eager" ||
+                 result.engine == "interpreter-eager-no-inline") {
+        std::vector<std::string> args = {elf_path, "run"};
+        if (result.engine != "interpreter")
+          args.push_back("--eager");
+        if (result.engine == "interpreter-eager-no-inline")
+          args.push_back("--inline-threshold=0");
+        args.push_back(*program);
+        ran = run_command(args, result.result);
+      } else {
+        printf("Unknown engine \"%s\"\n", result.engine.c_str());
+        ran = false;
+      }
+      if (!ran) {
+        rmdir(work_dir.c_str());
+        return EXIT_FAILURE;
+      }
+
+      if (i == 0)
+        reference = result.result;
+      auto reference_is_lazy = engines[0] == "interpreter";
+      auto is_lazy = result.engine == "interpreter";
+      if (result.result.stdout_data == reference.stdout_data &&
+          result.result.exit_status == reference.exit_status)
+        result.status = ENGINE_STATUS_MATCH;
+      else if (reference_is_lazy && !is_lazy &&
+               is_error_order_difference(reference, result.result)) {
+        result.status = ENGINE_STATUS_ERROR_ORDER;
+        n_error_order++;
+      } else if (!reference_is_lazy && is_lazy &&
+                 is_error_order_difference(result.result, reference)) {
+        result.status = ENGINE_STATUS_ERROR_ORDER;
+        n_error_order++;
+      } else if (unsupported) {
+        result.status = ENGINE_STATUS_UNSUPPORTED;
+        n_unsupported++;
+      } else {
+        result.status = ENGINE_STATUS_MISMATCH;
+        n_mismatches++;
+      }
+
+      results.push_back(result);
+    }
+  }
+  rmdir(work_dir.c_str());
+
+  if (json)
+    print_json(results);
+  else
+    print_csv(results);
+  fprintf(stderr,
+          "%zu programs, %zu mismatches, %zu unsupported by the compiler, %zu "
+          "differ only in when errors are reported\n",
+          programs.size(), n_mismatches, n_unsupported, n_error_order);
+
+  return n_mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,617 @@
+/*
+ * Copyright (C) 2020 Robert Ancell.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "elf-array.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Kernels process as many bytes as they can using SSE2 (always available on
+// x86_64) or AVX2 (if the CPU supports it), with the remaining elements
+// handled by the scalar code.
+
+size_t elf_array_type_get_size(ArrayType type) {
+  switch (type) {
+  case ARRAY_TYPE_UINT8:
+  case ARRAY_TYPE_INT8:
+    return 1;
+  case ARRAY_TYPE_UINT16:
+  case ARRAY_TYPE_INT16:
+    return 2;
+  case ARRAY_TYPE_UINT32:
+  case ARRAY_TYPE_INT32:
+    return 4;
+  case ARRAY_TYPE_UINT64:
+  case ARRAY_TYPE_INT64:
+    return 8;
+  }
+
+  return 0;
+}
+
+bool elf_array_type_is_signed(ArrayType type) {
+  return type == ARRAY_TYPE_INT8 || type == ARRAY_TYPE_INT16 ||
+         type == ARRAY_TYPE_INT32 || type == ARRAY_TYPE_INT64;
+}
+
+template <typename T>
+static void add_scalar(bool subtract, T *a, const T *b, size_t length) {
+  for (size_t i = 0; i < length; i++)
+    a[i] = subtract ? a[i] - b[i] : a[i] + b[i];
+}
+
+template <typename T> static uint64_t sum_scalar(const T *a, size_t length) {
+  uint64_t sum = 0;
+  for (size_t i = 0; i < length; i++)
+    sum += static_cast<uint64_t>(a[i]);
+  return sum;
+}
+
+template <typename T>
+static void minmax_scalar(bool is_max, const T *a, size_t length, T *result) {
+  for (size_t i = 0; i < length; i++) {
+    if (is_max ? a[i] > *result : a[i] < *result)
+      *result = a[i];
+  }
+}
+
+#if defined(__x86_64__)
+
+static bool have_avx2() {
+  static bool result = __builtin_cpu_supports("avx2");
+  return result;
+}
+
+static size_t add_sse2(size_t element_size, bool subtract, uint8_t *a,
+                       const uint8_t *b, size_t n_bytes) {
+  size_t offset = 0;
+  for (; offset + 16 <= n_bytes; offset += 16) {
+    auto va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + offset));
+    auto vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + offset));
+    __m128i r;
+    switch (element_size) {
+    case 1:
+      r = subtract ? _mm_sub_epi8(va, vb) : _mm_add_epi8(va, vb);
+      break;
+    case 2:
+      r = subtract ? _mm_sub_epi16(va, vb) : _mm_add_epi16(va, vb);
+      break;
+    case 4:
+      r = subtract ? _mm_sub_epi32(va, vb) : _mm_add_epi32(va, vb);
+      break;
+    default:
+      r = subtract ? _mm_sub_epi64(va, vb) : _mm_add_epi64(va, vb);
+      break;
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(a + offset), r);
+  }
+
+  return offset;
+}
+
+__attribute__((target("avx2"))) static size_t
+add_avx2(size_t element_size, bool subtract, uint8_t *a, const uint8_t *b,
+         size_t n_bytes) {
+  size_t offset = 0;
+  for (; offset + 32 <= n_bytes; offset += 32) {
+    auto va =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + offset));
+    auto vb =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + offset));
+    __m256i r;
+    switch (element_size) {
+    case 1:
+      r = subtract ? _mm256_sub_epi8(va, vb) : _mm256_add_epi8(va, vb);
+      break;
+    case 2:
+      r = subtract ? _mm256_sub_epi16(va, vb) : _mm256_add_epi16(va, vb);
+      break;
+    case 4:
+      r = subtract ? _mm256_sub_epi32(va, vb) : _mm256_add_epi32(va, vb);
+      break;
+    default:
+      r = subtract ? _mm256_sub_epi64(va, vb) : _mm256_add_epi64(va, vb);
+      break;
+    }
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(a + offset), r);
+  }
+
+  return offset;
+}
+
+static size_t fill_sse2(uint8_t *a, const uint8_t *pattern, size_t n_bytes) {
+  auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pattern));
+  size_t offset = 0;
+  for (; offset + 16 <= n_bytes; offset += 16)
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(a + offset), v);
+
+  return offset;
+}
+
+__attribute__((target("avx2"))) static size_t
+fill_avx2(uint8_t *a, const uint8_t *pattern, size_t n_bytes) {
+  auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pattern));
+  size_t offset = 0;
+  for (; offset + 32 <= n_bytes; offset += 32)
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(a + offset), v);
+
+  return offset;
+}
+
+// Returns false if a difference was found, otherwise offset is set to the
+// number of bytes compared
+static bool equal_sse2(const uint8_t *a, const uint8_t *b, size_t n_bytes,
+                       size_t *offset) {
+  for (; *offset + 16 <= n_bytes; *offset += 16) {
+    auto va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + *offset));
+    auto vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + *offset));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xFFFF)
+      return false;
+  }
+
+  return true;
+}
+
+__attribute__((target("avx2"))) static bool
+equal_avx2(const uint8_t *a, const uint8_t *b, size_t n_bytes, size_t *offset) {
+  for (; *offset + 32 <= n_bytes; *offset += 32) {
+    auto va =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + *offset));
+    auto vb =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + *offset));
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)) != -1)
+      return false;
+  }
+
+  return true;
+}
+
+// Adds each 32 bit value to the two 64 bit values in total
+static __m128i add_epi32_to_epi64(__m128i total, __m128i v, bool is_signed) {
+  auto high = is_signed ? _mm_srai_epi32(v, 31) : _mm_setzero_si128();
+  total = _mm_add_epi64(total, _mm_unpacklo_epi32(v, high));
+  return _mm_add_epi64(total, _mm_unpackhi_epi32(v, high));
+}
+
+__attribute__((target("avx2"))) static __m256i
+add_epi32_to_epi64_avx2(__m256i total, __m256i v, bool is_signed) {
+  auto high = is_signed ? _mm256_srai_epi32(v, 31) : _mm256_setzero_si256();
+  total = _mm256_add_epi64(total, _mm256_unpacklo_epi32(v, high));
+  return _mm256_add_epi64(total, _mm256_unpackhi_epi32(v, high));
+}
+
+// int8 values are biased to unsigned and uint16 values to signed so they can
+// use the available instructions, this is corrected for after summing
+static uint64_t get_sum_correction(ArrayType type, size_t length) {
+  if (type == ARRAY_TYPE_INT8)
+    return -static_cast<uint64_t>(128) * length;
+  else if (type == ARRAY_TYPE_UINT16)
+    return static_cast<uint64_t>(32768) * length;
+  else
+    return 0;
+}
+
+static size_t sum_sse2(ArrayType type, const uint8_t *a, size_t n_bytes,
+                       uint64_t *sum) {
+  auto zero = _mm_setzero_si128();
+  auto total = _mm_setzero_si128();
+  size_t offset = 0;
+  for (; offset + 16 <= n_bytes; offset += 16) {
+    auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + offset));
+    switch (type) {
+    case ARRAY_TYPE_UINT8:
+      total = _mm_add_epi64(total, _mm_sad_epu8(v, zero));
+      break;
+    case ARRAY_TYPE_INT8:
+      v = _mm_xor_si128(v, _mm_set1_epi8(-128));
+      total = _mm_add_epi64(total, _mm_sad_epu8(v, zero));
+      break;
+    case ARRAY_TYPE_UINT16:
+      v = _mm_xor_si128(v, _mm_set1_epi16(-32768));
+      v = _mm_madd_epi16(v, _mm_set1_epi16(1));
+      total = add_epi32_to_epi64(total, v, true);
+      break;
+    case ARRAY_TYPE_INT16:
+      v = _mm_madd_epi16(v, _mm_set1_epi16(1));
+      total = add_epi32_to_epi64(total, v, true);
+      break;
+    case ARRAY_TYPE_UINT32:
+      total = add_epi32_to_epi64(total, v, false);
+      break;
+    case ARRAY_TYPE_INT32:
+      total = add_epi32_to_epi64(total, v, true);
+      break;
+    case ARRAY_TYPE_UINT64:
+    case ARRAY_TYPE_INT64:
+      total = _mm_add_epi64(total, v);
+      break;
+    }
+  }
+
+  uint64_t totals[2];
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(totals), total);
+  *sum += totals[0] + totals[1] +
+          get_sum_correction(type, offset / elf_array_type_get_size(type));
+
+  return offset;
+}
+
+__attribute__((target("avx2"))) static size_t
+sum_avx2(ArrayType type, const uint8_t *a, size_t n_bytes, uint64_t *sum) {
+  auto zero = _mm256_setzero_si256();
+  auto total = _mm256_setzero_si256();
+  size_t offset = 0;
+  for (; offset + 32 <= n_bytes; offset += 32) {
+    auto v =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + offset));
+    switch (type) {
+    case ARRAY_TYPE_UINT8:
+      total = _mm256_add_epi64(total, _mm256_sad_epu8(v, zero));
+      break;
+    case ARRAY_TYPE_INT8:
+      v = _mm256_xor_si256(v, _mm256_set1_epi8(-128));
+      total = _mm256_add_epi64(total, _mm256_sad_epu8(v, zero));
+      break;
+    case ARRAY_TYPE_UINT16:
+      v = _mm256_xor_si256(v, _mm256_set1_epi16(-32768));
+      v = _mm256_madd_epi16(v, _mm256_set1_epi16(1));
+      total = add_epi32_to_epi64_avx2(total, v, true);
+      break;
+    case ARRAY_TYPE_INT16:
+      v = _mm256_madd_epi16(v, _mm256_set1_epi16(1));
+      total = add_epi32_to_epi64_avx2(total, v, true);
+      break;
+    case ARRAY_TYPE_UINT32:
+      total = add_epi32_to_epi64_avx2(total, v, false);
+      break;
+    case ARRAY_TYPE_INT32:
+      total = add_epi32_to_epi64_avx2(total, v, true);
+      break;
+    case ARRAY_TYPE_UINT64:
+    case ARRAY_TYPE_INT64:
+      total = _mm256_add_epi64(total, v);
+      break;
+    }
+  }
+
+  uint64_t totals[4];
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(totals), total);
+  *sum += totals[0] + totals[1] + totals[2] + totals[3] +
+          get_sum_correction(type, offset / elf_array_type_get_size(type));
+
+  return offset;
+}
+
+// Writes the smallest / largest values in each lane to lanes. SSE2 only has
+// unsigned 8 bit and signed 16 bit min / max, so other types are biased to
+// use these or compared and masked. 64 bit values aren't supported
+static size_t minmax_sse2(ArrayType type, bool is_max, const uint8_t *a,
+                          size_t n_bytes, uint8_t *lanes) {
+  if (n_bytes < 16 || elf_array_type_get_size(type) == 8)
+    return 0;
+
+  __m128i bias;
+  switch (type) {
+  case ARRAY_TYPE_INT8:
+    bias = _mm_set1_epi8(-128);
+    break;
+  case ARRAY_TYPE_UINT16:
+    bias = _mm_set1_epi16(-32768);
+    break;
+  case ARRAY_TYPE_UINT32:
+    bias = _mm_set1_epi32(INT32_MIN);
+    break;
+  default:
+    bias = _mm_setzero_si128();
+    break;
+  }
+
+  auto result = _mm_xor_si128(
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(a)), bias);
+  size_t offset = 16;
+  for (; offset + 16 <= n_bytes; offset += 16) {
+    auto v = _mm_xor_si128(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + offset)), bias);
+    switch (elf_array_type_get_size(type)) {
+    case 1:
+      result = is_max ? _mm_max_epu8(result, v) : _mm_min_epu8(result, v);
+      break;
+    case 2:
+      result = is_max ? _mm_max_epi16(result, v) : _mm_min_epi16(result, v);
+      break;
+    default: {
+      auto use_v =
+          is_max ? _mm_cmpgt_epi32(v, result) : _mm_cmpgt_epi32(result, v);
+      result = _mm_or_si128(_mm_and_si128(use_v, v),
+                            _mm_andnot_si128(use_v, result));
+      break;
+    }
+    }
+  }
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes),
+                   _mm_xor_si128(result, bias));
+
+  return offset;
+}
+
+__attribute__((target("avx2"))) static size_t
+minmax_avx2(ArrayType type, bool is_max, const uint8_t *a, size_t n_bytes,
+            uint8_t *lanes) {
+  if (n_bytes < 32)
+    return 0;
+
+  // There is no unsigned 64 bit comparison, so bias to signed
+  auto bias = type == ARRAY_TYPE_UINT64 ? _mm256_set1_epi64x(INT64_MIN)
+                                        : _mm256_setzero_si256();
+
+  auto result = _mm256_xor_si256(
+      _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a)), bias);
+  size_t offset = 32;
+  for (; offset + 32 <= n_bytes; offset += 32) {
+    auto v = _mm256_xor_si256(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + offset)),
+        bias);
+    switch (type) {
+    case ARRAY_TYPE_UINT8:
+      result =
+          is_max ? _mm256_max_epu8(result, v) : _mm256_min_epu8(result, v);
+      break;
+    case ARRAY_TYPE_INT8:
+      result =
+          is_max ? _mm256_max_epi8(result, v) : _mm256_min_epi8(result, v);
+      break;
+    case ARRAY_TYPE_UINT16:
+      result =
+          is_max ? _mm256_max_epu16(result, v) : _mm256_min_epu16(result, v);
+      break;
+    case ARRAY_TYPE_INT16:
+      result =
+          is_max ? _mm256_max_epi16(result, v) : _mm256_min_epi16(result, v);
+      break;
+    case ARRAY_TYPE_UINT32:
+      result =
+          is_max ? _mm256_max_epu32(result, v) : _mm256_min_epu32(result, v);
+      break;
+    case ARRAY_TYPE_INT32:
+      result =
+          is_max ? _mm256_max_epi32(result, v) : _mm256_min_epi32(result, v);
+      break;
+    case ARRAY_TYPE_UINT64:
+    case ARRAY_TYPE_INT64: {
+      auto use_v = is_max ? _mm256_cmpgt_epi64(v, result)
+                          : _mm256_cmpgt_epi64(result, v);
+      result = _mm256_blendv_epi8(result, v, use_v);
+      break;
+    }
+    }
+  }
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes),
+                      _mm256_xor_si256(result, bias));
+
+  return offset;
+}
+
+#endif
+
+static void add(ArrayType type, bool subtract, void *a, const void *b,
+                size_t length) {
+  auto element_size = elf_array_type_get_size(type);
+  auto n_bytes = length * element_size;
+  auto a_data = static_cast<uint8_t *>(a);
+  auto b_data = static_cast<const uint8_t *>(b);
+
+  size_t offset = 0;
+#if defined(__x86_64__)
+  if (have_avx2())
+    offset += add_avx2(element_size, subtract, a_data, b_data, n_bytes);
+  offset += add_sse2(element_size, subtract, a_data + offset, b_data + offset,
+                     n_bytes - offset);
+#endif
+
+  auto n_remaining = (n_bytes - offset) / element_size;
+  switch (element_size) {
+  case 1:
+    add_scalar(subtract, a_data + offset, b_data + offset, n_remaining);
+    break;
+  case 2:
+    add_scalar(subtract, reinterpret_cast<uint16_t *>(a_data + offset),
+               reinterpret_cast<const uint16_t *>(b_data + offset),
+               n_remaining);
+    break;
+  case 4:
+    add_scalar(subtract, reinterpret_cast<uint32_t *>(a_data + offset),
+               reinterpret_cast<const uint32_t *>(b_data + offset),
+               n_remaining);
+    break;
+  case 8:
+    add_scalar(subtract, reinterpret_cast<uint64_t *>(a_data + offset),
+               reinterpret_cast<const uint64_t *>(b_data + offset),
+               n_remaining);
+    break;
+  }
+}
+
+void elf_array_add(ArrayType type, void *a, const void *b, size_t length) {
+  add(type, false, a, b, length);
+}
+
+void elf_array_subtract(ArrayType type, void *a, const void *b,
+                        size_t length) {
+  add(type, true, a, b, length);
+}
+
+void elf_array_fill(ArrayType type, void *a, const void *value,
+                    size_t length) {
+  auto element_size = elf_array_type_get_size(type);
+  auto n_bytes = length * element_size;
+  auto data = static_cast<uint8_t *>(a);
+
+  // Value repeated to fill a vector register
+  uint8_t pattern[32];
+  for (size_t i = 0; i < 32; i += element_size)
+    memcpy(pattern + i, value, element_size);
+
+  size_t offset = 0;
+#if defined(__x86_64__)
+  if (have_avx2())
+    offset += fill_avx2(data, pattern, n_bytes);
+  offset += fill_sse2(data + offset, pattern, n_bytes - offset);
+#endif
+
+  for (; offset < n_bytes; offset += element_size)
+    memcpy(data + offset, value, element_size);
+}
+
+bool elf_array_equal(ArrayType type, const void *a, const void *b,
+                     size_t length) {
+  auto n_bytes = length * elf_array_type_get_size(type);
+  auto a_data = static_cast<const uint8_t *>(a);
+  auto b_data = static_cast<const uint8_t *>(b);
+
+  size_t offset = 0;
+#if defined(__x86_64__)
+  if (have_avx2() && !equal_avx2(a_data, b_data, n_bytes, &offset))
+    return false;
+  if (!equal_sse2(a_data, b_data, n_bytes, &offset))
+    return false;
+#endif
+
+  return offset == n_bytes ||
+         memcmp(a_data + offset, b_data + offset, n_bytes - offset) == 0;
+}
+
+uint64_t elf_array_sum(ArrayType type, const void *a, size_t length) {
+  auto element_size = elf_array_type_get_size(type);
+  auto n_bytes = length * element_size;
+  auto data = static_cast<const uint8_t *>(a);
+
+  uint64_t sum = 0;
+  size_t offset = 0;
+#if defined(__x86_64__)
+  if (have_avx2())
+    offset += sum_avx2(type, data, n_bytes, &sum);
+  offset += sum_sse2(type, data + offset, n_bytes - offset, &sum);
+#endif
+
+  auto remaining = data + offset;
+  auto n_remaining = (n_bytes - offset) / element_size;
+  switch (type) {
+  case ARRAY_TYPE_UINT8:
+    return sum + sum_scalar(remaining, n_remaining);
+  case ARRAY_TYPE_INT8:
+    return sum + sum_scalar(reinterpret_cast<const int8_t *>(remaining),
+                            n_remaining);
+  case ARRAY_TYPE_UINT16:
+    return sum + sum_scalar(reinterpret_cast<const uint16_t *>(remaining),
+                            n_remaining);
+  case ARRAY_TYPE_INT16:
+    return sum + sum_scalar(reinterpret_cast<const int16_t *>(remaining),
+                            n_remaining);
+  case ARRAY_TYPE_UINT32:
+    return sum + sum_scalar(reinterpret_cast<const uint32_t *>(remaining),
+                            n_remaining);
+  case ARRAY_TYPE_INT32:
+    return sum + sum_scalar(reinterpret_cast<const int32_t *>(remaining),
+                            n_remaining);
+  case ARRAY_TYPE_UINT64:
+    return sum + sum_scalar(reinterpret_cast<const uint64_t *>(remaining),
+                            n_remaining);
+  case ARRAY_TYPE_INT64:
+    return sum + sum_scalar(reinterpret_cast<const int64_t *>(remaining),
+                            n_remaining);
+  }
+
+  return sum;
+}
+
+template <typename T>
+static void minmax_lanes(bool is_max, const uint8_t *lanes,
+                          size_t n_lane_bytes, const uint8_t *remaining,
+                          size_t n_remaining, void *result) {
+  T value;
+  memcpy(&value, n_lane_bytes > 0 ? lanes : remaining, sizeof(T));
+  minmax_scalar(is_max, reinterpret_cast<const T *>(lanes),
+                n_lane_bytes / sizeof(T), &value);
+  minmax_scalar(is_max, reinterpret_cast<const T *>(remaining), n_remaining,
+                &value);
+  memcpy(result, &value, sizeof(T));
+}
+
+static void minmax(ArrayType type, bool is_max, const void *a, size_t length,
+                   void *result) {
+  auto element_size = elf_array_type_get_size(type);
+  auto n_bytes = length * element_size;
+  auto data = static_cast<const uint8_t *>(a);
+
+  // Smallest / largest values found in each SIMD lane
+  alignas(32) uint8_t lanes[32];
+  size_t n_lane_bytes = 0;
+
+  size_t offset = 0;
+#if defined(__x86_64__)
+  if (have_avx2()) {
+    offset = minmax_avx2(type, is_max, data, n_bytes, lanes);
+    n_lane_bytes = offset > 0 ? 32 : 0;
+  }
+  if (offset == 0) {
+    offset = minmax_sse2(type, is_max, data, n_bytes, lanes);
+    n_lane_bytes = offset > 0 ? 16 : 0;
+  }
+#endif
+
+  auto remaining = data + offset;
+  auto n_remaining = (n_bytes - offset) / element_size;
+  switch (type) {
+  case ARRAY_TYPE_UINT8:
+    minmax_lanes<uint8_t>(is_max, lanes, n_lane_bytes, remaining, n_remaining,
+                           result);
+    break;
+  case ARRAY_TYPE_INT8:
+    minmax_lanes<int8_t>(is_max, lanes, n_lane_bytes, remaining, n_remaining,
+                          result);
+    break;
+  case ARRAY_TYPE_UINT16:
+    minmax_lanes<uint16_t>(is_max, lanes, n_lane_bytes, remaining,
+                            n_remaining, result);
+    break;
+  case ARRAY_TYPE_INT16:
+    minmax_lanes<int16_t>(is_max, lanes, n_lane_bytes, remaining, n_remaining,
+                           result);
+    break;
+  case ARRAY_TYPE_UINT32:
+    minmax_lanes<uint32_t>(is_max, lanes, n_lane_bytes, remaining,
+                            n_remaining, result);
+    break;
+  case ARRAY_TYPE_INT32:
+    minmax_lanes<int32_t>(is_max, lanes, n_lane_bytes, remaining, n_remaining,
+                           result);
+    break;
+  case ARRAY_TYPE_UINT64:
+    minmax_lanes<uint64_t>(is_max, lanes, n_lane_bytes, remaining,
+                            n_remaining, result);
+    break;
+  case ARRAY_TYPE_INT64:
+    minmax_lanes<int64_t>(is_max, lanes, n_lane_bytes, remaining, n_remaining,
+                           result);
+    break;
+  }
+}
+
+void elf_array_min(ArrayType type, const void *a, size_t length,
+                   void *result) {
+  minmax(type, false, a, length, result);
+}
+
+void elf_array_max(ArrayType type, const void *a, size_t length,
+                   void *result) {
+  minmax(type, true, a, length, result);
+}
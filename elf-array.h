@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2020 Robert Ancell.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef enum {
+  ARRAY_TYPE_UINT8,
+  ARRAY_TYPE_INT8,
+  ARRAY_TYPE_UINT16,
+  ARRAY_TYPE_INT16,
+  ARRAY_TYPE_UINT32,
+  ARRAY_TYPE_INT32,
+  ARRAY_TYPE_UINT64,
+  ARRAY_TYPE_INT64,
+} ArrayType;
+
+size_t elf_array_type_get_size(ArrayType type);
+
+bool elf_array_type_is_signed(ArrayType type);
+
+// a[i] += b[i], wrapping on overflow
+void elf_array_add(ArrayType type, void *a, const void *b, size_t length);
+
+// a[i] -= b[i], wrapping on overflow
+void elf_array_subtract(ArrayType type, void *a, const void *b, size_t length);
+
+// Set all elements to the value pointed to by value
+void elf_array_fill(ArrayType type, void *a, const void *value, size_t length);
+
+bool elf_array_equal(ArrayType type, const void *a, const void *b,
+                     size_t length);
+
+// Sum of all elements, wrapping on overflow. Signed results are returned as
+// their two's complement bits
+uint64_t elf_array_sum(ArrayType type, const void *a, size_t length);
+
+// Smallest / largest element is written to result, length must be non-zero
+void elf_array_min(ArrayType type, const void *a, size_t length, void *result);
+
+void elf_array_max(ArrayType type, const void *a, size_t length, void *result);
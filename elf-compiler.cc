@@ -0,0 +1,430 @@
+/*
+ * Copyright (C) 2020 Robert Ancell.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <elf.h>
+#include <string.h>
+
+#include "elf-ir.h"
+#include "elf-lang.h"
+#include "elf-mir.h"
+#include "elf-operation.h"
+#include "x86_64.h"
+
+static size_t append(std::vector<uint8_t> &binary, const void *data,
+                     size_t length) {
+  auto bytes = static_cast<const uint8_t *>(data);
+  binary.insert(binary.end(), bytes, bytes + length);
+  return length;
+}
+
+static void write_binary(std::vector<uint8_t> &binary,
+                         std::vector<uint8_t> &text,
+                         std::vector<uint8_t> &rodata) {
+  const char *section_names[] = {"", ".shrtrtab", ".text", ".rodata", NULL};
+  size_t shrtrtab_length = 0;
+  for (int i = 0; section_names[i] != NULL; i++)
+    shrtrtab_length += strlen(section_names[i]) + 1;
+
+  char padding[16] = {0};
+  size_t text_padding_length = text.size() % 16;
+  if (text_padding_length > 0)
+    text_padding_length = 16 - text_padding_length;
+  size_t rodata_padding_length = rodata.size() % 16;
+  if (rodata_padding_length > 0)
+    rodata_padding_length = 16 - rodata_padding_length;
+  size_t shrtrtab_padding_length = shrtrtab_length % 16;
+  if (shrtrtab_padding_length > 0)
+    shrtrtab_padding_length = 16 - shrtrtab_padding_length;
+
+  Elf64_Ehdr elf_header = {0};
+  elf_header.e_ident[EI_MAG0] = ELFMAG0;
+  elf_header.e_ident[EI_MAG1] = ELFMAG1;
+  elf_header.e_ident[EI_MAG2] = ELFMAG2;
+  elf_header.e_ident[EI_MAG3] = ELFMAG3;
+  elf_header.e_ident[EI_CLASS] = ELFCLASS64;
+  elf_header.e_ident[EI_DATA] = ELFDATA2LSB;
+  elf_header.e_ident[EI_VERSION] = EV_CURRENT;
+  elf_header.e_type = ET_EXEC;
+  elf_header.e_machine = EM_X86_64;
+  elf_header.e_version = EV_CURRENT;
+  elf_header.e_entry = 0x8000000 + sizeof(Elf64_Ehdr) + sizeof(Elf64_Phdr);
+  elf_header.e_phoff = sizeof(elf_header);
+  elf_header.e_shoff = sizeof(Elf64_Ehdr) + sizeof(Elf64_Phdr) + text.size() +
+                       text_padding_length + rodata.size() +
+                       rodata_padding_length + shrtrtab_length +
+                       shrtrtab_padding_length;
+  elf_header.e_ehsize = sizeof(Elf64_Ehdr);
+  elf_header.e_phentsize = sizeof(Elf64_Phdr);
+  elf_header.e_phnum = 1;
+  elf_header.e_shentsize = sizeof(Elf64_Shdr);
+  elf_header.e_shnum = 4;    // Matches length of section_names
+  elf_header.e_shstrndx = 3; // ".shrtrtab" from section header table
+
+  ssize_t n_written = 0;
+  n_written += append(binary, &elf_header, sizeof(elf_header));
+
+  Elf64_Phdr program_header = {0};
+  program_header.p_type = PT_LOAD;
+  program_header.p_flags = PF_R | PF_X;
+  program_header.p_offset = 0;
+  program_header.p_vaddr = 0x8000000;
+  program_header.p_paddr = 0x8000000;
+  program_header.p_filesz = sizeof(Elf64_Ehdr) + sizeof(Elf64_Phdr) +
+                            text.size() + text_padding_length + rodata.size() +
+                            rodata_padding_length;
+  program_header.p_memsz = program_header.p_filesz;
+
+  n_written += append(binary, &program_header, sizeof(program_header));
+
+  ssize_t text_offset = n_written;
+  n_written += append(binary, text.data(), text.size());
+  n_written += append(binary, padding, text_padding_length);
+
+  ssize_t rodata_offset = n_written;
+  n_written += append(binary, rodata.data(), rodata.size());
+  n_written += append(binary, padding, rodata_padding_length);
+
+  ssize_t shrtrtab_offset = n_written;
+  ssize_t null_name_offset = n_written - shrtrtab_offset;
+  n_written += append(binary, section_names[0], strlen(section_names[0]) + 1);
+  ssize_t shrtrtab_name_offset = n_written - shrtrtab_offset;
+  n_written += append(binary, section_names[1], strlen(section_names[1]) + 1);
+  ssize_t text_name_offset = n_written - shrtrtab_offset;
+  n_written += append(binary, section_names[2], strlen(section_names[2]) + 1);
+  ssize_t rodata_name_offset = n_written - shrtrtab_offset;
+  n_written += append(binary, section_names[3], strlen(section_names[3]) + 1);
+  n_written += append(binary, padding, shrtrtab_padding_length);
+
+  Elf64_Shdr null_section_header = {0};
+  null_section_header.sh_name = null_name_offset;
+  null_section_header.sh_type = SHT_NULL;
+  n_written +=
+      append(binary, &null_section_header, sizeof(null_section_header));
+
+  Elf64_Shdr text_section_header = {0};
+  text_section_header.sh_name = text_name_offset;
+  text_section_header.sh_type = SHT_PROGBITS;
+  text_section_header.sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+  text_section_header.sh_addr = 0x8000000 + text_offset;
+  text_section_header.sh_offset = text_offset;
+  text_section_header.sh_size = text.size();
+  n_written +=
+      append(binary, &text_section_header, sizeof(text_section_header));
+
+  Elf64_Shdr rodata_section_header = {0};
+  rodata_section_header.sh_name = rodata_name_offset;
+  rodata_section_header.sh_type = SHT_PROGBITS;
+  rodata_section_header.sh_flags = SHF_ALLOC;
+  rodata_section_header.sh_addr = 0x80000000 + rodata_offset;
+  rodata_section_header.sh_offset = rodata_offset;
+  rodata_section_header.sh_size = rodata.size();
+  n_written +=
+      append(binary, &rodata_section_header, sizeof(rodata_section_header));
+
+  Elf64_Shdr shrtrtab_section_header = {0};
+  shrtrtab_section_header.sh_name = shrtrtab_name_offset;
+  shrtrtab_section_header.sh_type = SHT_STRTAB;
+  shrtrtab_section_header.sh_offset = shrtrtab_offset;
+  shrtrtab_section_header.sh_size = shrtrtab_length;
+  n_written += append(binary, &shrtrtab_section_header,
+                      sizeof(shrtrtab_section_header));
+}
+
+// Gets the condition to jump on for a comparison, or when it's false
+static int get_jump_condition(IrOpcode opcode, bool is_signed, bool negate) {
+  switch (opcode) {
+  case IR_OPCODE_EQUAL:
+    return negate ? X86_64_COND_NOT_EQUAL : X86_64_COND_EQUAL;
+  case IR_OPCODE_NOT_EQUAL:
+    return negate ? X86_64_COND_EQUAL : X86_64_COND_NOT_EQUAL;
+  case IR_OPCODE_LESS:
+    if (is_signed)
+      return negate ? X86_64_COND_GREATER_EQUAL : X86_64_COND_LESS;
+    return negate ? X86_64_COND_ABOVE_EQUAL : X86_64_COND_BELOW;
+  case IR_OPCODE_LESS_EQUAL:
+    if (is_signed)
+      return negate ? X86_64_COND_GREATER : X86_64_COND_LESS_EQUAL;
+    return negate ? X86_64_COND_ABOVE : X86_64_COND_BELOW_EQUAL;
+  case IR_OPCODE_GREATER:
+    if (is_signed)
+      return negate ? X86_64_COND_LESS_EQUAL : X86_64_COND_GREATER;
+    return negate ? X86_64_COND_BELOW_EQUAL : X86_64_COND_ABOVE;
+  case IR_OPCODE_GREATER_EQUAL:
+    if (is_signed)
+      return negate ? X86_64_COND_LESS : X86_64_COND_GREATER_EQUAL;
+    return negate ? X86_64_COND_BELOW : X86_64_COND_ABOVE_EQUAL;
+  default:
+    return -1;
+  }
+}
+
+// Converts SSA code to machine level code. Each value gets its own virtual
+// register, and phis become copies at the end of the blocks that lead to them
+struct MirLowering {
+  IrFunction &ir;
+  MirFunction function;
+
+  // Virtual register holding each value, or -1 if not assigned yet
+  std::vector<int> registers;
+
+  // Instruction setting each value
+  std::vector<IrInstruction *> definitions;
+
+  int n_stubs;
+
+  // What couldn't be lowered
+  std::string error;
+
+  MirLowering(IrFunction &ir)
+      : ir(ir), registers(ir.value_types.size(), -1),
+        definitions(ir.value_types.size(), nullptr), n_stubs(0) {}
+
+  std::string get_label(int block) { return "B" + std::to_string(block); }
+
+  int get_register(int value) {
+    if (registers[value] < 0)
+      registers[value] = function.add_register();
+    return registers[value];
+  }
+
+  bool has_phis(int block) {
+    auto &instructions = ir.blocks[block].instructions;
+    return !instructions.empty() &&
+           instructions.front().opcode == IR_OPCODE_PHI;
+  }
+
+  bool lower();
+  bool lower_instruction(int block, IrInstruction &instruction);
+  void write_phi_copies(int from, int to);
+  void write_jump(int from, int to);
+};
+
+bool MirLowering::lower() {
+  for (auto block = ir.blocks.begin(); block != ir.blocks.end(); block++)
+    for (auto i = block->instructions.begin(); i != block->instructions.end();
+         i++)
+      if (i->dest >= 0)
+        definitions[i->dest] = &*i;
+
+  for (size_t i = 0; i < ir.blocks.size(); i++) {
+    function.add_label(get_label(i));
+    auto &instructions = ir.blocks[i].instructions;
+    for (auto j = instructions.begin(); j != instructions.end(); j++)
+      if (!lower_instruction(i, *j))
+        return false;
+  }
+
+  return true;
+}
+
+bool MirLowering::lower_instruction(int block, IrInstruction &instruction) {
+  auto data_type =
+      instruction.dest >= 0 ? ir.value_types[instruction.dest] : "";
+
+  switch (instruction.opcode) {
+  case IR_OPCODE_CONSTANT:
+    // Conditions are only used by branches, which check them directly
+    if (data_type != "bool")
+      function.add_constant(get_register(instruction.dest), instruction.value);
+    return true;
+  case IR_OPCODE_ADD:
+  case IR_OPCODE_SUBTRACT:
+  case IR_OPCODE_MULTIPLY: {
+    auto opcode = MIR_OPCODE_MULTIPLY;
+    if (instruction.opcode == IR_OPCODE_ADD)
+      opcode = MIR_OPCODE_ADD;
+    else if (instruction.opcode == IR_OPCODE_SUBTRACT)
+      opcode = MIR_OPCODE_SUBTRACT;
+    function.add_binary(opcode, get_register(instruction.dest),
+                        get_register(instruction.operands[0]),
+                        get_register(instruction.operands[1]));
+    return true;
+  }
+  case IR_OPCODE_EQUAL:
+  case IR_OPCODE_NOT_EQUAL:
+  case IR_OPCODE_LESS:
+  case IR_OPCODE_LESS_EQUAL:
+  case IR_OPCODE_GREATER:
+  case IR_OPCODE_GREATER_EQUAL:
+    return true;
+  case IR_OPCODE_PHI:
+    if (data_type == "bool") {
+      error = "bool values that depend on control flow";
+      return false;
+    }
+    return true;
+  case IR_OPCODE_JUMP:
+    write_jump(block, instruction.blocks[0]);
+    return true;
+  case IR_OPCODE_BRANCH: {
+    auto condition = definitions[instruction.operands[0]];
+    if (condition->opcode == IR_OPCODE_CONSTANT) {
+      write_jump(block, instruction.blocks[condition->value ? 0 : 1]);
+      return true;
+    }
+
+    auto is_signed =
+        data_type_is_signed(ir.value_types[condition->operands[0]]);
+    auto jump_condition =
+        get_jump_condition(condition->opcode, is_signed, true);
+    if (jump_condition < 0) {
+      error = "conditions that aren't comparisons";
+      return false;
+    }
+
+    auto a = get_register(condition->operands[0]);
+    auto b = get_register(condition->operands[1]);
+    auto true_block = instruction.blocks[0];
+    auto false_block = instruction.blocks[1];
+    if (!has_phis(false_block)) {
+      function.add_jump_if(a, jump_condition, b, get_label(false_block));
+      write_jump(block, true_block);
+      return true;
+    }
+
+    // Phi copies for the false path go in a stub so they're only done when
+    // that path is taken
+    auto stub_label = "S" + std::to_string(n_stubs++);
+    function.add_jump_if(a, jump_condition, b, stub_label);
+    write_phi_copies(block, true_block);
+    function.add_jump(get_label(true_block));
+    function.add_label(stub_label);
+    write_jump(block, false_block);
+    return true;
+  }
+  case IR_OPCODE_EXIT:
+    function.add_exit(get_register(instruction.operands[0]));
+    return true;
+  case IR_OPCODE_PRINT: {
+    auto value = instruction.operands[0];
+    function.add_print(get_register(value),
+                       data_type_is_signed(ir.value_types[value]));
+    return true;
+  }
+  }
+
+  error = "IR instruction " + std::to_string(instruction.opcode);
+  return false;
+}
+
+// Sets the phis in a block to the values coming from the given block. The
+// copies are done at the same time, so if a phi uses another phi's value they
+// go through temporary registers
+void MirLowering::write_phi_copies(int from, int to) {
+  std::vector<std::pair<int, int>> copies;
+  auto &instructions = ir.blocks[to].instructions;
+  for (auto i = instructions.begin();
+       i != instructions.end() && i->opcode == IR_OPCODE_PHI; i++) {
+    for (size_t j = 0; j < i->blocks.size(); j++) {
+      if (i->blocks[j] != from)
+        continue;
+      auto dest = get_register(i->dest);
+      auto source = get_register(i->operands[j]);
+      if (dest != source)
+        copies.push_back(std::make_pair(dest, source));
+      break;
+    }
+  }
+
+  bool overlaps = false;
+  for (auto i = copies.begin(); i != copies.end(); i++)
+    for (auto j = copies.begin(); j != copies.end(); j++)
+      if (i != j && i->second == j->first)
+        overlaps = true;
+
+  if (overlaps) {
+    std::vector<int> temporaries;
+    for (auto i = copies.begin(); i != copies.end(); i++) {
+      temporaries.push_back(function.add_register());
+      function.add_copy(temporaries.back(), i->second);
+    }
+    for (size_t i = 0; i < copies.size(); i++)
+      function.add_copy(copies[i].first, temporaries[i]);
+  } else {
+    for (auto i = copies.begin(); i != copies.end(); i++)
+      function.add_copy(i->first, i->second);
+  }
+}
+
+// Blocks are written in order, so no jump is needed to the next one
+void MirLowering::write_jump(int from, int to) {
+  write_phi_copies(from, to);
+  if (to != from + 1)
+    function.add_jump(get_label(to));
+}
+
+static bool lower_to_mir(IrFunction &ir, MirFunction &function,
+                         std::string &error) {
+  MirLowering lowering(ir);
+  if (!lowering.lower()) {
+    error = lowering.error;
+    return false;
+  }
+  function = lowering.function;
+  return true;
+}
+
+static void write_unsupported(ElfOutput &errors, const std::string &error) {
+  auto message = "Can't compile " + error + " yet\n";
+  errors.write(message.data(), message.size());
+}
+
+static std::shared_ptr<IrFunction>
+build_ir(std::shared_ptr<OperationModule> module,
+         const ElfCompileOptions &options, ElfOutput &errors) {
+  std::string error;
+  auto function = ir_build_module(module.get(), error);
+  if (function == nullptr) {
+    write_unsupported(errors, error);
+    return nullptr;
+  }
+  if (options.optimize) {
+    IrPassManager passes;
+    ir_add_default_passes(passes);
+    passes.run(*function);
+  }
+  return function;
+}
+
+bool elf_get_ir(std::shared_ptr<OperationModule> module,
+                const ElfCompileOptions &options, std::string &text,
+                ElfOutput &errors) {
+  auto function = build_ir(module, options, errors);
+  if (function == nullptr)
+    return false;
+  text = ir_function_to_string(*function);
+  return true;
+}
+
+bool elf_compile(std::shared_ptr<OperationModule> module,
+                 std::vector<uint8_t> &binary, ElfOutput &errors,
+                 const ElfCompileOptions &options) {
+  auto function = build_ir(module, options, errors);
+  if (function == nullptr)
+    return false;
+  MirFunction mir;
+  std::string error;
+  if (!lower_to_mir(*function, mir, error)) {
+    write_unsupported(errors, error);
+    return false;
+  }
+
+  CodeBuffer text;
+  std::vector<int> registers;
+  if (options.allocate_registers)
+    registers = mir_get_allocatable_registers();
+  MirAllocation allocation;
+  mir_allocate_registers(mir, registers, allocation);
+  mir_write_x86_64(mir, allocation, text);
+  std::vector<uint8_t> rodata;
+  rodata.push_back(0x00);
+  write_binary(binary, text.data, rodata);
+
+  return true;
+}
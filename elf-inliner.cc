@@ -0,0 +1,276 @@
+/*
+ * Copyright (C) 2020 Robert Ancell.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <map>
+#include <set>
+
+#include "elf-lang.h"
+#include "elf-operation.h"
+#include "elf-reachability.h"
+
+static bool is_inline_type(const std::string &data_type) {
+  return data_type == "bool" || data_type == "uint8" || data_type == "int8" ||
+         data_type == "uint16" || data_type == "int16" ||
+         data_type == "uint32" || data_type == "int32" ||
+         data_type == "uint64" || data_type == "int64";
+}
+
+// Gets the number of operations in an expression that only reads values, or 0
+// if it has other operations, e.g. calls
+static size_t get_expression_size(Operation *operation) {
+  if (dynamic_cast<OperationNumberConstant *>(operation) != nullptr ||
+      dynamic_cast<OperationTrue *>(operation) != nullptr ||
+      dynamic_cast<OperationFalse *>(operation) != nullptr)
+    return 1;
+
+  auto symbol = dynamic_cast<OperationSymbol *>(operation);
+  if (symbol != nullptr)
+    return dynamic_cast<OperationVariableDefinition *>(
+               symbol->definition.get()) != nullptr
+               ? 1
+               : 0;
+
+  auto unary = dynamic_cast<OperationUnary *>(operation);
+  if (unary != nullptr) {
+    auto size = get_expression_size(unary->value.get());
+    return size > 0 ? size + 1 : 0;
+  }
+
+  auto binary = dynamic_cast<OperationBinary *>(operation);
+  if (binary != nullptr) {
+    auto a_size = get_expression_size(binary->a.get());
+    auto b_size = get_expression_size(binary->b.get());
+    return a_size > 0 && b_size > 0 ? a_size + b_size + 1 : 0;
+  }
+
+  auto convert = dynamic_cast<OperationConvert *>(operation);
+  if (convert != nullptr) {
+    auto size = get_expression_size(convert->op.get());
+    return size > 0 ? size + 1 : 0;
+  }
+
+  return 0;
+}
+
+// Checks an expression from get_expression_size() only reads the given
+// variables. Variables are looked up by name when run, so an inlined
+// expression can't refer to any others
+static bool only_uses(Operation *operation, std::set<Operation *> &variables) {
+  auto symbol = dynamic_cast<OperationSymbol *>(operation);
+  if (symbol != nullptr)
+    return variables.find(symbol->definition.get()) != variables.end();
+  auto unary = dynamic_cast<OperationUnary *>(operation);
+  if (unary != nullptr)
+    return only_uses(unary->value.get(), variables);
+  auto binary = dynamic_cast<OperationBinary *>(operation);
+  if (binary != nullptr)
+    return only_uses(binary->a.get(), variables) &&
+           only_uses(binary->b.get(), variables);
+  auto convert = dynamic_cast<OperationConvert *>(operation);
+  if (convert != nullptr)
+    return only_uses(convert->op.get(), variables);
+  return true;
+}
+
+// Copies an expression from get_expression_size(), replacing parameters with
+// the values passed for them. Constants aren't modified so they are shared
+static std::shared_ptr<Operation>
+substitute(std::shared_ptr<Operation> &operation,
+           std::map<Operation *, std::shared_ptr<Operation>> &arguments) {
+  auto symbol = std::dynamic_pointer_cast<OperationSymbol>(operation);
+  if (symbol != nullptr) {
+    auto argument = arguments.find(symbol->definition.get());
+    return argument != arguments.end() ? argument->second : operation;
+  }
+
+  auto unary = std::dynamic_pointer_cast<OperationUnary>(operation);
+  if (unary != nullptr)
+    return std::make_shared<OperationUnary>(
+        unary->op, substitute(unary->value, arguments));
+
+  auto binary = std::dynamic_pointer_cast<OperationBinary>(operation);
+  if (binary != nullptr)
+    return std::make_shared<OperationBinary>(
+        binary->op, substitute(binary->a, arguments),
+        substitute(binary->b, arguments));
+
+  auto convert = std::dynamic_pointer_cast<OperationConvert>(operation);
+  if (convert != nullptr) {
+    auto op = substitute(convert->op, arguments);
+    return std::make_shared<OperationConvert>(op, convert->data_type);
+  }
+
+  return operation;
+}
+
+// Replaces calls to functions that only return a small expression of their
+// parameters with that expression
+struct Inliner {
+  size_t threshold;
+
+  // Expression each function returns, or nullptr if it can't be inlined
+  std::map<OperationFunctionDefinition *, std::shared_ptr<Operation>>
+      expressions;
+
+  // Functions having calls in them inlined, to stop recursion
+  std::set<OperationFunctionDefinition *> inlining;
+
+  Inliner(size_t threshold) : threshold(threshold) {}
+
+  std::shared_ptr<Operation>
+  get_inline_expression(OperationFunctionDefinition *function);
+  void inline_call(std::shared_ptr<Operation> &operation);
+  void inline_sequence(std::vector<std::shared_ptr<Operation>> &body) {
+    for (auto i = body.begin(); i != body.end(); i++)
+      inline_operation(*i);
+  }
+  void inline_operation(std::shared_ptr<Operation> &operation);
+};
+
+std::shared_ptr<Operation>
+Inliner::get_inline_expression(OperationFunctionDefinition *function) {
+  auto expression = expressions.find(function);
+  if (expression != expressions.end())
+    return expression->second;
+
+  // Lazily parsed bodies aren't known yet
+  if (function->body_source != nullptr ||
+      inlining.find(function) != inlining.end() ||
+      function->children.size() != 1)
+    return nullptr;
+  auto return_operation =
+      std::dynamic_pointer_cast<OperationReturn>(function->children[0]);
+  if (return_operation == nullptr || return_operation->value == nullptr)
+    return nullptr;
+
+  auto data_type = function->get_data_type();
+  if (!is_inline_type(data_type))
+    return nullptr;
+  std::set<Operation *> parameters;
+  for (auto i = function->parameters.begin(); i != function->parameters.end();
+       i++) {
+    if (!is_inline_type((*i)->get_data_type()))
+      return nullptr;
+    parameters.insert(i->get());
+  }
+
+  // Inline calls in the function first, so functions made of other small
+  // functions can be inlined too
+  inlining.insert(function);
+  inline_operation(return_operation->value);
+  inlining.erase(function);
+
+  std::shared_ptr<Operation> result;
+  auto size = get_expression_size(return_operation->value.get());
+  if (size > 0 && size <= threshold &&
+      return_operation->value->get_data_type() == data_type &&
+      only_uses(return_operation->value.get(), parameters))
+    result = return_operation->value;
+  expressions[function] = result;
+  return result;
+}
+
+void Inliner::inline_call(std::shared_ptr<Operation> &operation) {
+  auto call = std::dynamic_pointer_cast<OperationCall>(operation);
+  if (call == nullptr || call->function == nullptr)
+    return;
+  auto function = call->function.get();
+  auto expression = get_inline_expression(function);
+  if (expression == nullptr ||
+      call->parameters.size() != function->parameters.size())
+    return;
+
+  // Values are only read, so they are the same wherever they're evaluated.
+  // Types must match as values aren't converted when passed
+  std::map<Operation *, std::shared_ptr<Operation>> arguments;
+  for (size_t i = 0; i < call->parameters.size(); i++) {
+    auto &value = call->parameters[i];
+    auto &parameter = function->parameters[i];
+    if (get_expression_size(value.get()) == 0 ||
+        value->get_data_type() != parameter->get_data_type())
+      return;
+    arguments[parameter.get()] = value;
+  }
+
+  // Parameters used more than once copy their value
+  auto result = substitute(expression, arguments);
+  if (get_expression_size(result.get()) > threshold)
+    return;
+  operation = result;
+}
+
+void Inliner::inline_operation(std::shared_ptr<Operation> &operation) {
+  if (operation == nullptr)
+    return;
+
+  auto variable_definition =
+      std::dynamic_pointer_cast<OperationVariableDefinition>(operation);
+  if (variable_definition != nullptr)
+    inline_operation(variable_definition->value);
+  auto assignment = std::dynamic_pointer_cast<OperationAssignment>(operation);
+  if (assignment != nullptr) {
+    inline_operation(assignment->target);
+    inline_operation(assignment->value);
+  }
+  auto if_operation = std::dynamic_pointer_cast<OperationIf>(operation);
+  if (if_operation != nullptr)
+    inline_operation(if_operation->condition);
+  auto while_operation = std::dynamic_pointer_cast<OperationWhile>(operation);
+  if (while_operation != nullptr)
+    inline_operation(while_operation->condition);
+  auto call = std::dynamic_pointer_cast<OperationCall>(operation);
+  if (call != nullptr)
+    inline_sequence(call->parameters);
+  auto return_operation = std::dynamic_pointer_cast<OperationReturn>(operation);
+  if (return_operation != nullptr)
+    inline_operation(return_operation->value);
+  auto assert_operation = std::dynamic_pointer_cast<OperationAssert>(operation);
+  if (assert_operation != nullptr)
+    inline_operation(assert_operation->expression);
+  auto array_constant =
+      std::dynamic_pointer_cast<OperationArrayConstant>(operation);
+  if (array_constant != nullptr)
+    inline_sequence(array_constant->values);
+  auto index = std::dynamic_pointer_cast<OperationIndex>(operation);
+  if (index != nullptr) {
+    inline_operation(index->value);
+    inline_operation(index->index);
+  }
+  auto member = std::dynamic_pointer_cast<OperationMember>(operation);
+  if (member != nullptr)
+    inline_operation(member->value);
+  auto unary = std::dynamic_pointer_cast<OperationUnary>(operation);
+  if (unary != nullptr)
+    inline_operation(unary->value);
+  auto binary = std::dynamic_pointer_cast<OperationBinary>(operation);
+  if (binary != nullptr) {
+    inline_operation(binary->a);
+    inline_operation(binary->b);
+  }
+  auto convert = std::dynamic_pointer_cast<OperationConvert>(operation);
+  if (convert != nullptr)
+    inline_operation(convert->op);
+
+  // Else blocks are also children of the statements they're in
+  inline_sequence(operation->children);
+
+  inline_call(operation);
+}
+
+void elf_inline_functions(std::shared_ptr<OperationModule> module,
+                          size_t threshold) {
+  if (threshold == 0)
+    return;
+
+  Inliner inliner(threshold);
+  inliner.inline_sequence(module->children);
+
+  // Functions that were only called where they were inlined are now unused
+  elf_remove_unreachable_code(module.get());
+}
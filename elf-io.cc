@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2020 Robert Ancell.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "elf-io.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "elf-utf8.h"
+
+bool elf_read_fd(int fd, std::string &data) {
+  char buffer[65536];
+  while (true) {
+    auto n_read = read(fd, buffer, sizeof(buffer));
+    if (n_read < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    if (n_read == 0)
+      return true;
+    data.append(buffer, n_read);
+  }
+}
+
+std::string elf_json_escape(const std::string &text) {
+  std::string escaped;
+  size_t offset = 0;
+  while (offset < text.size()) {
+    unsigned char c = text[offset];
+    if (c >= 0x80) {
+      auto length = elf_utf8_get_sequence_length(text.data() + offset,
+                                                 text.size() - offset);
+      if (length == 0) {
+        escaped += "\\ufffd";
+        offset++;
+      } else {
+        escaped.append(text, offset, length);
+        offset += length;
+      }
+      continue;
+    }
+
+    if (c == '"')
+      escaped += "\\\"";
+    else if (c == '\\')
+      escaped += "\\\\";
+    else if (c == '\n')
+      escaped += "\\n";
+    else if (c == '\r')
+      escaped += "\\r";
+    else if (c == '\t')
+      escaped += "\\t";
+    else if (c < 0x20) {
+      char code[7];
+      snprintf(code, sizeof(code), "\\u%04x", c);
+      escaped += code;
+    } else
+      escaped += c;
+    offset++;
+  }
+  return escaped;
+}
@@ -0,0 +1,20 @@
+/*
+ * Copyright (C) 2020 Robert Ancell.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ */
+
+#pragma once
+
+#include <string>
+
+// Appends everything up to end of file to data. Returns false and leaves errno
+// set on failure
+bool elf_read_fd(int fd, std::string &data);
+
+// Escapes text for use in a JSON string. Invalid UTF-8 is replaced, as it
+// can't be represented in JSON
+std::string elf_json_escape(const std::string &text);
@@ -0,0 +1,832 @@
+/*
+ * Copyright (C) 2020 Robert Ancell.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <map>
+#include <set>
+
+#include "elf-ir.h"
+#include "elf-token.h"
+
+bool IrInstruction::is_terminator() {
+  return opcode == IR_OPCODE_JUMP || opcode == IR_OPCODE_BRANCH ||
+         opcode == IR_OPCODE_EXIT;
+}
+
+bool IrInstruction::has_side_effects() { return dest < 0; }
+
+int IrFunction::add_block() {
+  blocks.push_back(IrBlock());
+  return blocks.size() - 1;
+}
+
+int IrFunction::add_value(const std::string &data_type) {
+  value_types.push_back(data_type);
+  return value_types.size() - 1;
+}
+
+std::vector<int> IrFunction::get_successors(int block) {
+  auto &instructions = blocks[block].instructions;
+  if (instructions.empty() || !instructions.back().is_terminator())
+    return {};
+  return instructions.back().blocks;
+}
+
+void IrFunction::replace_uses(int value, int replacement) {
+  for (auto block = blocks.begin(); block != blocks.end(); block++)
+    for (auto i = block->instructions.begin(); i != block->instructions.end();
+         i++)
+      for (auto operand = i->operands.begin(); operand != i->operands.end();
+           operand++)
+        if (*operand == value)
+          *operand = replacement;
+}
+
+// Describes an operation that can't be compiled, e.g. "function calls"
+static std::string describe_operation(Operation *operation) {
+  auto call = dynamic_cast<OperationCall *>(operation);
+  if (call != nullptr) {
+    if (dynamic_cast<OperationPrintFunction *>(call->value.get()) != nullptr)
+      return "print";
+    if (call->array_method != nullptr)
+      return "array methods";
+    return "function calls";
+  }
+  auto variable_definition =
+      dynamic_cast<OperationVariableDefinition *>(operation);
+  if (variable_definition != nullptr)
+    return variable_definition->get_data_type() + " variables";
+  auto symbol = dynamic_cast<OperationSymbol *>(operation);
+  if (symbol != nullptr)
+    return "references to " + symbol->name->get_text();
+  auto unary = dynamic_cast<OperationUnary *>(operation);
+  if (unary != nullptr)
+    return "the unary " + unary->op->get_text() + " operator";
+  auto binary = dynamic_cast<OperationBinary *>(operation);
+  if (binary != nullptr)
+    return "the " + binary->op->get_text() + " operator";
+  auto convert = dynamic_cast<OperationConvert *>(operation);
+  if (convert != nullptr)
+    return "conversions to " + convert->data_type;
+  if (dynamic_cast<OperationTextConstant *>(operation) != nullptr)
+    return "text";
+  if (dynamic_cast<OperationArrayConstant *>(operation) != nullptr)
+    return "arrays";
+  if (dynamic_cast<OperationIndex *>(operation) != nullptr)
+    return "array indexing";
+  if (dynamic_cast<OperationMember *>(operation) != nullptr)
+    return "members";
+  if (dynamic_cast<OperationAssert *>(operation) != nullptr)
+    return "assert";
+  if (dynamic_cast<OperationReturn *>(operation) != nullptr)
+    return "return";
+  return operation->to_string();
+}
+
+// Builds SSA form directly from the operations, creating phi instructions when
+// a variable is read in a block it wasn't set in. See "Simple and Efficient
+// Construction of Static Single Assignment Form", Braun et al.
+struct IrBuilder {
+  std::shared_ptr<IrFunction> function;
+
+  // Block instructions are being added to
+  int block;
+
+  // Value of each variable at the end of each block it's set in
+  std::map<Operation *, std::map<int, int>> definitions;
+
+  // Phis added to blocks whose predecessors are not all known yet
+  std::map<int, std::map<Operation *, int>> incomplete_phis;
+  std::vector<bool> sealed;
+
+  // Phis that were removed and the value that replaced them
+  std::map<int, int> replacements;
+
+  // Phis having their operands added, which can't be removed until done
+  std::set<int> filling_phis;
+
+  // Set if a variable is read where it has no value
+  bool failed;
+
+  // What couldn't be built, the first problem found is reported
+  std::string error;
+
+  IrBuilder()
+      : function(std::make_shared<IrFunction>("main")), block(0),
+        failed(false) {
+    add_block();
+    seal_block(0);
+  }
+
+  bool is_supported_type(const std::string &data_type) {
+    return data_type == "uint64" || data_type == "int64";
+  }
+
+  bool set_unsupported(const std::string &description) {
+    if (error.empty())
+      error = description;
+    return false;
+  }
+
+  int add_block() {
+    sealed.push_back(false);
+    return function->add_block();
+  }
+
+  void add_edge(int from, int to) {
+    function->blocks[to].predecessors.push_back(from);
+  }
+
+  int add_instruction(IrInstruction &instruction,
+                      const std::string &data_type = "") {
+    if (!data_type.empty())
+      instruction.dest = function->add_value(data_type);
+    function->blocks[block].instructions.push_back(instruction);
+    return instruction.dest;
+  }
+
+  int add_constant(const std::string &data_type, uint64_t value) {
+    IrInstruction instruction(IR_OPCODE_CONSTANT);
+    instruction.value = value;
+    return add_instruction(instruction, data_type);
+  }
+
+  void add_jump(int target) {
+    IrInstruction instruction(IR_OPCODE_JUMP);
+    instruction.blocks.push_back(target);
+    add_instruction(instruction);
+    add_edge(block, target);
+  }
+
+  void add_exit(uint64_t status) {
+    IrInstruction instruction(IR_OPCODE_EXIT);
+    instruction.operands.push_back(add_constant("uint8", status));
+    add_instruction(instruction);
+  }
+
+  // Targets are set later with set_branch_target(), so blocks are numbered in
+  // the order their code is in
+  void add_branch(int condition) {
+    IrInstruction instruction(IR_OPCODE_BRANCH);
+    instruction.operands.push_back(condition);
+    instruction.blocks.assign(2, -1);
+    add_instruction(instruction);
+  }
+
+  void set_branch_target(int branch_block, int index, int target) {
+    function->blocks[branch_block].instructions.back().blocks[index] = target;
+    add_edge(branch_block, target);
+  }
+
+  int resolve(int value) {
+    auto replacement = replacements.find(value);
+    while (replacement != replacements.end()) {
+      value = replacement->second;
+      replacement = replacements.find(value);
+    }
+    return value;
+  }
+
+  IrInstruction *find_phi(int value, int *phi_block = nullptr);
+  int add_phi(int phi_block, Operation *variable);
+  void write_variable(Operation *variable, int variable_block, int value);
+  int read_variable(Operation *variable, int variable_block);
+  int add_phi_operands(Operation *variable, int phi);
+  int remove_trivial_phi(int phi);
+  void seal_block(int sealed_block);
+
+  bool build_sequence(std::vector<std::shared_ptr<Operation>> &body);
+  bool build_statement(std::shared_ptr<Operation> &operation);
+  int build_value(std::shared_ptr<Operation> &operation);
+};
+
+IrInstruction *IrBuilder::find_phi(int value, int *phi_block) {
+  for (size_t i = 0; i < function->blocks.size(); i++) {
+    auto &instructions = function->blocks[i].instructions;
+    for (auto j = instructions.begin(); j != instructions.end(); j++) {
+      if (j->opcode != IR_OPCODE_PHI)
+        break;
+      if (j->dest == value) {
+        if (phi_block != nullptr)
+          *phi_block = i;
+        return &*j;
+      }
+    }
+  }
+  return nullptr;
+}
+
+// Phis go before the other instructions in a block
+int IrBuilder::add_phi(int phi_block, Operation *variable) {
+  IrInstruction phi(IR_OPCODE_PHI);
+  phi.dest = function->add_value(variable->get_data_type());
+  auto &instructions = function->blocks[phi_block].instructions;
+  auto position = instructions.begin();
+  while (position != instructions.end() && position->opcode == IR_OPCODE_PHI)
+    position++;
+  instructions.insert(position, phi);
+  return phi.dest;
+}
+
+void IrBuilder::write_variable(Operation *variable, int variable_block,
+                               int value) {
+  definitions[variable][variable_block] = value;
+}
+
+int IrBuilder::read_variable(Operation *variable, int variable_block) {
+  auto &variable_definitions = definitions[variable];
+  auto definition = variable_definitions.find(variable_block);
+  if (definition != variable_definitions.end())
+    return resolve(definition->second);
+
+  int value;
+  auto &predecessors = function->blocks[variable_block].predecessors;
+  if (!sealed[variable_block]) {
+    value = add_phi(variable_block, variable);
+    incomplete_phis[variable_block][variable] = value;
+  } else if (predecessors.size() == 1)
+    value = read_variable(variable, predecessors[0]);
+  else if (predecessors.empty()) {
+    failed = true;
+    return add_constant(variable->get_data_type(), 0);
+  } else {
+    // Set before reading the predecessors to stop loops recursing forever
+    value = add_phi(variable_block, variable);
+    write_variable(variable, variable_block, value);
+    value = add_phi_operands(variable, value);
+  }
+  write_variable(variable, variable_block, value);
+  return value;
+}
+
+int IrBuilder::add_phi_operands(Operation *variable, int phi) {
+  int phi_block;
+  find_phi(phi, &phi_block);
+  auto predecessors = function->blocks[phi_block].predecessors;
+  filling_phis.insert(phi);
+  for (auto i = predecessors.begin(); i != predecessors.end(); i++) {
+    auto value = read_variable(variable, *i);
+    // Look up again, as reading may have added phis to this block
+    auto instruction = find_phi(phi);
+    instruction->operands.push_back(value);
+    instruction->blocks.push_back(*i);
+  }
+  filling_phis.erase(phi);
+  return remove_trivial_phi(phi);
+}
+
+// Removes a phi that only ever has one value
+int IrBuilder::remove_trivial_phi(int phi) {
+  int phi_block;
+  auto instruction = find_phi(phi, &phi_block);
+  int same = -1;
+  for (auto i = instruction->operands.begin(); i != instruction->operands.end();
+       i++) {
+    if (*i == same || *i == phi)
+      continue;
+    if (same >= 0)
+      return phi;
+    same = *i;
+  }
+  if (same < 0)
+    return phi;
+
+  std::vector<int> users;
+  auto &blocks = function->blocks;
+  for (auto block = blocks.begin(); block != blocks.end(); block++) {
+    for (auto i = block->instructions.begin(); i != block->instructions.end();
+         i++) {
+      if (i->opcode != IR_OPCODE_PHI || i->dest == phi)
+        continue;
+      for (auto operand = i->operands.begin(); operand != i->operands.end();
+           operand++)
+        if (*operand == phi) {
+          users.push_back(i->dest);
+          break;
+        }
+    }
+  }
+
+  auto &instructions = blocks[phi_block].instructions;
+  for (auto i = instructions.begin(); i != instructions.end(); i++)
+    if (i->dest == phi) {
+      instructions.erase(i);
+      break;
+    }
+  function->replace_uses(phi, same);
+  replacements[phi] = same;
+  for (auto i = definitions.begin(); i != definitions.end(); i++)
+    for (auto j = i->second.begin(); j != i->second.end(); j++)
+      if (j->second == phi)
+        j->second = same;
+
+  for (auto i = users.begin(); i != users.end(); i++)
+    if (filling_phis.find(*i) == filling_phis.end() &&
+        find_phi(*i) != nullptr)
+      remove_trivial_phi(*i);
+
+  return resolve(same);
+}
+
+// Called once all the predecessors of a block are known
+void IrBuilder::seal_block(int sealed_block) {
+  auto phis = incomplete_phis[sealed_block];
+  for (auto i = phis.begin(); i != phis.end(); i++)
+    add_phi_operands(i->first, resolve(i->second));
+  incomplete_phis.erase(sealed_block);
+  sealed[sealed_block] = true;
+}
+
+bool IrBuilder::build_sequence(std::vector<std::shared_ptr<Operation>> &body) {
+  for (auto i = body.begin(); i != body.end(); i++)
+    if (!build_statement(*i))
+      return false;
+  return true;
+}
+
+bool IrBuilder::build_statement(std::shared_ptr<Operation> &operation) {
+  // Definitions only generate code when used, and else is built with its if
+  if (std::dynamic_pointer_cast<OperationPrimitiveDefinition>(operation) !=
+          nullptr ||
+      std::dynamic_pointer_cast<OperationTypeDefinition>(operation) !=
+          nullptr ||
+      std::dynamic_pointer_cast<OperationFunctionDefinition>(operation) !=
+          nullptr ||
+      std::dynamic_pointer_cast<OperationElse>(operation) != nullptr)
+    return true;
+
+  auto variable_definition =
+      std::dynamic_pointer_cast<OperationVariableDefinition>(operation);
+  if (variable_definition != nullptr) {
+    auto data_type = variable_definition->get_data_type();
+    if (!is_supported_type(data_type))
+      return set_unsupported(data_type + " variables");
+    int value;
+    if (variable_definition->value != nullptr) {
+      value = build_value(variable_definition->value);
+      if (value < 0)
+        return false;
+    } else
+      value = add_constant(data_type, 0);
+    write_variable(variable_definition.get(), block, value);
+    return true;
+  }
+
+  auto assignment = std::dynamic_pointer_cast<OperationAssignment>(operation);
+  if (assignment != nullptr) {
+    auto symbol =
+        std::dynamic_pointer_cast<OperationSymbol>(assignment->target);
+    if (symbol == nullptr)
+      return set_unsupported("assignments to " +
+                             describe_operation(assignment->target.get()));
+    if (definitions.find(symbol->definition.get()) == definitions.end())
+      return set_unsupported("assignments to " + symbol->name->get_text());
+    auto value = build_value(assignment->value);
+    if (value < 0)
+      return false;
+    write_variable(symbol->definition.get(), block, value);
+    return true;
+  }
+
+  auto call = std::dynamic_pointer_cast<OperationCall>(operation);
+  if (call != nullptr &&
+      std::dynamic_pointer_cast<OperationPrintFunction>(call->value) !=
+          nullptr &&
+      call->parameters.size() == 1) {
+    auto value = build_value(call->parameters[0]);
+    if (value < 0)
+      return false;
+    auto &data_type = function->value_types[value];
+    if (!is_supported_type(data_type))
+      return set_unsupported("printing " + data_type + " values");
+    IrInstruction instruction(IR_OPCODE_PRINT);
+    instruction.operands.push_back(value);
+    add_instruction(instruction);
+    return true;
+  }
+
+  // A failed assertion stops the program, the same as finishing it
+  auto assert_operation = std::dynamic_pointer_cast<OperationAssert>(operation);
+  if (assert_operation != nullptr) {
+    auto condition = build_value(assert_operation->expression);
+    if (condition < 0)
+      return false;
+    if (function->value_types[condition] != "bool")
+      return set_unsupported("conditions that aren't bool");
+    auto condition_block = block;
+    add_branch(condition);
+
+    auto failed_block = add_block();
+    set_branch_target(condition_block, 1, failed_block);
+    seal_block(failed_block);
+    block = failed_block;
+    add_exit(0);
+
+    auto passed_block = add_block();
+    set_branch_target(condition_block, 0, passed_block);
+    seal_block(passed_block);
+    block = passed_block;
+    return true;
+  }
+
+  auto while_operation = std::dynamic_pointer_cast<OperationWhile>(operation);
+  if (while_operation != nullptr) {
+    // The header isn't sealed until the end of the body jumps back to it
+    auto header = add_block();
+    add_jump(header);
+    block = header;
+    auto condition = build_value(while_operation->condition);
+    if (condition < 0)
+      return false;
+    if (function->value_types[condition] != "bool")
+      return set_unsupported("conditions that aren't bool");
+    add_branch(condition);
+
+    auto body = add_block();
+    set_branch_target(header, 0, body);
+    seal_block(body);
+    block = body;
+    if (!build_sequence(while_operation->children))
+      return false;
+    add_jump(header);
+    seal_block(header);
+
+    auto exit = add_block();
+    set_branch_target(header, 1, exit);
+    seal_block(exit);
+    block = exit;
+    return true;
+  }
+
+  auto if_operation = std::dynamic_pointer_cast<OperationIf>(operation);
+  if (if_operation != nullptr) {
+    auto condition = build_value(if_operation->condition);
+    if (condition < 0)
+      return false;
+    if (function->value_types[condition] != "bool")
+      return set_unsupported("conditions that aren't bool");
+    auto condition_block = block;
+    add_branch(condition);
+
+    auto then_block = add_block();
+    set_branch_target(condition_block, 0, then_block);
+    seal_block(then_block);
+    block = then_block;
+    if (!build_sequence(if_operation->children))
+      return false;
+    auto then_end_block = block;
+
+    auto else_end_block = condition_block;
+    if (if_operation->else_operation != nullptr) {
+      auto else_block = add_block();
+      set_branch_target(condition_block, 1, else_block);
+      seal_block(else_block);
+      block = else_block;
+      if (!build_sequence(if_operation->else_operation->children))
+        return false;
+      else_end_block = block;
+    }
+
+    auto join = add_block();
+    block = then_end_block;
+    add_jump(join);
+    if (if_operation->else_operation != nullptr) {
+      block = else_end_block;
+      add_jump(join);
+    } else
+      set_branch_target(condition_block, 1, join);
+    seal_block(join);
+    block = join;
+    return true;
+  }
+
+  return set_unsupported(describe_operation(operation.get()));
+}
+
+// Returns the value, or -1 if not supported
+int IrBuilder::build_value(std::shared_ptr<Operation> &operation) {
+  if (std::dynamic_pointer_cast<OperationTrue>(operation) != nullptr)
+    return add_constant("bool", 1);
+  if (std::dynamic_pointer_cast<OperationFalse>(operation) != nullptr)
+    return add_constant("bool", 0);
+
+  // Constants are converted to the type they're used with
+  auto convert = std::dynamic_pointer_cast<OperationConvert>(operation);
+  std::shared_ptr<OperationNumberConstant> number_constant;
+  std::string data_type;
+  if (convert != nullptr && is_supported_type(convert->data_type)) {
+    number_constant =
+        std::dynamic_pointer_cast<OperationNumberConstant>(convert->op);
+    data_type = convert->data_type;
+  } else {
+    number_constant =
+        std::dynamic_pointer_cast<OperationNumberConstant>(operation);
+    if (number_constant != nullptr)
+      data_type = number_constant->data_type;
+  }
+  if (number_constant != nullptr) {
+    if (!is_supported_type(data_type)) {
+      set_unsupported(data_type + " values");
+      return -1;
+    }
+    uint64_t value = number_constant->magnitude;
+    if (number_constant->sign_token != nullptr)
+      value = -value;
+    return add_constant(data_type, value);
+  }
+
+  auto symbol = std::dynamic_pointer_cast<OperationSymbol>(operation);
+  if (symbol != nullptr) {
+    auto definition = symbol->definition.get();
+    if (definitions.find(definition) == definitions.end()) {
+      set_unsupported(describe_operation(symbol.get()));
+      return -1;
+    }
+    return read_variable(definition, block);
+  }
+
+  auto binary = std::dynamic_pointer_cast<OperationBinary>(operation);
+  if (binary != nullptr) {
+    auto data_type = binary->a->get_data_type();
+    if (!is_supported_type(data_type)) {
+      set_unsupported(data_type + " values");
+      return -1;
+    }
+    IrOpcode opcode;
+    switch (binary->op->type) {
+    case TOKEN_TYPE_ADD:
+      opcode = IR_OPCODE_ADD;
+      break;
+    case TOKEN_TYPE_SUBTRACT:
+      opcode = IR_OPCODE_SUBTRACT;
+      break;
+    case TOKEN_TYPE_MULTIPLY:
+      opcode = IR_OPCODE_MULTIPLY;
+      break;
+    case TOKEN_TYPE_EQUAL:
+      opcode = IR_OPCODE_EQUAL;
+      break;
+    case TOKEN_TYPE_NOT_EQUAL:
+      opcode = IR_OPCODE_NOT_EQUAL;
+      break;
+    case TOKEN_TYPE_LESS:
+      opcode = IR_OPCODE_LESS;
+      break;
+    case TOKEN_TYPE_LESS_EQUAL:
+      opcode = IR_OPCODE_LESS_EQUAL;
+      break;
+    case TOKEN_TYPE_GREATER:
+      opcode = IR_OPCODE_GREATER;
+      break;
+    case TOKEN_TYPE_GREATER_EQUAL:
+      opcode = IR_OPCODE_GREATER_EQUAL;
+      break;
+    default:
+      set_unsupported(describe_operation(binary.get()));
+      return -1;
+    }
+    auto a = build_value(binary->a);
+    auto b = build_value(binary->b);
+    if (a < 0 || b < 0)
+      return -1;
+    IrInstruction instruction(opcode);
+    instruction.operands.push_back(a);
+    instruction.operands.push_back(b);
+    return add_instruction(instruction, opcode <= IR_OPCODE_MULTIPLY
+                                            ? data_type
+                                            : std::string("bool"));
+  }
+
+  set_unsupported(describe_operation(operation.get()));
+  return -1;
+}
+
+std::shared_ptr<IrFunction> ir_build_module(OperationModule *module,
+                                            std::string &error) {
+  IrBuilder builder;
+  if (!builder.build_sequence(module->children)) {
+    error = builder.error;
+    return nullptr;
+  }
+  if (builder.failed) {
+    error = "variables that may be read before they are set";
+    return nullptr;
+  }
+  builder.add_exit(0);
+  return builder.function;
+}
+
+static const char *get_opcode_name(IrOpcode opcode) {
+  switch (opcode) {
+  case IR_OPCODE_CONSTANT:
+    return "constant";
+  case IR_OPCODE_ADD:
+    return "add";
+  case IR_OPCODE_SUBTRACT:
+    return "subtract";
+  case IR_OPCODE_MULTIPLY:
+    return "multiply";
+  case IR_OPCODE_EQUAL:
+    return "equal";
+  case IR_OPCODE_NOT_EQUAL:
+    return "not-equal";
+  case IR_OPCODE_LESS:
+    return "less";
+  case IR_OPCODE_LESS_EQUAL:
+    return "less-equal";
+  case IR_OPCODE_GREATER:
+    return "greater";
+  case IR_OPCODE_GREATER_EQUAL:
+    return "greater-equal";
+  case IR_OPCODE_PHI:
+    return "phi";
+  case IR_OPCODE_JUMP:
+    return "jump";
+  case IR_OPCODE_BRANCH:
+    return "branch";
+  case IR_OPCODE_EXIT:
+    return "exit";
+  case IR_OPCODE_PRINT:
+    return "print";
+  }
+  return "?";
+}
+
+static std::string value_to_string(int value) {
+  return "%" + std::to_string(value);
+}
+
+static std::string block_to_string(int block) {
+  return "b" + std::to_string(block);
+}
+
+std::string ir_function_to_string(IrFunction &function) {
+  std::string text = "function " + function.name + " {\n";
+  for (size_t i = 0; i < function.blocks.size(); i++) {
+    auto &block = function.blocks[i];
+    text += block_to_string(i) + ":";
+    for (size_t j = 0; j < block.predecessors.size(); j++)
+      text += (j == 0 ? " ; from " : ", ") +
+              block_to_string(block.predecessors[j]);
+    text += "\n";
+
+    for (auto j = block.instructions.begin(); j != block.instructions.end();
+         j++) {
+      text += "  ";
+      if (j->dest >= 0)
+        text += value_to_string(j->dest) + " = " +
+                function.value_types[j->dest] + " ";
+      text += get_opcode_name(j->opcode);
+
+      std::vector<std::string> arguments;
+      if (j->opcode == IR_OPCODE_CONSTANT) {
+        auto &data_type = function.value_types[j->dest];
+        if (data_type == "bool")
+          arguments.push_back(j->value != 0 ? "true" : "false");
+        else if (data_type_is_signed(data_type))
+          arguments.push_back(std::to_string((int64_t)j->value));
+        else
+          arguments.push_back(std::to_string(j->value));
+      } else if (j->opcode == IR_OPCODE_PHI) {
+        for (size_t k = 0; k < j->operands.size(); k++)
+          arguments.push_back("[" + value_to_string(j->operands[k]) + ", " +
+                              block_to_string(j->blocks[k]) + "]");
+      } else {
+        for (auto k = j->operands.begin(); k != j->operands.end(); k++)
+          arguments.push_back(value_to_string(*k));
+        for (auto k = j->blocks.begin(); k != j->blocks.end(); k++)
+          arguments.push_back(block_to_string(*k));
+      }
+      for (size_t k = 0; k < arguments.size(); k++)
+        text += (k == 0 ? " " : ", ") + arguments[k];
+      text += "\n";
+    }
+  }
+  text += "}\n";
+
+  return text;
+}
+
+bool IrPassManager::run(IrFunction &function) {
+  bool changed = false;
+  for (auto i = passes.begin(); i != passes.end(); i++)
+    if (i->second(function))
+      changed = true;
+  return changed;
+}
+
+static bool fold(IrOpcode opcode, bool is_signed, uint64_t a, uint64_t b,
+                 uint64_t *result) {
+  int64_t signed_a = a, signed_b = b;
+  switch (opcode) {
+  case IR_OPCODE_ADD:
+    *result = a + b;
+    return true;
+  case IR_OPCODE_SUBTRACT:
+    *result = a - b;
+    return true;
+  case IR_OPCODE_MULTIPLY:
+    *result = a * b;
+    return true;
+  case IR_OPCODE_EQUAL:
+    *result = a == b;
+    return true;
+  case IR_OPCODE_NOT_EQUAL:
+    *result = a != b;
+    return true;
+  case IR_OPCODE_LESS:
+    *result = is_signed ? signed_a < signed_b : a < b;
+    return true;
+  case IR_OPCODE_LESS_EQUAL:
+    *result = is_signed ? signed_a <= signed_b : a <= b;
+    return true;
+  case IR_OPCODE_GREATER:
+    *result = is_signed ? signed_a > signed_b : a > b;
+    return true;
+  case IR_OPCODE_GREATER_EQUAL:
+    *result = is_signed ? signed_a >= signed_b : a >= b;
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool ir_fold_constants(IrFunction &function) {
+  // Blocks are in code order, so values are always folded before they're used,
+  // except by phis
+  std::map<int, uint64_t> constants;
+  bool changed = false;
+  for (auto block = function.blocks.begin(); block != function.blocks.end();
+       block++) {
+    for (auto i = block->instructions.begin(); i != block->instructions.end();
+         i++) {
+      if (i->opcode == IR_OPCODE_CONSTANT) {
+        constants[i->dest] = i->value;
+        continue;
+      }
+      if (i->operands.size() != 2)
+        continue;
+
+      auto a = constants.find(i->operands[0]);
+      auto b = constants.find(i->operands[1]);
+      if (a == constants.end() || b == constants.end())
+        continue;
+      uint64_t result;
+      auto is_signed =
+          data_type_is_signed(function.value_types[i->operands[0]]);
+      if (!fold(i->opcode, is_signed, a->second, b->second, &result))
+        continue;
+      i->opcode = IR_OPCODE_CONSTANT;
+      i->operands.clear();
+      i->value = result;
+      constants[i->dest] = result;
+      changed = true;
+    }
+  }
+
+  return changed;
+}
+
+bool ir_remove_dead_code(IrFunction &function) {
+  bool changed = false;
+  bool removed = true;
+  while (removed) {
+    removed = false;
+
+    // A phi using itself on a loop doesn't keep it alive
+    std::vector<int> n_uses(function.value_types.size(), 0);
+    for (auto block = function.blocks.begin(); block != function.blocks.end();
+         block++)
+      for (auto i = block->instructions.begin();
+           i != block->instructions.end(); i++)
+        for (auto operand = i->operands.begin(); operand != i->operands.end();
+             operand++)
+          if (*operand != i->dest)
+            n_uses[*operand]++;
+
+    for (auto block = function.blocks.begin(); block != function.blocks.end();
+         block++) {
+      auto &instructions = block->instructions;
+      for (auto i = instructions.begin(); i != instructions.end();) {
+        if (!i->has_side_effects() && n_uses[i->dest] == 0) {
+          i = instructions.erase(i);
+          removed = true;
+          changed = true;
+        } else
+          i++;
+      }
+    }
+  }
+
+  return changed;
+}
+
+void ir_add_default_passes(IrPassManager &manager) {
+  manager.add_pass("fold-constants", ir_fold_constants);
+  manager.add_pass("remove-dead-code", ir_remove_dead_code);
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2020 Robert Ancell.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ */
+
+#pragma once
+
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "elf-operation.h"
+
+// Typed intermediate representation in static single assignment form. Each
+// value is set by exactly one instruction and has a data type. Code is split
+// into basic blocks that end in a jump, branch or exit, and values that differ
+// depending on the path taken into a block are merged with phi instructions
+
+typedef enum {
+  IR_OPCODE_CONSTANT,      // dest = value
+  IR_OPCODE_ADD,           // dest = operands[0] + operands[1]
+  IR_OPCODE_SUBTRACT,      // dest = operands[0] - operands[1]
+  IR_OPCODE_MULTIPLY,      // dest = operands[0] * operands[1]
+  IR_OPCODE_EQUAL,         // dest = operands[0] == operands[1]
+  IR_OPCODE_NOT_EQUAL,     // dest = operands[0] != operands[1]
+  IR_OPCODE_LESS,          // dest = operands[0] < operands[1]
+  IR_OPCODE_LESS_EQUAL,    // dest = operands[0] <= operands[1]
+  IR_OPCODE_GREATER,       // dest = operands[0] > operands[1]
+  IR_OPCODE_GREATER_EQUAL, // dest = operands[0] >= operands[1]
+  IR_OPCODE_PHI,           // dest = operands[i] if entered from blocks[i]
+  IR_OPCODE_JUMP,          // goto blocks[0]
+  IR_OPCODE_BRANCH,        // goto operands[0] ? blocks[0] : blocks[1]
+  IR_OPCODE_EXIT,          // exit process with status operands[0]
+  IR_OPCODE_PRINT,         // write operands[0] and a newline to stdout
+} IrOpcode;
+
+struct IrInstruction {
+  IrOpcode opcode;
+
+  // Value set by this instruction, or -1 if none
+  int dest;
+
+  std::vector<int> operands;
+  std::vector<int> blocks;
+
+  uint64_t value;
+
+  IrInstruction(IrOpcode opcode) : opcode(opcode), dest(-1), value(0) {}
+  bool is_terminator();
+  bool has_side_effects();
+};
+
+struct IrBlock {
+  std::vector<IrInstruction> instructions;
+  std::vector<int> predecessors;
+};
+
+struct IrFunction {
+  std::string name;
+  std::vector<IrBlock> blocks;
+
+  // Data type of each value
+  std::vector<std::string> value_types;
+
+  IrFunction(const std::string &name) : name(name) {}
+
+  int add_block();
+  int add_value(const std::string &data_type);
+  std::vector<int> get_successors(int block);
+
+  // Changes all uses of a value to another value
+  void replace_uses(int value, int replacement);
+};
+
+// Builds the top level statements of a module. Returns nullptr and describes
+// what isn't supported in error if it uses something that can't be represented
+// yet; only 64 bit integer variables, arithmetic, the control flow using them,
+// printing them and assert are supported
+std::shared_ptr<IrFunction> ir_build_module(OperationModule *module,
+                                            std::string &error);
+
+std::string ir_function_to_string(IrFunction &function);
+
+// Returns true if the pass changed the function
+typedef bool (*IrPass)(IrFunction &function);
+
+struct IrPassManager {
+  std::vector<std::pair<std::string, IrPass>> passes;
+
+  void add_pass(const std::string &name, IrPass pass) {
+    passes.push_back(std::make_pair(name, pass));
+  }
+
+  // Runs each pass in order. Returns true if any changed the function
+  bool run(IrFunction &function);
+};
+
+// Replaces arithmetic and comparisons on constants with their result
+bool ir_fold_constants(IrFunction &function);
+
+// Removes instructions whose values are never used
+bool ir_remove_dead_code(IrFunction &function);
+
+void ir_add_default_passes(IrPassManager &manager);
@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2020 Robert Ancell.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ */
+
+#pragma once
+
+#include <memory>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+// Destination for text printed by programs and for error messages
+struct ElfOutput {
+  virtual ~ElfOutput() {}
+  virtual void write(const char *data, size_t length) = 0;
+};
+
+// Writes to a stdio stream, e.g. stdout
+struct ElfFileOutput : ElfOutput {
+  FILE *file;
+
+  ElfFileOutput(FILE *file) : file(file) {}
+  void write(const char *data, size_t length) {
+    fwrite(data, 1, length, file);
+  }
+};
+
+// Collects output in memory, e.g. to capture what a program prints
+struct ElfStringOutput : ElfOutput {
+  std::string text;
+
+  void write(const char *data, size_t length) { text.append(data, length); }
+};
+
+struct OperationModule;
+
+// Parses and checks a program, writing any errors to errors. data must remain
+// valid while the module is used. If eager is false, function bodies are only
+// parsed when first called, so the module can't be run from two threads at
+// once
+std::shared_ptr<OperationModule> elf_parse(const char *data, size_t data_length,
+                                           bool eager, ElfOutput &errors);
+
+// Runs a program from elf_parse(), writing what it prints to output. Returns
+// false if the program failed to run
+bool elf_run(const char *data, std::shared_ptr<OperationModule> module,
+             ElfOutput &output, ElfOutput &errors);
+
+// Replaces calls to small functions that return an expression of their
+// parameters with that expression, avoiding the cost of the call. threshold is
+// the largest number of operations an inlined expression can have, or 0 to
+// not inline. Only functions whose bodies have been parsed are inlined
+void elf_inline_functions(std::shared_ptr<OperationModule> module,
+                          size_t threshold);
+
+// Default threshold for elf_inline_functions()
+#define ELF_DEFAULT_INLINE_THRESHOLD 16
+
+// Parses a program with elf_parse() and applies the passes done before it is
+// run or compiled: code that can't be reached is removed, then calls to small
+// functions are inlined. Returns nullptr and writes to errors if the program
+// isn't valid
+std::shared_ptr<OperationModule> elf_prepare(const char *data,
+                                             size_t data_length, bool eager,
+                                             size_t inline_threshold,
+                                             ElfOutput &errors);
+
+struct ElfCompileOptions {
+  // Keep values in registers, otherwise all are stored on the stack
+  bool allocate_registers;
+
+  // Run the optimisation passes on the intermediate representation
+  bool optimize;
+
+  ElfCompileOptions() : allocate_registers(true), optimize(true) {}
+};
+
+// Gets the intermediate representation of a program from elf_parse() as text.
+// Returns false and writes what isn't supported to errors if the program uses
+// features that can't be compiled yet
+bool elf_get_ir(std::shared_ptr<OperationModule> module,
+                const ElfCompileOptions &options, std::string &text,
+                ElfOutput &errors);
+
+// Compiles a program from elf_parse() to an x86-64 ELF executable. Returns
+// false and writes what isn't supported to errors if the program uses
+// features that can't be compiled yet
+bool elf_compile(std::shared_ptr<OperationModule> module,
+                 std::vector<uint8_t> &binary, ElfOutput &errors,
+                 const ElfCompileOptions &options = ElfCompileOptions());
+
+// A program that has been parsed and checked, ready to be run any number of
+// times. Runs don't modify it, so it can be run from many threads at once
+struct ElfProgram {
+  // Copy of the source, which the module refers to
+  std::string source;
+
+  std::shared_ptr<OperationModule> module;
+};
+
+// Returns nullptr and writes to errors if the program isn't valid
+std::shared_ptr<ElfProgram> elf_program_new(const char *data,
+                                            size_t data_length,
+                                            ElfOutput &errors);
+
+// Runs a program in a new execution context
+bool elf_program_run(std::shared_ptr<ElfProgram> program, ElfOutput &output,
+                     ElfOutput &errors);
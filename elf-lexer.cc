@@ -8,167 +8,287 @@
  */
 
 #include "elf-lexer.h"
+#include "elf-utf8.h"
 
+#include <algorithm>
 #include <memory>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
-static bool is_number_char(char c) { return c >= '0' && c <= '9'; }
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-static bool is_symbol_char(char c) {
-  return is_number_char(c) || (c >= 'a' && c <= 'z') ||
-         (c >= 'A' && c <= 'Z') || c == '_';
+// Character classes used to drive the lexer
+enum {
+  CHAR_CLASS_WHITESPACE = 1 << 0,
+  CHAR_CLASS_DIGIT = 1 << 1,
+  CHAR_CLASS_LETTER = 1 << 2, // Includes underscore
+};
+
+struct CharTables {
+  // Classes of each character
+  uint8_t classes[256];
+
+  // Type of token started by each character
+  TokenType start_types[256];
+
+  CharTables() {
+    for (int c = 0; c < 256; c++) {
+      classes[c] = 0;
+      start_types[c] = TOKEN_TYPE_INVALID;
+    }
+
+    classes[static_cast<uint8_t>(' ')] = CHAR_CLASS_WHITESPACE;
+    classes[static_cast<uint8_t>('\r')] = CHAR_CLASS_WHITESPACE;
+    classes[static_cast<uint8_t>('\n')] = CHAR_CLASS_WHITESPACE;
+    for (int c = '0'; c <= '9'; c++) {
+      classes[c] = CHAR_CLASS_DIGIT;
+      start_types[c] = TOKEN_TYPE_NUMBER;
+    }
+    for (int c = 'a'; c <= 'z'; c++) {
+      classes[c] = CHAR_CLASS_LETTER;
+      start_types[c] = TOKEN_TYPE_WORD;
+    }
+    for (int c = 'A'; c <= 'Z'; c++) {
+      classes[c] = CHAR_CLASS_LETTER;
+      start_types[c] = TOKEN_TYPE_WORD;
+    }
+    classes[static_cast<uint8_t>('_')] = CHAR_CLASS_LETTER;
+    start_types[static_cast<uint8_t>('_')] = TOKEN_TYPE_WORD;
+
+    start_types[static_cast<uint8_t>('#')] = TOKEN_TYPE_COMMENT;
+    start_types[static_cast<uint8_t>('(')] = TOKEN_TYPE_OPEN_PAREN;
+    start_types[static_cast<uint8_t>(')')] = TOKEN_TYPE_CLOSE_PAREN;
+    start_types[static_cast<uint8_t>('[')] = TOKEN_TYPE_OPEN_BRACKET;
+    start_types[static_cast<uint8_t>(']')] = TOKEN_TYPE_CLOSE_BRACKET;
+    start_types[static_cast<uint8_t>(',')] = TOKEN_TYPE_COMMA;
+    start_types[static_cast<uint8_t>('{')] = TOKEN_TYPE_OPEN_BRACE;
+    start_types[static_cast<uint8_t>('}')] = TOKEN_TYPE_CLOSE_BRACE;
+    start_types[static_cast<uint8_t>('=')] = TOKEN_TYPE_ASSIGN;
+    start_types[static_cast<uint8_t>('!')] = TOKEN_TYPE_NOT;
+    start_types[static_cast<uint8_t>('<')] = TOKEN_TYPE_LESS;
+    start_types[static_cast<uint8_t>('>')] = TOKEN_TYPE_GREATER;
+    start_types[static_cast<uint8_t>('+')] = TOKEN_TYPE_ADD;
+    start_types[static_cast<uint8_t>('-')] = TOKEN_TYPE_SUBTRACT;
+    start_types[static_cast<uint8_t>('*')] = TOKEN_TYPE_MULTIPLY;
+    start_types[static_cast<uint8_t>('/')] = TOKEN_TYPE_DIVIDE;
+    start_types[static_cast<uint8_t>('"')] = TOKEN_TYPE_TEXT;
+    start_types[static_cast<uint8_t>('\'')] = TOKEN_TYPE_TEXT;
+    // FIXME: Don't allow whitespace before it?
+    start_types[static_cast<uint8_t>('.')] = TOKEN_TYPE_MEMBER;
+  }
+};
+
+static const CharTables char_tables;
+
+static uint8_t get_char_class(char c) {
+  return char_tables.classes[static_cast<uint8_t>(c)];
 }
 
-static char string_is_complete(const char *data, std::shared_ptr<Token> token) {
-  // Need at least an open and closing quote
-  if (token->length < 2)
-    return false;
-
-  // Both start and end characters need to be the same
-  char start_char = data[token->offset];
-  char end_char = data[token->offset + token->length - 1];
-  if (end_char != start_char)
-    return false;
-
-  bool in_escape = false;
-  for (size_t i = 1; i < token->length - 1; i++) {
-    if (in_escape) {
-      in_escape = false;
+// Offset of the first character at or after offset that isn't in the given
+// classes
+static size_t skip_class(const char *data, size_t offset, size_t length,
+                         uint8_t classes) {
+  while (offset < length && (get_char_class(data[offset]) & classes) != 0)
+    offset++;
+  return offset;
+}
+
+// Offset of the first non-whitespace character at or after offset
+static size_t skip_whitespace(const char *data, size_t offset, size_t length) {
+#if defined(__SSE2__)
+  auto space = _mm_set1_epi8(' ');
+  auto carriage_return = _mm_set1_epi8('\r');
+  auto line_feed = _mm_set1_epi8('\n');
+  while (offset + 16 <= length) {
+    auto v =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + offset));
+    auto is_whitespace = _mm_or_si128(
+        _mm_cmpeq_epi8(v, space),
+        _mm_or_si128(_mm_cmpeq_epi8(v, carriage_return),
+                     _mm_cmpeq_epi8(v, line_feed)));
+    auto mask = _mm_movemask_epi8(is_whitespace);
+    if (mask != 0xFFFF)
+      return offset + __builtin_ctz(~mask);
+    offset += 16;
+  }
+#endif
+  return skip_class(data, offset, length, CHAR_CLASS_WHITESPACE);
+}
+
+// Offset of the first a or b character at or after offset, or length if none
+static size_t find_char(const char *data, size_t offset, size_t length, char a,
+                        char b) {
+#if defined(__SSE2__)
+  auto va = _mm_set1_epi8(a);
+  auto vb = _mm_set1_epi8(b);
+  while (offset + 16 <= length) {
+    auto v =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + offset));
+    auto mask = _mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+    if (mask != 0)
+      return offset + __builtin_ctz(mask);
+    offset += 16;
+  }
+#endif
+  while (offset < length && data[offset] != a && data[offset] != b)
+    offset++;
+  return offset;
+}
+
+// Offset after the closing quote of the text starting at offset, or length
+// if not terminated
+static size_t find_text_end(const char *data, size_t offset, size_t length) {
+  char quote = data[offset];
+  offset++;
+  while (true) {
+    offset = find_char(data, offset, length, quote, '\\');
+    if (offset >= length)
+      return length;
+    if (data[offset] == quote)
+      return offset + 1;
+    offset += 2; // Skip escaped character
+  }
+}
+
+void LineTable::scan(const char *data, size_t end) {
+  while (scanned_length < end) {
+    auto newline = static_cast<const char *>(
+        memchr(data + scanned_length, '\n', end - scanned_length));
+    if (newline == nullptr) {
+      scanned_length = end;
+      return;
+    }
+
+    scanned_length = newline - data + 1;
+    line_starts.push_back(scanned_length);
+  }
+}
+
+void LineTable::get_position(const char *data, size_t offset, size_t *line,
+                             size_t *column) {
+  scan(data, offset);
+
+  auto next_line =
+      std::upper_bound(line_starts.begin(), line_starts.end(), offset);
+  *line = next_line - line_starts.begin();
+  *column = offset - *(next_line - 1);
+}
+
+// Source is validated in blocks of this size ahead of the lexer
+#define VALIDATE_BLOCK_SIZE 65536
+
+void Lexer::validate(size_t length) {
+  auto start = validated_length;
+  while (is_valid && validated_length < length) {
+    auto end = validated_length + VALIDATE_BLOCK_SIZE;
+    if (end > data_length)
+      end = data_length;
+
+    auto valid_end =
+        validated_length + elf_utf8_validate(data + validated_length,
+                                             end - validated_length);
+    if (valid_end == end) {
+      validated_length = end;
       continue;
     }
 
-    if (data[token->offset + i] == '\\')
-      in_escape = true;
+    // Check if a character was just split across blocks
+    auto sequence_length = elf_utf8_get_sequence_length(
+        data + valid_end, data_length - valid_end);
+    if (sequence_length > 0)
+      validated_length = valid_end + sequence_length;
+    else {
+      validated_length = valid_end;
+      is_valid = false;
+    }
   }
 
-  // Closing quote needs to be non-escaped
-  return !in_escape;
+  // Only extend the lines if they reach where this lexer started, otherwise
+  // they are scanned when looked up
+  if (lines->scanned_length >= start)
+    lines->scan(data, validated_length);
 }
 
-static bool token_is_complete(const char *data, std::shared_ptr<Token> token,
-                              char next_c) {
-  switch (token->type) {
+// Reads the token at offset without going past limit, returning its end
+size_t Lexer::lex_token(size_t limit, TokenType *type) {
+  *type = char_tables.start_types[static_cast<uint8_t>(data[offset])];
+  auto end = offset + 1;
+  switch (*type) {
   case TOKEN_TYPE_COMMENT:
-    return next_c == '\n' || next_c == '\0';
+    return find_char(data, end, limit, '\n', '\0');
   case TOKEN_TYPE_WORD:
-    return !is_symbol_char(next_c);
   case TOKEN_TYPE_MEMBER:
-    return !is_symbol_char(next_c);
+    return skip_class(data, end, limit, CHAR_CLASS_LETTER | CHAR_CLASS_DIGIT);
   case TOKEN_TYPE_NUMBER:
-    return !is_number_char(next_c);
+    return skip_class(data, end, limit, CHAR_CLASS_DIGIT);
   case TOKEN_TYPE_TEXT:
-    return string_is_complete(data, token);
+    return find_text_end(data, offset, limit);
+  case TOKEN_TYPE_ASSIGN:
   case TOKEN_TYPE_NOT:
-    return next_c != '=';
   case TOKEN_TYPE_LESS:
-    return next_c != '=';
   case TOKEN_TYPE_GREATER:
-    return next_c != '=';
-  case TOKEN_TYPE_ASSIGN:
-    return next_c != '=';
-  case TOKEN_TYPE_EQUAL:
-  case TOKEN_TYPE_NOT_EQUAL:
-  case TOKEN_TYPE_LESS_EQUAL:
-  case TOKEN_TYPE_GREATER_EQUAL:
-  case TOKEN_TYPE_ADD:
-  case TOKEN_TYPE_SUBTRACT:
-  case TOKEN_TYPE_MULTIPLY:
-  case TOKEN_TYPE_DIVIDE:
-  case TOKEN_TYPE_OPEN_PAREN:
-  case TOKEN_TYPE_CLOSE_PAREN:
-  case TOKEN_TYPE_OPEN_BRACKET:
-  case TOKEN_TYPE_CLOSE_BRACKET:
-  case TOKEN_TYPE_COMMA:
-  case TOKEN_TYPE_OPEN_BRACE:
-  case TOKEN_TYPE_CLOSE_BRACE:
-  case TOKEN_TYPE_EOF:
-    return true;
+    if (end < limit && data[end] == '=') {
+      if (*type == TOKEN_TYPE_ASSIGN)
+        *type = TOKEN_TYPE_EQUAL;
+      else if (*type == TOKEN_TYPE_NOT)
+        *type = TOKEN_TYPE_NOT_EQUAL;
+      else if (*type == TOKEN_TYPE_LESS)
+        *type = TOKEN_TYPE_LESS_EQUAL;
+      else
+        *type = TOKEN_TYPE_GREATER_EQUAL;
+      return end + 1;
+    }
+    return end;
+  case TOKEN_TYPE_INVALID: {
+    // Keep multi-byte characters in one token
+    auto sequence_length =
+        elf_utf8_get_sequence_length(data + offset, limit - offset);
+    return sequence_length > 1 ? offset + sequence_length : end;
+  }
+  default:
+    return end;
   }
+}
 
-  return false;
+std::shared_ptr<Token> Lexer::next_token() {
+  offset = skip_whitespace(data, offset, data_length);
+  if (offset >= data_length)
+    return std::make_shared<Token>(TOKEN_TYPE_EOF, data_length, 0, data);
+
+  TokenType type;
+  auto end = lex_token(data_length, &type);
+
+  // Only lex up to the first invalid UTF-8, which is then marked invalid
+  validate(end);
+  if (!is_valid && end > validated_length) {
+    if (offset >= validated_length) {
+      auto token = std::make_shared<Token>(TOKEN_TYPE_INVALID, offset, 1, data);
+      offset = data_length;
+      return token;
+    }
+    end = lex_token(validated_length, &type);
+  }
+
+  auto token = std::make_shared<Token>(type, offset, end - offset, data);
+  offset = end;
+  return token;
 }
 
 std::vector<std::shared_ptr<Token>> elf_lex(const char *data,
                                             size_t data_length) {
   std::vector<std::shared_ptr<Token>> tokens;
-  std::shared_ptr<Token> current_token = nullptr;
-
-  for (size_t offset = 0; offset < data_length; offset++) {
-    // FIXME: Support UTF-8
-    char c = data[offset];
-
-    if (current_token != nullptr && token_is_complete(data, current_token, c))
-      current_token = nullptr;
-
-    if (current_token == nullptr) {
-      // Skip whitespace
-      if (c == ' ' || c == '\r' || c == '\n')
-        continue;
-
-      TokenType type;
-      if (c == '#')
-        type = TOKEN_TYPE_COMMENT;
-      else if (c == '(')
-        type = TOKEN_TYPE_OPEN_PAREN;
-      else if (c == ')')
-        type = TOKEN_TYPE_CLOSE_PAREN;
-      else if (c == '[')
-        type = TOKEN_TYPE_OPEN_BRACKET;
-      else if (c == ']')
-        type = TOKEN_TYPE_CLOSE_BRACKET;
-      else if (c == ',')
-        type = TOKEN_TYPE_COMMA;
-      else if (c == '{')
-        type = TOKEN_TYPE_OPEN_BRACE;
-      else if (c == '}')
-        type = TOKEN_TYPE_CLOSE_BRACE;
-      else if (c == '=')
-        type = TOKEN_TYPE_ASSIGN;
-      else if (c == '!')
-        type = TOKEN_TYPE_NOT;
-      else if (c == '<')
-        type = TOKEN_TYPE_LESS;
-      else if (c == '>')
-        type = TOKEN_TYPE_GREATER;
-      else if (c == '+')
-        type = TOKEN_TYPE_ADD;
-      else if (c == '-')
-        type = TOKEN_TYPE_SUBTRACT;
-      else if (c == '*')
-        type = TOKEN_TYPE_MULTIPLY;
-      else if (c == '/')
-        type = TOKEN_TYPE_DIVIDE;
-      else if (is_number_char(c))
-        type = TOKEN_TYPE_NUMBER;
-      else if (c == '"' || c == '\'')
-        type = TOKEN_TYPE_TEXT;
-      else if (c == '.') // FIXME: Don't allow whitespace before it?
-        type = TOKEN_TYPE_MEMBER;
-      else if (is_symbol_char(c))
-        type = TOKEN_TYPE_WORD;
-
-      auto token = std::make_shared<Token>(type, offset, 1, data);
-      tokens.push_back(token);
-
-      current_token = token;
-    } else {
-      if (c == '=') {
-        if (current_token->type == TOKEN_TYPE_ASSIGN)
-          current_token->type = TOKEN_TYPE_EQUAL;
-        else if (current_token->type == TOKEN_TYPE_NOT)
-          current_token->type = TOKEN_TYPE_NOT_EQUAL;
-        else if (current_token->type == TOKEN_TYPE_LESS)
-          current_token->type = TOKEN_TYPE_LESS_EQUAL;
-        else if (current_token->type == TOKEN_TYPE_GREATER)
-          current_token->type = TOKEN_TYPE_GREATER_EQUAL;
-      }
-
-      current_token->length++;
-    }
-  }
 
-  auto token = std::make_shared<Token>(TOKEN_TYPE_EOF, data_length, 0, data);
-  tokens.push_back(token);
+  Lexer lexer(data, data_length);
+  while (true) {
+    auto token = lexer.next_token();
+    tokens.push_back(token);
+    if (token->type == TOKEN_TYPE_EOF)
+      break;
+  }
 
   return tokens;
 }
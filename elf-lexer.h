@@ -14,5 +14,52 @@
 
 #include "elf-token.h"
 
+// Offsets of the start of each line, for mapping offsets to lines and columns
+struct LineTable {
+  // The first line starts at offset 0
+  std::vector<size_t> line_starts;
+
+  // Length of source that has been scanned for lines
+  size_t scanned_length;
+
+  LineTable() : line_starts(1, 0), scanned_length(0) {}
+
+  // Records the lines that start before end
+  void scan(const char *data, size_t end);
+
+  // Gets the line (starting at 1) and column (in bytes, starting at 0) of
+  // offset, scanning data up to there if it hasn't been already
+  void get_position(const char *data, size_t offset, size_t *line,
+                    size_t *column);
+};
+
+// Produces tokens one at a time as the parser needs them, instead of lexing the
+// whole source first. The source must already be fully in memory
+struct Lexer {
+  const char *data;
+  size_t data_length;
+
+  // Offset of the next token
+  size_t offset;
+
+  // Source is checked to be valid UTF-8 up to here as tokens are read
+  size_t validated_length;
+  bool is_valid;
+
+  // Lines are recorded as the source is validated. This may be shared with
+  // other lexers over the same source
+  std::shared_ptr<LineTable> lines;
+
+  Lexer(const char *data, size_t data_length)
+      : data(data), data_length(data_length), offset(0), validated_length(0),
+        is_valid(true), lines(std::make_shared<LineTable>()) {}
+
+  // Returns the next token, or a TOKEN_TYPE_EOF token at the end
+  std::shared_ptr<Token> next_token();
+
+  void validate(size_t length);
+  size_t lex_token(size_t limit, TokenType *type);
+};
+
 std::vector<std::shared_ptr<Token>> elf_lex(const char *data,
                                             size_t data_length);
@@ -0,0 +1,388 @@
+/*
+ * Copyright (C) 2020 Robert Ancell.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <algorithm>
+#include <map>
+
+#include "elf-mir.h"
+
+// Registers used to load and store values kept on the stack
+#define SCRATCH_REG_A X86_64_REG_10
+#define SCRATCH_REG_B X86_64_REG_11
+
+void MirFunction::add_constant(int dest, uint64_t value) {
+  MirInstruction instruction(MIR_OPCODE_CONSTANT);
+  instruction.dest = dest;
+  instruction.value = value;
+  instructions.push_back(instruction);
+}
+
+void MirFunction::add_copy(int dest, int a) {
+  MirInstruction instruction(MIR_OPCODE_COPY);
+  instruction.dest = dest;
+  instruction.a = a;
+  instructions.push_back(instruction);
+}
+
+void MirFunction::add_binary(MirOpcode opcode, int dest, int a, int b) {
+  MirInstruction instruction(opcode);
+  instruction.dest = dest;
+  instruction.a = a;
+  instruction.b = b;
+  instructions.push_back(instruction);
+}
+
+void MirFunction::add_label(const std::string &label) {
+  MirInstruction instruction(MIR_OPCODE_LABEL);
+  instruction.label = label;
+  instructions.push_back(instruction);
+}
+
+void MirFunction::add_jump(const std::string &label) {
+  MirInstruction instruction(MIR_OPCODE_JUMP);
+  instruction.label = label;
+  instructions.push_back(instruction);
+}
+
+void MirFunction::add_jump_if(int a, int condition, int b,
+                              const std::string &label) {
+  MirInstruction instruction(MIR_OPCODE_JUMP_IF);
+  instruction.a = a;
+  instruction.condition = condition;
+  instruction.b = b;
+  instruction.label = label;
+  instructions.push_back(instruction);
+}
+
+void MirFunction::add_exit(int a) {
+  MirInstruction instruction(MIR_OPCODE_EXIT);
+  instruction.a = a;
+  instructions.push_back(instruction);
+}
+
+void MirFunction::add_print(int a, bool is_signed) {
+  MirInstruction instruction(MIR_OPCODE_PRINT);
+  instruction.a = a;
+  instruction.is_signed = is_signed;
+  instructions.push_back(instruction);
+}
+
+std::vector<int> mir_get_allocatable_registers() {
+  return {X86_64_REG_BASE,     X86_64_REG_12,   X86_64_REG_13,
+          X86_64_REG_14,       X86_64_REG_15,   X86_64_REG_ACCUMULATOR,
+          X86_64_REG_COUNTER,  X86_64_REG_DATA, X86_64_REG_SOURCE,
+          X86_64_REG_DESTINATION, X86_64_REG_8, X86_64_REG_9};
+}
+
+// Range of instructions a virtual register is live over
+struct LiveInterval {
+  int reg;
+  size_t start;
+  size_t end;
+
+  LiveInterval() : reg(-1), start(SIZE_MAX), end(0) {}
+};
+
+static void add_use(std::vector<LiveInterval> &intervals, int reg,
+                    size_t index) {
+  if (reg < 0)
+    return;
+  auto &interval = intervals[reg];
+  interval.reg = reg;
+  interval.start = std::min(interval.start, index);
+  interval.end = std::max(interval.end, index);
+}
+
+static std::vector<LiveInterval> get_live_intervals(MirFunction &function) {
+  std::vector<LiveInterval> intervals(function.n_registers);
+  std::map<std::string, size_t> labels;
+  for (size_t i = 0; i < function.instructions.size(); i++) {
+    auto &instruction = function.instructions[i];
+    add_use(intervals, instruction.dest, i);
+    add_use(intervals, instruction.a, i);
+    add_use(intervals, instruction.b, i);
+    if (instruction.opcode == MIR_OPCODE_LABEL)
+      labels[instruction.label] = i;
+  }
+
+  // Values used in a loop that were set before it are live for the whole loop,
+  // as they're needed again on the next iteration
+  std::vector<std::pair<size_t, size_t>> loops;
+  for (size_t i = 0; i < function.instructions.size(); i++) {
+    auto &instruction = function.instructions[i];
+    if (instruction.opcode != MIR_OPCODE_JUMP &&
+        instruction.opcode != MIR_OPCODE_JUMP_IF)
+      continue;
+    auto label = labels.find(instruction.label);
+    if (label != labels.end() && label->second <= i)
+      loops.push_back(std::make_pair(label->second, i));
+  }
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (auto i = intervals.begin(); i != intervals.end(); i++) {
+      for (auto loop = loops.begin(); loop != loops.end(); loop++) {
+        if (i->reg >= 0 && i->start < loop->first && i->end >= loop->first &&
+            i->end < loop->second) {
+          i->end = loop->second;
+          changed = true;
+        }
+      }
+    }
+  }
+
+  return intervals;
+}
+
+void mir_allocate_registers(MirFunction &function,
+                            const std::vector<int> &available_registers,
+                            MirAllocation &allocation) {
+  allocation.registers.assign(function.n_registers, -1);
+  allocation.stack_slots.assign(function.n_registers, -1);
+  allocation.n_stack_slots = 0;
+
+  auto intervals = get_live_intervals(function);
+  std::vector<LiveInterval *> sorted_intervals;
+  for (auto i = intervals.begin(); i != intervals.end(); i++)
+    if (i->reg >= 0)
+      sorted_intervals.push_back(&*i);
+  std::stable_sort(sorted_intervals.begin(), sorted_intervals.end(),
+                   [](LiveInterval *a, LiveInterval *b) {
+                     return a->start < b->start;
+                   });
+
+  // Registers are taken from the back, so the first available is used first
+  std::vector<int> free_registers(available_registers.rbegin(),
+                                  available_registers.rend());
+
+  // Intervals currently in registers, ordered by end
+  std::vector<LiveInterval *> active;
+
+  for (auto i = sorted_intervals.begin(); i != sorted_intervals.end(); i++) {
+    auto interval = *i;
+
+    // Free registers no longer in use. A value last used by an instruction can
+    // share a register with the value it sets
+    while (!active.empty() && active.front()->end <= interval->start) {
+      free_registers.push_back(allocation.registers[active.front()->reg]);
+      active.erase(active.begin());
+    }
+
+    LiveInterval *spilled = interval;
+    if (!free_registers.empty()) {
+      allocation.registers[interval->reg] = free_registers.back();
+      free_registers.pop_back();
+      spilled = nullptr;
+    } else if (!active.empty() && active.back()->end > interval->end) {
+      // Spill the value used furthest in the future
+      spilled = active.back();
+      active.pop_back();
+      allocation.registers[interval->reg] = allocation.registers[spilled->reg];
+      allocation.registers[spilled->reg] = -1;
+    }
+
+    if (spilled != interval) {
+      auto position = std::upper_bound(
+          active.begin(), active.end(), interval,
+          [](LiveInterval *a, LiveInterval *b) { return a->end < b->end; });
+      active.insert(position, interval);
+    }
+    if (spilled != nullptr)
+      allocation.stack_slots[spilled->reg] = allocation.n_stack_slots++;
+  }
+}
+
+static int32_t get_stack_offset(MirAllocation &allocation, int reg) {
+  return -8 * (allocation.stack_slots[reg] + 1);
+}
+
+// Gets the register holding a value, loading it from the stack if necessary
+static int load_value(MirAllocation &allocation, CodeBuffer &buffer, int reg,
+                      int scratch_reg) {
+  if (allocation.registers[reg] >= 0)
+    return allocation.registers[reg];
+
+  x86_64_mov64_load(buffer, scratch_reg, X86_64_REG_STACK_BASE_POINTER,
+                    get_stack_offset(allocation, reg));
+  return scratch_reg;
+}
+
+// Gets the register to write a value to, which is stored with store_value()
+static int get_dest(MirAllocation &allocation, int reg) {
+  if (allocation.registers[reg] >= 0)
+    return allocation.registers[reg];
+  return SCRATCH_REG_A;
+}
+
+static void store_value(MirAllocation &allocation, CodeBuffer &buffer,
+                        int reg) {
+  if (allocation.registers[reg] >= 0)
+    return;
+  x86_64_mov64_store(buffer, X86_64_REG_STACK_BASE_POINTER,
+                     get_stack_offset(allocation, reg), SCRATCH_REG_A);
+}
+
+static void write_binary(MirInstruction &instruction,
+                         MirAllocation &allocation, CodeBuffer &buffer) {
+  auto a = load_value(allocation, buffer, instruction.a, SCRATCH_REG_A);
+  auto b = load_value(allocation, buffer, instruction.b, SCRATCH_REG_B);
+  auto dest = get_dest(allocation, instruction.dest);
+
+  // Avoid overwriting b before it is used
+  if (dest == b && dest != a) {
+    if (instruction.opcode == MIR_OPCODE_SUBTRACT) {
+      x86_64_mov64_reg(buffer, b, SCRATCH_REG_B);
+      b = SCRATCH_REG_B;
+    } else
+      std::swap(a, b);
+  }
+
+  if (dest != a)
+    x86_64_mov64_reg(buffer, a, dest);
+  if (instruction.opcode == MIR_OPCODE_ADD)
+    x86_64_op64(buffer, X86_64_OP_ADD, b, dest);
+  else if (instruction.opcode == MIR_OPCODE_SUBTRACT)
+    x86_64_op64(buffer, X86_64_OP_SUB, b, dest);
+  else
+    x86_64_imul64(buffer, b, dest);
+  store_value(allocation, buffer, instruction.dest);
+}
+
+// Writes the digits backwards into a buffer on the stack, then writes that
+// with the write system call. Registers used by the division and the system
+// call are saved, as they may hold values
+static void write_print(MirInstruction &instruction, MirAllocation &allocation,
+                        CodeBuffer &buffer, const std::string &label) {
+  auto a = load_value(allocation, buffer, instruction.a, SCRATCH_REG_A);
+  if (a != SCRATCH_REG_A)
+    x86_64_mov64_reg(buffer, a, SCRATCH_REG_A);
+  std::vector<int> saved_registers = {
+      X86_64_REG_ACCUMULATOR, X86_64_REG_COUNTER, X86_64_REG_DATA,
+      X86_64_REG_SOURCE, X86_64_REG_DESTINATION};
+  for (auto i = saved_registers.begin(); i != saved_registers.end(); i++)
+    x86_64_push64(buffer, *i);
+
+  // Largest number is 20 digits, plus sign and newline
+  const uint32_t buffer_size = 32;
+  x86_64_op64_val(buffer, X86_64_OP_SUB, X86_64_REG_STACK_POINTER,
+                  buffer_size);
+  x86_64_mov64_reg(buffer, X86_64_REG_STACK_POINTER, X86_64_REG_SOURCE);
+  x86_64_op64_val(buffer, X86_64_OP_ADD, X86_64_REG_SOURCE, buffer_size);
+  x86_64_mov32_val(buffer, X86_64_REG_DATA, '\n');
+  x86_64_op64_val(buffer, X86_64_OP_SUB, X86_64_REG_SOURCE, 1);
+  x86_64_mov8_store(buffer, X86_64_REG_SOURCE, 0, X86_64_REG_DATA);
+
+  x86_64_mov64_reg(buffer, SCRATCH_REG_A, X86_64_REG_ACCUMULATOR);
+  if (instruction.is_signed) {
+    x86_64_op64_val(buffer, X86_64_OP_CMP, X86_64_REG_ACCUMULATOR, 0);
+    x86_64_jmp_cond(buffer, X86_64_COND_GREATER_EQUAL, label + "D");
+    x86_64_neg64(buffer, X86_64_REG_ACCUMULATOR);
+    buffer.add_label(label + "D");
+  }
+  x86_64_mov32_val(buffer, X86_64_REG_COUNTER, 10);
+  buffer.add_label(label + "L");
+  x86_64_op32(buffer, X86_64_OP_XOR, X86_64_REG_DATA, X86_64_REG_DATA);
+  x86_64_div64(buffer, X86_64_REG_COUNTER);
+  x86_64_op32_val(buffer, X86_64_OP_ADD, X86_64_REG_DATA, '0');
+  x86_64_op64_val(buffer, X86_64_OP_SUB, X86_64_REG_SOURCE, 1);
+  x86_64_mov8_store(buffer, X86_64_REG_SOURCE, 0, X86_64_REG_DATA);
+  x86_64_op64_val(buffer, X86_64_OP_CMP, X86_64_REG_ACCUMULATOR, 0);
+  x86_64_jmp_cond(buffer, X86_64_COND_NOT_EQUAL, label + "L");
+  if (instruction.is_signed) {
+    x86_64_op64_val(buffer, X86_64_OP_CMP, SCRATCH_REG_A, 0);
+    x86_64_jmp_cond(buffer, X86_64_COND_GREATER_EQUAL, label + "W");
+    x86_64_mov32_val(buffer, X86_64_REG_DATA, '-');
+    x86_64_op64_val(buffer, X86_64_OP_SUB, X86_64_REG_SOURCE, 1);
+    x86_64_mov8_store(buffer, X86_64_REG_SOURCE, 0, X86_64_REG_DATA);
+    buffer.add_label(label + "W");
+  }
+
+  // write (1, source, end of buffer - source)
+  x86_64_mov64_reg(buffer, X86_64_REG_STACK_POINTER, X86_64_REG_DATA);
+  x86_64_op64_val(buffer, X86_64_OP_ADD, X86_64_REG_DATA, buffer_size);
+  x86_64_op64(buffer, X86_64_OP_SUB, X86_64_REG_SOURCE, X86_64_REG_DATA);
+  x86_64_mov32_val(buffer, X86_64_REG_DESTINATION, 1);
+  x86_64_mov32_val(buffer, X86_64_REG_ACCUMULATOR, 1); // write
+  x86_64_syscall(buffer);
+
+  x86_64_op64_val(buffer, X86_64_OP_ADD, X86_64_REG_STACK_POINTER,
+                  buffer_size);
+  for (auto i = saved_registers.rbegin(); i != saved_registers.rend(); i++)
+    x86_64_pop64(buffer, *i);
+}
+
+void mir_write_x86_64(MirFunction &function, MirAllocation &allocation,
+                      CodeBuffer &buffer) {
+  x86_64_push64(buffer, X86_64_REG_STACK_BASE_POINTER);
+  x86_64_mov64_reg(buffer, X86_64_REG_STACK_POINTER,
+                   X86_64_REG_STACK_BASE_POINTER);
+  if (allocation.n_stack_slots > 0) {
+    // Keep the stack 16 byte aligned
+    uint32_t frame_size = (allocation.n_stack_slots * 8 + 15) & ~15;
+    x86_64_op64_val(buffer, X86_64_OP_SUB, X86_64_REG_STACK_POINTER,
+                    frame_size);
+  }
+
+  // Each print has its own labels
+  int n_prints = 0;
+
+  for (auto i = function.instructions.begin(); i != function.instructions.end();
+       i++) {
+    auto &instruction = *i;
+    switch (instruction.opcode) {
+    case MIR_OPCODE_CONSTANT: {
+      auto dest = get_dest(allocation, instruction.dest);
+      // The 32 bit move clears the upper bits and is shorter
+      if (instruction.value <= UINT32_MAX)
+        x86_64_mov32_val(buffer, dest, instruction.value);
+      else
+        x86_64_mov64_val(buffer, dest, instruction.value);
+      store_value(allocation, buffer, instruction.dest);
+      break;
+    }
+    case MIR_OPCODE_COPY: {
+      auto a = load_value(allocation, buffer, instruction.a, SCRATCH_REG_A);
+      auto dest = get_dest(allocation, instruction.dest);
+      if (a != dest)
+        x86_64_mov64_reg(buffer, a, dest);
+      store_value(allocation, buffer, instruction.dest);
+      break;
+    }
+    case MIR_OPCODE_ADD:
+    case MIR_OPCODE_SUBTRACT:
+    case MIR_OPCODE_MULTIPLY:
+      write_binary(instruction, allocation, buffer);
+      break;
+    case MIR_OPCODE_LABEL:
+      buffer.add_label(instruction.label);
+      break;
+    case MIR_OPCODE_JUMP:
+      x86_64_jmp(buffer, instruction.label);
+      break;
+    case MIR_OPCODE_JUMP_IF: {
+      auto a = load_value(allocation, buffer, instruction.a, SCRATCH_REG_A);
+      auto b = load_value(allocation, buffer, instruction.b, SCRATCH_REG_B);
+      x86_64_op64(buffer, X86_64_OP_CMP, b, a);
+      x86_64_jmp_cond(buffer, instruction.condition, instruction.label);
+      break;
+    }
+    case MIR_OPCODE_EXIT: {
+      auto a = load_value(allocation, buffer, instruction.a, SCRATCH_REG_A);
+      x86_64_mov64_reg(buffer, a, X86_64_REG_DESTINATION);
+      x86_64_mov32_val(buffer, X86_64_REG_ACCUMULATOR, 0x3C); // exit
+      x86_64_syscall(buffer);
+      break;
+    }
+    case MIR_OPCODE_PRINT:
+      write_print(instruction, allocation, buffer,
+                  "P" + std::to_string(n_prints++));
+      break;
+    }
+  }
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2020 Robert Ancell.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "x86_64.h"
+
+// Machine level code using an unlimited number of virtual registers, which
+// are assigned to x86-64 registers before code is generated
+
+typedef enum {
+  MIR_OPCODE_CONSTANT, // dest = value
+  MIR_OPCODE_COPY,     // dest = a
+  MIR_OPCODE_ADD,      // dest = a + b
+  MIR_OPCODE_SUBTRACT, // dest = a - b
+  MIR_OPCODE_MULTIPLY, // dest = a * b
+  MIR_OPCODE_LABEL,    // label:
+  MIR_OPCODE_JUMP,     // goto label
+  MIR_OPCODE_JUMP_IF,  // if a condition b goto label
+  MIR_OPCODE_EXIT,     // exit process with status a
+  MIR_OPCODE_PRINT,    // write a in decimal and a newline to stdout
+} MirOpcode;
+
+struct MirInstruction {
+  MirOpcode opcode;
+
+  // Virtual registers, or -1 if not used
+  int dest;
+  int a;
+  int b;
+
+  uint64_t value;
+
+  // X86_64_COND_*
+  int condition;
+
+  // True if a is printed as a signed number
+  bool is_signed;
+
+  std::string label;
+
+  MirInstruction(MirOpcode opcode)
+      : opcode(opcode), dest(-1), a(-1), b(-1), value(0), condition(0),
+        is_signed(false) {}
+};
+
+struct MirFunction {
+  std::vector<MirInstruction> instructions;
+  int n_registers;
+
+  MirFunction() : n_registers(0) {}
+
+  int add_register() { return n_registers++; }
+
+  void add_constant(int dest, uint64_t value);
+  void add_copy(int dest, int a);
+  void add_binary(MirOpcode opcode, int dest, int a, int b);
+  void add_label(const std::string &label);
+  void add_jump(const std::string &label);
+  void add_jump_if(int a, int condition, int b, const std::string &label);
+  void add_exit(int a);
+  void add_print(int a, bool is_signed);
+};
+
+struct MirAllocation {
+  // x86-64 register for each virtual register, or -1 if kept on the stack
+  std::vector<int> registers;
+
+  // Stack slot for each virtual register not in a register, or -1
+  std::vector<int> stack_slots;
+
+  int n_stack_slots;
+
+  MirAllocation() : n_stack_slots(0) {}
+};
+
+// Registers that can be allocated. The stack pointer, base pointer and two
+// scratch registers used for values on the stack are reserved
+std::vector<int> mir_get_allocatable_registers();
+
+// Assigns virtual registers to the available registers using linear scan.
+// Values that don't fit are spilled to the stack, so passing no registers
+// keeps everything on the stack
+void mir_allocate_registers(MirFunction &function,
+                            const std::vector<int> &available_registers,
+                            MirAllocation &allocation);
+
+void mir_write_x86_64(MirFunction &function, MirAllocation &allocation,
+                      CodeBuffer &buffer);
@@ -33,6 +33,48 @@ OperationPrimitiveDefinition::find_member(const std::string &name) {
   return nullptr;
 }
 
+std::shared_ptr<Operation>
+OperationPrimitiveDefinition::find_array_member(const std::string &name) {
+  if (name != "add" && name != "subtract" && name != "fill" &&
+      name != "equals" && name != "sum" && name != "min" && name != "max")
+    return nullptr;
+
+  // Only arrays of integers have built-in methods
+  auto type = this->name->get_text();
+  if (type != "uint8" && type != "int8" && type != "uint16" &&
+      type != "int16" && type != "uint32" && type != "int32" &&
+      type != "uint64" && type != "int64")
+    return nullptr;
+
+  return std::make_shared<OperationArrayMethod>(type, name);
+}
+
+bool OperationArrayMethod::is_constant() { return false; }
+
+std::string OperationArrayMethod::get_data_type() {
+  if (name == "sum")
+    return element_type[0] == 'u' ? "uint64" : "int64";
+  else if (name == "min" || name == "max")
+    return element_type;
+  else if (name == "equals")
+    return "bool";
+  else
+    return "";
+}
+
+std::string OperationArrayMethod::to_string() {
+  return "ARRAY_METHOD(" + name + ")";
+}
+
+std::vector<std::string> OperationArrayMethod::get_parameter_types() {
+  std::vector<std::string> types;
+  if (name == "add" || name == "subtract" || name == "equals")
+    types.push_back(element_type + "[]");
+  else if (name == "fill")
+    types.push_back(element_type);
+  return types;
+}
+
 std::string OperationTypeDefinition::get_data_type() {
   return name->get_text();
 }
@@ -113,8 +155,8 @@ std::string OperationFunctionDefinition::to_string() {
 }
 
 bool OperationCall::is_constant() {
-  // FIXME: Check if parameters are constant
-  return value->is_constant();
+  // Calls may have side effects, so can't be evaluated ahead of time
+  return false;
 }
 
 std::string OperationCall::get_data_type() { return value->get_data_type(); }
@@ -252,3 +294,8 @@ bool OperationPrintFunction::is_constant() { return true; }
 std::string OperationPrintFunction::get_data_type() { return ""; }
 
 std::string OperationPrintFunction::to_string() { return "PRINT"; }
+
+bool data_type_is_signed(const std::string &data_type) {
+  return data_type == "int8" || data_type == "int16" || data_type == "int32" ||
+         data_type == "int64";
+}
@@ -36,12 +36,33 @@ struct OperationPrimitiveDefinition : Operation {
   std::string get_data_type();
   std::string to_string();
   std::shared_ptr<Operation> find_member(const std::string &name);
+  std::shared_ptr<Operation> find_array_member(const std::string &name);
 };
 
+// Built-in method on arrays of a primitive type, e.g. a.sum ()
+struct OperationArrayMethod : Operation {
+  std::string element_type;
+  std::string name;
+
+  OperationArrayMethod(const std::string &element_type,
+                       const std::string &name)
+      : element_type(element_type), name(name) {}
+  bool is_constant();
+  std::string get_data_type();
+  std::string to_string();
+  std::vector<std::string> get_parameter_types();
+};
+
+struct OperationVariableDefinition;
+
 struct OperationTypeDefinition : Operation {
   std::shared_ptr<Token> name;
+  std::vector<std::shared_ptr<OperationVariableDefinition>> fields;
+  std::vector<size_t> field_offsets;
+  size_t size;
 
-  OperationTypeDefinition(std::shared_ptr<Token> &name) : name(name) {}
+  OperationTypeDefinition(std::shared_ptr<Token> &name)
+      : name(name), size(0) {}
   std::string get_data_type();
   std::string to_string();
   std::shared_ptr<Operation> find_member(const std::string &name);
@@ -122,12 +143,21 @@ struct OperationWhile : Operation {
   std::string to_string();
 };
 
-struct OperationFunctionDefinition : Operation {
+struct FunctionBodySource;
+
+// Shared from this so the runner, which only holds plain pointers, can parse a
+// lazy body
+struct OperationFunctionDefinition
+    : Operation,
+      std::enable_shared_from_this<OperationFunctionDefinition> {
   std::shared_ptr<OperationFunctionDefinition> parent;
   std::shared_ptr<OperationDataType> data_type;
   std::shared_ptr<Token> name;
   std::vector<std::shared_ptr<OperationVariableDefinition>> parameters;
 
+  // Set if the body hasn't been parsed yet, see elf_parse_function_body()
+  std::shared_ptr<FunctionBodySource> body_source;
+
   OperationFunctionDefinition(
       std::shared_ptr<OperationDataType> data_type, std::shared_ptr<Token> name,
       std::vector<std::shared_ptr<OperationVariableDefinition>> parameters)
@@ -142,6 +172,8 @@ struct OperationCall : Operation {
   std::shared_ptr<Token> open_paren;
   std::vector<std::shared_ptr<Operation>> parameters;
   std::shared_ptr<Operation> definition;
+  std::shared_ptr<OperationFunctionDefinition> function;
+  std::shared_ptr<OperationArrayMethod> array_method;
 
   OperationCall(std::shared_ptr<Operation> &value,
                 std::shared_ptr<Token> &open_paren,
@@ -227,10 +259,12 @@ struct OperationTextConstant : Operation {
 };
 
 struct OperationArrayConstant : Operation {
+  std::shared_ptr<Token> open_token;
   std::vector<std::shared_ptr<Operation>> values;
 
-  OperationArrayConstant(std::vector<std::shared_ptr<Operation>> &values)
-      : values(values) {}
+  OperationArrayConstant(std::shared_ptr<Token> &open_token,
+                         std::vector<std::shared_ptr<Operation>> &values)
+      : open_token(open_token), values(values) {}
   bool is_constant();
   std::string get_data_type();
   std::string to_string();
@@ -253,10 +287,11 @@ struct OperationMember : Operation {
   std::shared_ptr<Token> member;
   std::shared_ptr<Operation> type_definition;
   std::shared_ptr<Operation> member_definition;
+  int field_index;
 
   OperationMember(std::shared_ptr<Operation> value,
                   std::shared_ptr<Token> member)
-      : value(value), member(member) {}
+      : value(value), member(member), field_index(-1) {}
   bool is_constant();
   std::string get_data_type();
   std::string to_string();
@@ -306,3 +341,6 @@ struct OperationPrintFunction : Operation {
   std::string get_data_type();
   std::string to_string();
 };
+
+// Checks if a data type is a signed integer, e.g. int32
+bool data_type_is_signed(const std::string &data_type);
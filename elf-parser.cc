@@ -10,7 +10,12 @@
 #include "elf-parser.h"
 
 #include "elf-lexer.h"
+#include "elf-reachability.h"
+#include "elf-utf8.h"
 
+#include <algorithm>
+#include <memory>
+#include <stdint.h>
 #include <stdio.h>
 #include <vector>
 
@@ -22,22 +27,75 @@ struct StackFrame {
   StackFrame(std::shared_ptr<Operation> operation) : operation(operation) {}
 };
 
+// Stack frame kept until a function body is parsed. References are weak, as
+// the scope contains the function that keeps this
+struct SavedStackFrame {
+  std::weak_ptr<Operation> operation;
+
+  std::vector<std::weak_ptr<OperationVariableDefinition>> variables;
+
+  SavedStackFrame(StackFrame &frame)
+      : operation(frame.operation),
+        variables(frame.variables.begin(), frame.variables.end()) {}
+};
+
+// Location of an unparsed function body and the scope to resolve it in
+struct FunctionBodySource {
+  const char *data;
+  size_t data_length;
+
+  // Offset of the first token after the open brace
+  size_t offset;
+
+  std::shared_ptr<OperationModule> core_module;
+
+  // Lines of data, shared with the lexer that skipped the body
+  std::shared_ptr<LineTable> lines;
+
+  // Copy of the resolver stack when the function definition was resolved
+  std::vector<SavedStackFrame> stack;
+
+  FunctionBodySource(const char *data, size_t data_length, size_t offset,
+                     std::shared_ptr<OperationModule> core_module)
+      : data(data), data_length(data_length), offset(offset),
+        core_module(core_module) {}
+};
+
 struct Parser {
   const char *data;
   size_t data_length;
 
+  ElfOutput &errors;
+
+  // Tokens are read from the lexer as they are needed, and kept so the parser
+  // can go back to an earlier token
+  Lexer lexer;
   std::vector<std::shared_ptr<Token>> tokens;
   size_t offset;
 
-  std::vector<StackFrame *> stack;
+  // First invalid character found, reported in preference to other errors
+  std::shared_ptr<Token> invalid_token;
+
+  std::vector<std::unique_ptr<StackFrame>> stack;
 
   std::shared_ptr<Token> error_token;
   std::string error_message;
 
   std::shared_ptr<OperationModule> core_module;
 
-  Parser(const char *data, size_t data_length)
-      : data(data), data_length(data_length), offset(0) {}
+  // Parse function bodies now rather than when first called
+  bool eager;
+
+  // Offset in data to stop parsing top-level statements at
+  size_t end_offset;
+
+  // Top-level statements are recorded here if set
+  std::vector<DocumentStatement> *statements;
+
+  Parser(const char *data, size_t data_length, ElfOutput &errors)
+      : data(data), data_length(data_length), errors(errors),
+        lexer(data, data_length), offset(0), eager(true),
+        end_offset(SIZE_MAX), statements(nullptr) {}
 
   void push_stack(std::shared_ptr<Operation> operation);
   void
@@ -77,8 +135,11 @@ struct Parser {
   std::shared_ptr<OperationTypeDefinition> parse_type_definition();
   std::shared_ptr<OperationVariableDefinition> parse_variable_definition();
   std::shared_ptr<OperationFunctionDefinition> parse_function_definition();
+  bool skip_function_body(std::shared_ptr<OperationFunctionDefinition> &op);
   std::shared_ptr<Operation> parse_expression_or_assignment();
   std::shared_ptr<OperationFunctionDefinition> get_current_function();
+  void add_statement(std::shared_ptr<Operation> &operation,
+                     size_t start_offset);
   bool parse_sequence();
   bool resolve_operation(std::shared_ptr<Operation> operation);
   bool
@@ -109,12 +170,12 @@ struct Parser {
 };
 
 void Parser::push_stack(std::shared_ptr<Operation> operation) {
-  stack.push_back(new StackFrame(operation));
+  stack.push_back(std::unique_ptr<StackFrame>(new StackFrame(operation)));
 }
 
 void Parser::add_stack_variable(
     std::shared_ptr<OperationVariableDefinition> definition) {
-  auto frame = stack.back();
+  auto &frame = stack.back();
   frame->variables.push_back(definition);
 }
 
@@ -130,28 +191,27 @@ void Parser::set_error(std::shared_ptr<Token> token,
 }
 
 void Parser::print_error() {
+  std::string text;
   if (error_token != nullptr) {
-    size_t line_offset = 0;
-    size_t line_number = 1;
-    for (size_t i = 0; i < error_token->offset; i++) {
-      if (data[i] == '\n') {
-        line_offset = i + 1;
-        line_number++;
-      }
-    }
-
-    printf("Line %zi:\n", line_number);
-    for (size_t i = line_offset; data[i] != '\0' && data[i] != '\n'; i++)
-      printf("%c", data[i]);
-    printf("\n");
-    for (size_t i = line_offset; i < error_token->offset; i++)
-      printf(" ");
-    for (size_t i = 0; i < error_token->length; i++)
-      printf("^");
-    printf("\n");
+    size_t line_number, column;
+    lexer.lines->get_position(data, error_token->offset, &line_number,
+                              &column);
+    auto line_offset = error_token->offset - column;
+    auto line_end = line_offset;
+    while (line_end < data_length && data[line_end] != '\0' &&
+           data[line_end] != '\n')
+      line_end++;
+
+    text += "Line " + std::to_string(line_number) + ":\n";
+    text.append(data + line_offset, line_end - line_offset);
+    text += "\n";
+    text.append(column, ' ');
+    text.append(error_token->length, '^');
+    text += "\n";
   }
-  printf("%s\n",
-         error_message.empty() ? "<unknown error>" : error_message.c_str());
+  text += error_message.empty() ? "<unknown error>" : error_message;
+  text += "\n";
+  errors.write(text.data(), text.size());
 }
 
 bool Parser::token_text_matches(std::shared_ptr<Token> a,
@@ -208,7 +268,7 @@ Parser::find_variable(std::shared_ptr<Token> token) {
     return nullptr;
 
   for (auto i = stack.rbegin(); i != stack.rend(); i++) {
-    auto frame = *i;
+    auto &frame = *i;
 
     for (auto j = frame->variables.begin(); j != frame->variables.end(); j++) {
       auto definition = *j;
@@ -242,7 +302,17 @@ Parser::find_function(std::shared_ptr<Token> token) {
 }
 
 std::shared_ptr<Token> Parser::current_token() {
-  return offset < tokens.size() ? tokens[offset] : 0;
+  while (offset >= tokens.size()) {
+    if (!tokens.empty() && tokens.back()->type == TOKEN_TYPE_EOF)
+      return 0;
+
+    auto token = lexer.next_token();
+    if (token->type == TOKEN_TYPE_INVALID && invalid_token == nullptr)
+      invalid_token = token;
+    tokens.push_back(token);
+  }
+
+  return tokens[offset];
 }
 
 void Parser::next_token() { offset++; }
@@ -489,7 +559,7 @@ std::shared_ptr<OperationArrayConstant> Parser::parse_array_constant() {
     auto t = current_token();
     if (t->type == TOKEN_TYPE_CLOSE_BRACKET) {
       next_token();
-      return std::make_shared<OperationArrayConstant>(values);
+      return std::make_shared<OperationArrayConstant>(token, values);
     }
 
     if (values.size() > 0) {
@@ -652,9 +722,20 @@ convert_to_data_type(std::shared_ptr<Operation> &operation,
   return std::make_shared<OperationConvert>(operation, to_type);
 }
 
-static bool is_signed(const std::string &data_type) {
-  return data_type == "int8" || data_type == "int16" || data_type == "int32" ||
-         data_type == "int64";
+// Number of bytes used to store a value inline in an object
+static size_t get_data_type_size(const std::string &data_type) {
+  if (data_type == "bool" || data_type == "uint8" || data_type == "int8")
+    return 1;
+  else if (data_type == "uint16" || data_type == "int16")
+    return 2;
+  else if (data_type == "uint32" || data_type == "int32")
+    return 4;
+  else
+    return 8; // 64 bit values and references to other values
+}
+
+static size_t align_size(size_t size, size_t alignment) {
+  return (size + alignment - 1) / alignment * alignment;
 }
 
 std::shared_ptr<Operation> Parser::parse_expression() {
@@ -694,7 +775,7 @@ std::shared_ptr<Operation> Parser::parse_expression() {
     }
 
     auto data_type = value->get_data_type();
-    if (!is_signed(data_type)) {
+    if (!data_type_is_signed(data_type)) {
       set_error(value_token, "Cannot invert " + data_type);
       return nullptr;
     }
@@ -1066,6 +1147,11 @@ Parser::parse_function_definition() {
 
   auto op = std::make_shared<OperationFunctionDefinition>(data_type, name,
                                                           parameters);
+  if (!eager) {
+    if (!skip_function_body(op))
+      return nullptr;
+    return op;
+  }
   push_stack(op);
 
   if (!parse_sequence())
@@ -1082,6 +1168,33 @@ Parser::parse_function_definition() {
   return op;
 }
 
+// Finds the end of a function body by matching braces, so it can be parsed
+// later
+bool Parser::skip_function_body(
+    std::shared_ptr<OperationFunctionDefinition> &op) {
+  op->body_source = std::make_shared<FunctionBodySource>(
+      data, data_length, current_token()->offset, core_module);
+  op->body_source->lines = lexer.lines;
+
+  int depth = 1;
+  while (true) {
+    auto token = current_token();
+    if (token->type == TOKEN_TYPE_EOF) {
+      set_error(token, "Missing function close brace");
+      return false;
+    }
+    next_token();
+
+    if (token->type == TOKEN_TYPE_OPEN_BRACE)
+      depth++;
+    else if (token->type == TOKEN_TYPE_CLOSE_BRACE) {
+      depth--;
+      if (depth == 0)
+        return true;
+    }
+  }
+}
+
 std::shared_ptr<Operation> Parser::parse_expression_or_assignment() {
   auto start_offset = offset;
 
@@ -1114,14 +1227,71 @@ std::shared_ptr<OperationFunctionDefinition> Parser::get_current_function() {
   return nullptr;
 }
 
+static std::string
+get_data_type_name(std::shared_ptr<OperationDataType> &data_type) {
+  return data_type != nullptr ? data_type->get_data_type() : "";
+}
+
+// Describes the symbol a statement defines, or is empty if it doesn't define
+// one
+static std::string get_definition(std::shared_ptr<Operation> &operation) {
+  auto function_definition =
+      std::dynamic_pointer_cast<OperationFunctionDefinition>(operation);
+  if (function_definition != nullptr) {
+    auto definition = "function " +
+                      get_data_type_name(function_definition->data_type) +
+                      " " + function_definition->name->get_text() + " (";
+    for (auto i = function_definition->parameters.begin();
+         i != function_definition->parameters.end(); i++) {
+      if (i != function_definition->parameters.begin())
+        definition += ", ";
+      definition += get_data_type_name((*i)->data_type);
+    }
+    return definition + ")";
+  }
+
+  auto variable_definition =
+      std::dynamic_pointer_cast<OperationVariableDefinition>(operation);
+  if (variable_definition != nullptr)
+    return "variable " + get_data_type_name(variable_definition->data_type) +
+           " " + variable_definition->name->get_text();
+
+  auto type_definition =
+      std::dynamic_pointer_cast<OperationTypeDefinition>(operation);
+  if (type_definition != nullptr)
+    return "type " + type_definition->name->get_text();
+
+  auto primitive_definition =
+      std::dynamic_pointer_cast<OperationPrimitiveDefinition>(operation);
+  if (primitive_definition != nullptr)
+    return "type " + primitive_definition->name->get_text();
+
+  return "";
+}
+
+void Parser::add_statement(std::shared_ptr<Operation> &operation,
+                           size_t start_offset) {
+  DocumentStatement statement;
+  statement.definition = get_definition(operation);
+  auto last_token = tokens[offset - 1];
+  statement.start = tokens[start_offset]->offset;
+  statement.end = last_token->offset + last_token->length;
+  statement.tokens.assign(tokens.begin() + start_offset,
+                          tokens.begin() + offset);
+  statements->push_back(statement);
+}
+
 bool Parser::parse_sequence() {
   auto parent = stack.back()->operation;
+  auto is_top_level = parent == stack.front()->operation;
 
   while (true) {
     // Stop when sequence ends
     if (current_token()->type == TOKEN_TYPE_EOF ||
         current_token()->type == TOKEN_TYPE_CLOSE_BRACE)
       return true;
+    if (is_top_level && current_token()->offset >= end_offset)
+      return true;
 
     // Ignore comments
     if (current_token()->type == TOKEN_TYPE_COMMENT) {
@@ -1129,6 +1299,7 @@ bool Parser::parse_sequence() {
       continue;
     }
 
+    auto start_offset = offset;
     std::shared_ptr<Operation> op = parse_if();
     if (op == nullptr)
       op = parse_else(parent);
@@ -1155,6 +1326,8 @@ bool Parser::parse_sequence() {
     }
 
     parent->children.push_back(op);
+    if (is_top_level && statements != nullptr)
+      add_statement(op, start_offset);
   }
 }
 
@@ -1252,12 +1425,40 @@ bool Parser::resolve_sequence(std::vector<std::shared_ptr<Operation>> &body) {
 
 bool Parser::resolve_array_constant(
     std::shared_ptr<OperationArrayConstant> &operation) {
-  return resolve_sequence(operation->values);
+  push_stack(operation);
+  if (!resolve_sequence(operation->values))
+    return false;
+
+  // Elements are stored at the width of the array type, so convert them all to
+  // a type that can hold every value, e.g. [1, 300] is uint16[]
+  std::vector<std::string> candidate_types;
+  for (auto i = operation->values.begin(); i != operation->values.end(); i++)
+    candidate_types.push_back((*i)->get_data_type());
+  candidate_types.push_back("int16");
+  candidate_types.push_back("int32");
+  candidate_types.push_back("int64");
+  for (auto i = candidate_types.begin(); i != candidate_types.end(); i++) {
+    std::vector<std::shared_ptr<Operation>> values;
+    for (auto j = operation->values.begin(); j != operation->values.end();
+         j++) {
+      auto value = convert_to_data_type(*j, *i);
+      if (value == nullptr)
+        break;
+      values.push_back(value);
+    }
+    if (values.size() == operation->values.size()) {
+      operation->values.swap(values);
+      return true;
+    }
+  }
+
+  set_error(operation->open_token, "Array values have different types");
+  return false;
 }
 
 bool Parser::resolve_index(std::shared_ptr<OperationIndex> &operation) {
-  // FIXME
-  return true;
+  return resolve_operation(operation->value) &&
+         resolve_operation(operation->index);
 }
 
 bool Parser::resolve_module(std::shared_ptr<OperationModule> &operation) {
@@ -1368,8 +1569,15 @@ bool Parser::resolve_call(std::shared_ptr<OperationCall> &operation) {
     return false;
 
   auto symbol = std::dynamic_pointer_cast<OperationSymbol>(operation->value);
-  if (symbol != nullptr)
+  if (symbol != nullptr) {
     operation->definition = symbol->definition;
+
+    // Bind directly to the function so it doesn't need to be looked up at
+    // runtime
+    operation->function =
+        std::dynamic_pointer_cast<OperationFunctionDefinition>(
+            symbol->definition);
+  }
   auto member = std::dynamic_pointer_cast<OperationMember>(operation->value);
   if (member != nullptr)
     operation->definition = member->member_definition;
@@ -1384,8 +1592,13 @@ bool Parser::resolve_call(std::shared_ptr<OperationCall> &operation) {
   auto function_definition =
       std::dynamic_pointer_cast<OperationFunctionDefinition>(
           operation->definition);
-  if (function_definition != nullptr) {
-    auto n_required = function_definition->parameters.size();
+  operation->array_method =
+      std::dynamic_pointer_cast<OperationArrayMethod>(operation->definition);
+  if (function_definition != nullptr || operation->array_method != nullptr) {
+    auto n_required =
+        function_definition != nullptr
+            ? function_definition->parameters.size()
+            : operation->array_method->get_parameter_types().size();
     auto n_provided = operation->parameters.size();
     if (n_provided > n_required) {
       if (n_required == 0)
@@ -1409,7 +1622,26 @@ bool Parser::resolve_call(std::shared_ptr<OperationCall> &operation) {
   }
 
   push_stack(operation);
-  return resolve_sequence(operation->parameters);
+  if (!resolve_sequence(operation->parameters))
+    return false;
+
+  if (operation->array_method != nullptr) {
+    auto parameter_types = operation->array_method->get_parameter_types();
+    for (size_t i = 0; i < parameter_types.size(); i++) {
+      auto conversion =
+          convert_to_data_type(operation->parameters[i], parameter_types[i]);
+      if (conversion == nullptr) {
+        set_error(operation->open_paren,
+                  "Parameter is of type " + parameter_types[i] +
+                      ", but value is of type " +
+                      operation->parameters[i]->get_data_type());
+        return false;
+      }
+      operation->parameters[i] = conversion;
+    }
+  }
+
+  return true;
 }
 
 bool Parser::resolve_function_definition(
@@ -1422,16 +1654,54 @@ bool Parser::resolve_function_definition(
   for (auto i = operation->parameters.begin(); i != operation->parameters.end();
        i++)
     add_stack_variable(*i);
+
+  // Keep the scope to resolve the body in when it is parsed
+  if (operation->body_source != nullptr) {
+    for (auto i = stack.begin(); i != stack.end(); i++)
+      operation->body_source->stack.push_back(SavedStackFrame(**i));
+    pop_stack();
+    return true;
+  }
+
   return resolve_sequence(operation->children);
 }
 
 bool Parser::resolve_type_definition(
     std::shared_ptr<OperationTypeDefinition> &operation) {
   push_stack(operation);
-  return resolve_sequence(operation->children);
+  if (!resolve_sequence(operation->children))
+    return false;
+
+  // Lay out the fields in order like a C struct, with each field aligned to
+  // its size
+  size_t alignment = 1;
+  for (auto i = operation->children.begin(); i != operation->children.end();
+       i++) {
+    auto variable_definition =
+        std::dynamic_pointer_cast<OperationVariableDefinition>(*i);
+    if (variable_definition == nullptr)
+      continue;
+
+    auto size = get_data_type_size(variable_definition->get_data_type());
+    operation->size = align_size(operation->size, size);
+    operation->fields.push_back(variable_definition);
+    operation->field_offsets.push_back(operation->size);
+    operation->size += size;
+    if (size > alignment)
+      alignment = size;
+  }
+  operation->size = align_size(operation->size, alignment);
+
+  return true;
 }
 
 bool Parser::resolve_return(std::shared_ptr<OperationReturn> &operation) {
+  // The body may have been moved into another function since it was parsed,
+  // see elf_document_edit()
+  auto function = get_current_function();
+  if (function != nullptr)
+    operation->function = function;
+
   return resolve_operation(operation->value);
 }
 
@@ -1444,6 +1714,26 @@ bool Parser::resolve_member(std::shared_ptr<OperationMember> &operation) {
     return false;
 
   auto data_type = operation->value->get_data_type();
+  auto member_name = operation->get_member_name();
+
+  // Arrays of primitives have built-in methods
+  if (data_type.size() > 2 &&
+      data_type.compare(data_type.size() - 2, 2, "[]") == 0) {
+    auto primitive_definition =
+        std::dynamic_pointer_cast<OperationPrimitiveDefinition>(
+            find_type(data_type.substr(0, data_type.size() - 2)));
+    if (primitive_definition != nullptr)
+      operation->member_definition =
+          primitive_definition->find_array_member(member_name);
+    if (operation->member_definition == nullptr) {
+      set_error(operation->member, "Array type " + data_type +
+                                       " doesn't have a member named " +
+                                       member_name);
+      return false;
+    }
+    operation->type_definition = primitive_definition;
+    return true;
+  }
 
   auto definition = find_type(data_type);
   if (definition == nullptr) { // FIXME: Should always resolve
@@ -1453,8 +1743,6 @@ bool Parser::resolve_member(std::shared_ptr<OperationMember> &operation) {
   }
   operation->type_definition = definition;
 
-  auto member_name = operation->get_member_name();
-
   auto primitive_definition =
       std::dynamic_pointer_cast<OperationPrimitiveDefinition>(definition);
   if (primitive_definition != nullptr) {
@@ -1478,6 +1766,12 @@ bool Parser::resolve_member(std::shared_ptr<OperationMember> &operation) {
                                        member_name);
       return false;
     }
+
+    for (auto i = type_definition->fields.begin();
+         i != type_definition->fields.end(); i++) {
+      if (*i == operation->member_definition)
+        operation->field_index = i - type_definition->fields.begin();
+    }
   }
 
   return true;
@@ -1515,18 +1809,40 @@ bool Parser::resolve_print_function(
   return true;
 }
 
+static bool check_invalid_token(Parser &parser) {
+  auto invalid_token = parser.invalid_token;
+  if (invalid_token == nullptr)
+    return true;
+
+  parser.error_token = nullptr;
+  if (elf_utf8_get_sequence_length(
+          parser.data + invalid_token->offset,
+          parser.data_length - invalid_token->offset) == 0)
+    parser.set_error(invalid_token, "Invalid UTF-8");
+  else
+    parser.set_error(invalid_token, "Unexpected character");
+  parser.print_error();
+  return false;
+}
+
 static std::shared_ptr<OperationModule>
 parse_module(std::shared_ptr<OperationModule> core_module, const char *data,
-             size_t data_length) {
-  Parser parser(data, data_length);
+             size_t data_length, bool eager, ElfOutput &errors,
+             std::vector<DocumentStatement> *statements) {
+  Parser parser(data, data_length, errors);
 
   parser.core_module = core_module;
-  parser.tokens = elf_lex(data, data_length);
+  parser.eager = eager;
+  parser.statements = statements;
 
   auto module = std::make_shared<OperationModule>();
   parser.push_stack(module);
 
-  if (!parser.parse_sequence()) {
+  auto parsed = parser.parse_sequence();
+  if (!check_invalid_token(parser))
+    return nullptr;
+
+  if (!parsed) {
     parser.print_error();
     return nullptr;
   }
@@ -1537,16 +1853,18 @@ parse_module(std::shared_ptr<OperationModule> core_module, const char *data,
   }
 
   if (parser.current_token()->type != TOKEN_TYPE_EOF) {
-    printf("Expected end of input\n");
+    std::string message = "Expected end of input\n";
+    errors.write(message.data(), message.size());
     return nullptr;
   }
 
   return module;
 }
 
-std::shared_ptr<OperationModule> elf_parse(const char *data,
-                                           size_t data_length) {
-  std::string core_module_source =
+static std::shared_ptr<OperationModule> get_core_module() {
+  // Static, as the core module's tokens point into this and are used when
+  // function bodies are parsed later
+  static const char core_module_source[] =
       "primitive bool {}\n"
       "primitive uint8 {}\n"
       "primitive int8 {}\n"
@@ -1558,10 +1876,278 @@ std::shared_ptr<OperationModule> elf_parse(const char *data,
       "primitive int64 {}\n"
       "primitive utf8 {}\n"; // FIXME: Doesn't need to be primitive?
 
-  auto core_module = parse_module(nullptr, core_module_source.c_str(),
-                                  core_module_source.size());
+  static ElfFileOutput errors(stderr);
+  static auto core_module =
+      parse_module(nullptr, core_module_source,
+                   sizeof(core_module_source) - 1, true, errors, nullptr);
+
+  return core_module;
+}
+
+std::shared_ptr<OperationModule> elf_parse(const char *data, size_t data_length,
+                                           bool eager, ElfOutput &errors) {
+  auto core_module = get_core_module();
   if (core_module == nullptr)
     return nullptr;
 
-  return parse_module(core_module, data, data_length);
+  return parse_module(core_module, data, data_length, eager, errors, nullptr);
+}
+
+bool elf_parse_function_body(
+    std::shared_ptr<OperationFunctionDefinition> &function,
+    ElfOutput &errors) {
+  auto source = function->body_source;
+  function->body_source = nullptr;
+
+  Parser parser(source->data, source->data_length, errors);
+  parser.core_module = source->core_module;
+  parser.eager = false;
+  parser.lexer.offset = source->offset;
+  parser.lexer.validated_length = source->offset;
+  parser.lexer.lines = source->lines;
+
+  parser.push_stack(function);
+  auto parsed = parser.parse_sequence();
+  if (!check_invalid_token(parser))
+    return false;
+  if (!parsed) {
+    parser.print_error();
+    return false;
+  }
+
+  // Resolve in the same scope as the function definition. The function's
+  // frame is removed at the end of the sequence
+  parser.stack.clear();
+  for (auto i = source->stack.begin(); i != source->stack.end(); i++) {
+    parser.push_stack(i->operation.lock());
+    for (auto j = i->variables.begin(); j != i->variables.end(); j++)
+      parser.add_stack_variable(j->lock());
+  }
+  if (!parser.resolve_sequence(function->children)) {
+    parser.print_error();
+    return false;
+  }
+  elf_remove_dead_statements(function->children);
+
+  return true;
+}
+
+static bool reparse_document(std::shared_ptr<Document> &document,
+                             ElfOutput &errors) {
+  document->statements.clear();
+  document->is_dirty = false;
+
+  auto core_module = get_core_module();
+  if (core_module == nullptr)
+    return false;
+
+  document->module =
+      parse_module(core_module, document->text.c_str(), document->text.size(),
+                   true, errors, &document->statements);
+  if (document->module == nullptr) {
+    document->statements.clear();
+    return false;
+  }
+
+  return true;
+}
+
+std::shared_ptr<Document> elf_parse_document(const std::string &text,
+                                             ElfOutput &errors) {
+  auto document = std::make_shared<Document>();
+  document->text = text;
+  reparse_document(document, errors);
+  return document;
+}
+
+// Exchanges the contents of two definitions of the same symbol
+static void swap_definition(std::shared_ptr<Operation> &a,
+                            std::shared_ptr<Operation> &b) {
+  auto function_a = std::dynamic_pointer_cast<OperationFunctionDefinition>(a);
+  auto function_b = std::dynamic_pointer_cast<OperationFunctionDefinition>(b);
+  if (function_a != nullptr && function_b != nullptr) {
+    std::swap(function_a->data_type, function_b->data_type);
+    std::swap(function_a->name, function_b->name);
+    std::swap(function_a->parameters, function_b->parameters);
+    std::swap(function_a->body_source, function_b->body_source);
+    std::swap(function_a->children, function_b->children);
+  }
+
+  auto variable_a = std::dynamic_pointer_cast<OperationVariableDefinition>(a);
+  auto variable_b = std::dynamic_pointer_cast<OperationVariableDefinition>(b);
+  if (variable_a != nullptr && variable_b != nullptr) {
+    std::swap(variable_a->data_type, variable_b->data_type);
+    std::swap(variable_a->name, variable_b->name);
+    std::swap(variable_a->value, variable_b->value);
+  }
+}
+
+bool elf_document_edit(std::shared_ptr<Document> &document, size_t offset,
+                       size_t length, const std::string &text,
+                       ElfOutput &errors) {
+  if (offset > document->text.size())
+    offset = document->text.size();
+  if (length > document->text.size() - offset)
+    length = document->text.size() - offset;
+
+  if (document->module == nullptr) {
+    document->text.replace(offset, length, text);
+    return reparse_document(document, errors);
+  }
+
+  auto &statements = document->statements;
+  auto &children = document->module->children;
+  auto n_statements = statements.size();
+
+  // Find the statements the edit touches, the region between the statements
+  // either side of them is parsed again
+  auto edit_end = offset + length;
+  size_t first = 0;
+  while (first < n_statements && statements[first].end < offset)
+    first++;
+  size_t last = n_statements;
+  while (last > first && statements[last - 1].start > edit_end)
+    last--;
+  if (document->is_dirty) {
+    first = std::min(first, document->dirty_start);
+    last = std::max(last, document->dirty_end);
+  }
+
+  // The statement before the edit may continue into it, and an else is
+  // attached to the if before it
+  if (first > 0)
+    first--;
+  if (first > 0 && std::dynamic_pointer_cast<OperationElse>(children[first]) !=
+                       nullptr)
+    first--;
+  while (last < n_statements &&
+         std::dynamic_pointer_cast<OperationElse>(children[last]) != nullptr)
+    last++;
+
+  auto region_start = first > 0 ? statements[first - 1].end : 0;
+  auto region_end = last < n_statements ? statements[last].start
+                                        : document->text.size();
+
+  // Apply the edit and update the tokens to match
+  auto old_data = document->text.c_str();
+  document->text.replace(offset, length, text);
+  auto data = document->text.c_str();
+  auto data_length = document->text.size();
+  region_end = region_end - length + text.size();
+  auto moved = data != old_data;
+  auto resized = text.size() != length;
+  for (size_t i = moved ? 0 : last; i < n_statements; i++) {
+    auto &statement = statements[i];
+    auto shift = resized && i >= last;
+    if (!moved && !shift)
+      break;
+
+    if (shift) {
+      statement.start = statement.start - length + text.size();
+      statement.end = statement.end - length + text.size();
+    }
+    for (auto j = statement.tokens.begin(); j != statement.tokens.end(); j++) {
+      auto &token = *j;
+      token->data = data;
+      if (shift)
+        token->offset = token->offset - length + text.size();
+    }
+  }
+
+  Parser parser(data, data_length, errors);
+  parser.core_module = get_core_module();
+  parser.lexer.offset = region_start;
+  parser.lexer.validated_length = region_start;
+  parser.end_offset = region_end;
+  std::vector<DocumentStatement> new_statements;
+  parser.statements = &new_statements;
+
+  auto region = std::make_shared<OperationModule>();
+  parser.push_stack(region);
+  auto parsed = parser.parse_sequence();
+  auto valid = check_invalid_token(parser);
+  if (valid && !parsed)
+    parser.print_error();
+  if (!valid || !parsed) {
+    document->is_dirty = true;
+    document->dirty_start = first;
+    document->dirty_end = last;
+    return false;
+  }
+
+  // The region no longer lines up with the following statements
+  if (parser.current_token()->offset != region_end)
+    return reparse_document(document, errors);
+
+  // Other statements may have been resolved against the definitions being
+  // replaced, so if they change everything is resolved again. Types are
+  // always resolved again as their fields are laid out when resolved
+  auto &new_children = region->children;
+  auto same_definitions = true;
+  if (new_children.size() == last - first) {
+    for (size_t i = 0; i < new_children.size(); i++) {
+      auto &definition = new_statements[i].definition;
+      if (definition != statements[first + i].definition ||
+          definition.compare(0, 5, "type ") == 0)
+        same_definitions = false;
+    }
+  } else {
+    for (size_t i = first; i < last; i++)
+      if (!statements[i].definition.empty())
+        same_definitions = false;
+    for (auto i = new_statements.begin(); i != new_statements.end(); i++)
+      if (!i->definition.empty())
+        same_definitions = false;
+  }
+  if (!same_definitions)
+    return reparse_document(document, errors);
+
+  // Move the new definitions into the existing objects so references to them
+  // remain valid. The old contents are kept in case resolving fails
+  std::vector<std::shared_ptr<Operation>> old_definitions;
+  for (size_t i = 0; i < new_children.size(); i++) {
+    if (new_statements[i].definition.empty())
+      continue;
+
+    swap_definition(children[first + i], new_children[i]);
+    old_definitions.push_back(new_children[i]);
+    new_children[i] = children[first + i];
+  }
+
+  // Resolve in the module scope, with the variables defined before the region
+  parser.stack.clear();
+  parser.push_stack(document->module);
+  for (size_t i = 0; i < first; i++) {
+    auto variable_definition =
+        std::dynamic_pointer_cast<OperationVariableDefinition>(children[i]);
+    if (variable_definition != nullptr)
+      parser.add_stack_variable(variable_definition);
+  }
+  for (auto i = new_children.begin(); i != new_children.end(); i++) {
+    if (parser.resolve_operation(*i))
+      continue;
+
+    parser.print_error();
+    auto j = old_definitions.begin();
+    for (size_t k = 0; k < new_children.size(); k++) {
+      if (!new_statements[k].definition.empty()) {
+        swap_definition(children[first + k], *j);
+        j++;
+      }
+    }
+    document->is_dirty = true;
+    document->dirty_start = first;
+    document->dirty_end = last;
+    return false;
+  }
+
+  children.erase(children.begin() + first, children.begin() + last);
+  children.insert(children.begin() + first, new_children.begin(),
+                  new_children.end());
+  statements.erase(statements.begin() + first, statements.begin() + last);
+  statements.insert(statements.begin() + first, new_statements.begin(),
+                    new_statements.end());
+  document->is_dirty = false;
+
+  return true;
 }
@@ -10,9 +10,53 @@
 #pragma once
 
 #include <memory>
+#include <string>
+#include <vector>
 
+#include "elf-lang.h"
 #include "elf-operation.h"
 #include "elf-token.h"
 
-std::shared_ptr<OperationModule> elf_parse(const char *data,
-                                           size_t data_length);
+// Parses and resolves a function body that was skipped by elf_parse()
+bool elf_parse_function_body(
+    std::shared_ptr<OperationFunctionDefinition> &function,
+    ElfOutput &errors);
+
+// A top-level statement in a Document and the tokens it was parsed from
+struct DocumentStatement {
+  size_t start;
+  size_t end;
+  std::vector<std::shared_ptr<Token>> tokens;
+
+  // Symbol this statement defines, empty if it doesn't define one
+  std::string definition;
+};
+
+// Source that is kept parsed as it is edited, e.g. by an editor
+struct Document {
+  std::string text;
+
+  // Resolved module, or nullptr if the text doesn't parse. Out of date while
+  // is_dirty is set
+  std::shared_ptr<OperationModule> module;
+
+  // The statement for each child of module
+  std::vector<DocumentStatement> statements;
+
+  // Set if the last edit failed to parse, statements [dirty_start, dirty_end)
+  // are then out of date and reparsed by the next edit
+  bool is_dirty;
+  size_t dirty_start;
+  size_t dirty_end;
+
+  Document() : is_dirty(false), dirty_start(0), dirty_end(0) {}
+};
+
+std::shared_ptr<Document> elf_parse_document(const std::string &text,
+                                             ElfOutput &errors);
+
+// Replaces length bytes at offset with text. Only the statements touched by
+// the edit are parsed and resolved again, unless they define different symbols
+bool elf_document_edit(std::shared_ptr<Document> &document, size_t offset,
+                       size_t length, const std::string &text,
+                       ElfOutput &errors);
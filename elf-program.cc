@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2020 Robert Ancell.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "elf-lang.h"
+#include "elf-reachability.h"
+
+std::shared_ptr<OperationModule> elf_prepare(const char *data,
+                                             size_t data_length, bool eager,
+                                             size_t inline_threshold,
+                                             ElfOutput &errors) {
+  auto module = elf_parse(data, data_length, eager, errors);
+  if (module == nullptr)
+    return nullptr;
+
+  elf_remove_unreachable_code(module.get());
+  elf_inline_functions(module, inline_threshold);
+
+  return module;
+}
+
+std::shared_ptr<ElfProgram> elf_program_new(const char *data,
+                                            size_t data_length,
+                                            ElfOutput &errors) {
+  auto program = std::make_shared<ElfProgram>();
+  program->source.assign(data, data_length);
+
+  // Parse everything now, as lazily parsed function bodies would be changed
+  // while running
+  program->module =
+      elf_prepare(program->source.c_str(), program->source.size(), true,
+                  ELF_DEFAULT_INLINE_THRESHOLD, errors);
+  if (program->module == nullptr)
+    return nullptr;
+
+  return program;
+}
+
+bool elf_program_run(std::shared_ptr<ElfProgram> program, ElfOutput &output,
+                     ElfOutput &errors) {
+  return elf_run(program->source.c_str(), program->module, output, errors);
+}
@@ -0,0 +1,296 @@
+/*
+ * Copyright (C) 2020 Robert Ancell.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <set>
+
+#include "elf-reachability.h"
+
+// Gets the value of a number constant, which may be converted to the type it's
+// compared with
+static bool get_constant_number(Operation *operation, bool *is_negative,
+                                uint64_t *magnitude) {
+  auto convert = dynamic_cast<OperationConvert *>(operation);
+  if (convert != nullptr)
+    operation = convert->op.get();
+
+  auto number_constant = dynamic_cast<OperationNumberConstant *>(operation);
+  if (number_constant == nullptr)
+    return false;
+  *magnitude = number_constant->magnitude;
+  *is_negative = number_constant->sign_token != nullptr &&
+                 number_constant->magnitude != 0;
+  return true;
+}
+
+// Compares two numbers, returning <0, 0 or >0
+static int compare_numbers(bool a_is_negative, uint64_t a_magnitude,
+                           bool b_is_negative, uint64_t b_magnitude) {
+  if (a_is_negative != b_is_negative)
+    return a_is_negative ? -1 : 1;
+  if (a_magnitude == b_magnitude)
+    return 0;
+  bool a_is_larger = a_magnitude > b_magnitude;
+  return a_is_larger != a_is_negative ? 1 : -1;
+}
+
+static bool get_constant_condition(Operation *operation, bool *value) {
+  if (dynamic_cast<OperationTrue *>(operation) != nullptr) {
+    *value = true;
+    return true;
+  }
+  if (dynamic_cast<OperationFalse *>(operation) != nullptr) {
+    *value = false;
+    return true;
+  }
+
+  auto unary = dynamic_cast<OperationUnary *>(operation);
+  if (unary != nullptr) {
+    if (unary->op->type != TOKEN_TYPE_NOT ||
+        !get_constant_condition(unary->value.get(), value))
+      return false;
+    *value = !*value;
+    return true;
+  }
+
+  auto binary = dynamic_cast<OperationBinary *>(operation);
+  if (binary == nullptr)
+    return false;
+
+  int order;
+  bool a, b;
+  bool a_is_negative, b_is_negative;
+  uint64_t a_magnitude, b_magnitude;
+  if (get_constant_condition(binary->a.get(), &a) &&
+      get_constant_condition(binary->b.get(), &b))
+    order = a == b ? 0 : 1;
+  else if (get_constant_number(binary->a.get(), &a_is_negative,
+                               &a_magnitude) &&
+           get_constant_number(binary->b.get(), &b_is_negative, &b_magnitude))
+    order = compare_numbers(a_is_negative, a_magnitude, b_is_negative,
+                            b_magnitude);
+  else
+    return false;
+
+  switch (binary->op->type) {
+  case TOKEN_TYPE_EQUAL:
+    *value = order == 0;
+    return true;
+  case TOKEN_TYPE_NOT_EQUAL:
+    *value = order != 0;
+    return true;
+  case TOKEN_TYPE_GREATER:
+    *value = order > 0;
+    return true;
+  case TOKEN_TYPE_GREATER_EQUAL:
+    *value = order >= 0;
+    return true;
+  case TOKEN_TYPE_LESS:
+    *value = order < 0;
+    return true;
+  case TOKEN_TYPE_LESS_EQUAL:
+    *value = order <= 0;
+    return true;
+  default:
+    return false;
+  }
+}
+
+void elf_remove_dead_statements(std::vector<std::shared_ptr<Operation>> &body) {
+  std::vector<std::shared_ptr<Operation>> statements;
+  for (size_t i = 0; i < body.size(); i++) {
+    auto &operation = body[i];
+
+    auto if_operation = std::dynamic_pointer_cast<OperationIf>(operation);
+    if (if_operation != nullptr) {
+      auto else_operation = if_operation->else_operation;
+      elf_remove_dead_statements(if_operation->children);
+      if (else_operation != nullptr)
+        elf_remove_dead_statements(else_operation->children);
+
+      // Replace with the block that always runs. Variables are already
+      // resolved, so moving them out of the block doesn't change their meaning
+      bool value;
+      if (get_constant_condition(if_operation->condition.get(), &value)) {
+        if (value)
+          statements.insert(statements.end(), if_operation->children.begin(),
+                            if_operation->children.end());
+        else if (else_operation != nullptr)
+          statements.insert(statements.end(), else_operation->children.begin(),
+                            else_operation->children.end());
+        if (else_operation != nullptr && i + 1 < body.size() &&
+            body[i + 1] == else_operation)
+          i++;
+        if (!statements.empty() &&
+            std::dynamic_pointer_cast<OperationReturn>(statements.back()) !=
+                nullptr)
+          break;
+        continue;
+      }
+    }
+
+    auto while_operation =
+        std::dynamic_pointer_cast<OperationWhile>(operation);
+    if (while_operation != nullptr) {
+      bool value;
+      if (get_constant_condition(while_operation->condition.get(), &value) &&
+          !value)
+        continue;
+      elf_remove_dead_statements(while_operation->children);
+    }
+
+    if (std::dynamic_pointer_cast<OperationFunctionDefinition>(operation) !=
+            nullptr ||
+        std::dynamic_pointer_cast<OperationTypeDefinition>(operation) !=
+            nullptr)
+      elf_remove_dead_statements(operation->children);
+
+    statements.push_back(operation);
+    if (std::dynamic_pointer_cast<OperationReturn>(operation) != nullptr)
+      break;
+  }
+
+  body.swap(statements);
+}
+
+// Finds the functions that can be called from a set of statements
+struct Reachability {
+  std::set<Operation *> functions;
+  std::vector<OperationFunctionDefinition *> unvisited_functions;
+
+  // Set if a reachable function hasn't had its body parsed
+  bool has_unparsed_body;
+
+  Reachability() : has_unparsed_body(false) {}
+
+  void add_function(Operation *operation) {
+    auto function = dynamic_cast<OperationFunctionDefinition *>(operation);
+    if (function == nullptr || !functions.insert(function).second)
+      return;
+    if (function->body_source != nullptr)
+      has_unparsed_body = true;
+    unvisited_functions.push_back(function);
+  }
+
+  void visit_sequence(std::vector<std::shared_ptr<Operation>> &body) {
+    for (auto i = body.begin(); i != body.end(); i++)
+      visit(*i);
+  }
+
+  void visit(std::shared_ptr<Operation> &operation);
+
+  void visit_functions() {
+    while (!unvisited_functions.empty()) {
+      auto function = unvisited_functions.back();
+      unvisited_functions.pop_back();
+      visit_sequence(function->children);
+    }
+  }
+};
+
+void Reachability::visit(std::shared_ptr<Operation> &operation) {
+  if (operation == nullptr)
+    return;
+
+  // Functions are only reachable when used
+  if (std::dynamic_pointer_cast<OperationFunctionDefinition>(operation) !=
+      nullptr)
+    return;
+
+  auto symbol = std::dynamic_pointer_cast<OperationSymbol>(operation);
+  if (symbol != nullptr)
+    add_function(symbol->definition.get());
+  auto type_definition =
+      std::dynamic_pointer_cast<OperationTypeDefinition>(operation);
+  if (type_definition != nullptr)
+    for (auto i = type_definition->fields.begin();
+         i != type_definition->fields.end(); i++)
+      visit((*i)->value);
+  auto variable_definition =
+      std::dynamic_pointer_cast<OperationVariableDefinition>(operation);
+  if (variable_definition != nullptr)
+    visit(variable_definition->value);
+  auto assignment = std::dynamic_pointer_cast<OperationAssignment>(operation);
+  if (assignment != nullptr) {
+    visit(assignment->target);
+    visit(assignment->value);
+  }
+  auto if_operation = std::dynamic_pointer_cast<OperationIf>(operation);
+  if (if_operation != nullptr) {
+    visit(if_operation->condition);
+    if (if_operation->else_operation != nullptr)
+      visit_sequence(if_operation->else_operation->children);
+  }
+  auto while_operation = std::dynamic_pointer_cast<OperationWhile>(operation);
+  if (while_operation != nullptr)
+    visit(while_operation->condition);
+  auto call = std::dynamic_pointer_cast<OperationCall>(operation);
+  if (call != nullptr) {
+    add_function(call->function.get());
+    add_function(call->definition.get());
+    visit(call->value);
+    visit_sequence(call->parameters);
+  }
+  auto return_operation = std::dynamic_pointer_cast<OperationReturn>(operation);
+  if (return_operation != nullptr)
+    visit(return_operation->value);
+  auto assert_operation = std::dynamic_pointer_cast<OperationAssert>(operation);
+  if (assert_operation != nullptr)
+    visit(assert_operation->expression);
+  auto array_constant =
+      std::dynamic_pointer_cast<OperationArrayConstant>(operation);
+  if (array_constant != nullptr)
+    visit_sequence(array_constant->values);
+  auto index = std::dynamic_pointer_cast<OperationIndex>(operation);
+  if (index != nullptr) {
+    visit(index->value);
+    visit(index->index);
+  }
+  auto member = std::dynamic_pointer_cast<OperationMember>(operation);
+  if (member != nullptr) {
+    add_function(member->member_definition.get());
+    visit(member->value);
+  }
+  auto unary = std::dynamic_pointer_cast<OperationUnary>(operation);
+  if (unary != nullptr)
+    visit(unary->value);
+  auto binary = std::dynamic_pointer_cast<OperationBinary>(operation);
+  if (binary != nullptr) {
+    visit(binary->a);
+    visit(binary->b);
+  }
+  auto convert = std::dynamic_pointer_cast<OperationConvert>(operation);
+  if (convert != nullptr)
+    visit(convert->op);
+
+  visit_sequence(operation->children);
+}
+
+void elf_remove_unreachable_code(OperationModule *module) {
+  elf_remove_dead_statements(module->children);
+
+  Reachability reachability;
+  reachability.visit_sequence(module->children);
+  reachability.visit_functions();
+  if (reachability.has_unparsed_body)
+    return;
+
+  std::vector<std::shared_ptr<Operation>> statements;
+  for (auto i = module->children.begin(); i != module->children.end(); i++) {
+    auto function = std::dynamic_pointer_cast<OperationFunctionDefinition>(*i);
+    if (function != nullptr &&
+        reachability.functions.find(function.get()) ==
+            reachability.functions.end()) {
+      // Returns refer back to their function, so clear the body to free it
+      function->children.clear();
+      continue;
+    }
+    statements.push_back(*i);
+  }
+  module->children.swap(statements);
+}
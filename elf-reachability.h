@@ -0,0 +1,25 @@
+/*
+ * Copyright (C) 2020 Robert Ancell.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ */
+
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "elf-operation.h"
+
+// Removes statements that can never run from a sequence and the blocks inside
+// it, i.e. if and while with constant conditions and code after a return
+void elf_remove_dead_statements(std::vector<std::shared_ptr<Operation>> &body);
+
+// Removes dead statements, and functions defined at the top level of a module
+// that are never called from its statements. Functions are only removed if
+// every reachable function body has been parsed, as the calls in a lazily
+// parsed body aren't known yet
+void elf_remove_unreachable_code(OperationModule *module);
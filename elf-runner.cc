@@ -7,19 +7,32 @@
  * (at your option) any later version.
  */
 
-#include "elf-runner.h"
+#include "elf-array.h"
+#include "elf-lang.h"
+#include "elf-lexer.h"
+#include "elf-parser.h"
 
 #include <assert.h>
+#include <map>
 #include <memory>
 #include <stdio.h>
+#include <string.h>
 
 struct DataValue {
   virtual ~DataValue() {}
   virtual std::shared_ptr<DataValue> convert_to(const std::string &data_type);
+  virtual std::shared_ptr<DataValue> copy() = 0;
+  // Number of bytes used when stored inline, 0 if stored as a reference
+  virtual size_t get_size() { return 0; }
+  virtual std::shared_ptr<DataValue> load(const uint8_t *data);
+  virtual void store(uint8_t *data) {}
   virtual std::string print() = 0;
 };
 
 struct DataValueNone : DataValue {
+  std::shared_ptr<DataValue> copy() {
+    return std::make_shared<DataValueNone>();
+  }
   std::string print() { return "none"; }
 };
 
@@ -28,6 +41,16 @@ struct DataValueBool : DataValue {
 
   DataValueBool(bool value) : value(value) {}
   ~DataValueBool() {}
+  std::shared_ptr<DataValue> copy() {
+    return std::make_shared<DataValueBool>(value);
+  }
+  size_t get_size() { return sizeof(value); }
+  std::shared_ptr<DataValue> load(const uint8_t *data) {
+    bool v;
+    memcpy(&v, data, sizeof(v));
+    return std::make_shared<DataValueBool>(v);
+  }
+  void store(uint8_t *data) { memcpy(data, &value, sizeof(value)); }
   std::string print() { return value ? "true" : "false"; }
 };
 
@@ -36,6 +59,16 @@ struct DataValueUint8 : DataValue {
 
   DataValueUint8(uint8_t value) : value(value) {}
   std::shared_ptr<DataValue> convert_to(const std::string &data_type);
+  std::shared_ptr<DataValue> copy() {
+    return std::make_shared<DataValueUint8>(value);
+  }
+  size_t get_size() { return sizeof(value); }
+  std::shared_ptr<DataValue> load(const uint8_t *data) {
+    uint8_t v;
+    memcpy(&v, data, sizeof(v));
+    return std::make_shared<DataValueUint8>(v);
+  }
+  void store(uint8_t *data) { memcpy(data, &value, sizeof(value)); }
   std::string print() { return std::to_string(value); }
 };
 
@@ -44,6 +77,16 @@ struct DataValueInt8 : DataValue {
 
   DataValueInt8(int8_t value) : value(value) {}
   std::shared_ptr<DataValue> convert_to(const std::string &data_type);
+  std::shared_ptr<DataValue> copy() {
+    return std::make_shared<DataValueInt8>(value);
+  }
+  size_t get_size() { return sizeof(value); }
+  std::shared_ptr<DataValue> load(const uint8_t *data) {
+    int8_t v;
+    memcpy(&v, data, sizeof(v));
+    return std::make_shared<DataValueInt8>(v);
+  }
+  void store(uint8_t *data) { memcpy(data, &value, sizeof(value)); }
   std::string print() { return std::to_string(value); }
 };
 
@@ -52,6 +95,16 @@ struct DataValueUint16 : DataValue {
 
   DataValueUint16(uint16_t value) : value(value) {}
   std::shared_ptr<DataValue> convert_to(const std::string &data_type);
+  std::shared_ptr<DataValue> copy() {
+    return std::make_shared<DataValueUint16>(value);
+  }
+  size_t get_size() { return sizeof(value); }
+  std::shared_ptr<DataValue> load(const uint8_t *data) {
+    uint16_t v;
+    memcpy(&v, data, sizeof(v));
+    return std::make_shared<DataValueUint16>(v);
+  }
+  void store(uint8_t *data) { memcpy(data, &value, sizeof(value)); }
   std::string print() { return std::to_string(value); }
 };
 
@@ -60,6 +113,16 @@ struct DataValueInt16 : DataValue {
 
   DataValueInt16(int16_t value) : value(value) {}
   std::shared_ptr<DataValue> convert_to(const std::string &data_type);
+  std::shared_ptr<DataValue> copy() {
+    return std::make_shared<DataValueInt16>(value);
+  }
+  size_t get_size() { return sizeof(value); }
+  std::shared_ptr<DataValue> load(const uint8_t *data) {
+    int16_t v;
+    memcpy(&v, data, sizeof(v));
+    return std::make_shared<DataValueInt16>(v);
+  }
+  void store(uint8_t *data) { memcpy(data, &value, sizeof(value)); }
   std::string print() { return std::to_string(value); }
 };
 
@@ -68,6 +131,16 @@ struct DataValueUint32 : DataValue {
 
   DataValueUint32(uint32_t value) : value(value) {}
   std::shared_ptr<DataValue> convert_to(const std::string &data_type);
+  std::shared_ptr<DataValue> copy() {
+    return std::make_shared<DataValueUint32>(value);
+  }
+  size_t get_size() { return sizeof(value); }
+  std::shared_ptr<DataValue> load(const uint8_t *data) {
+    uint32_t v;
+    memcpy(&v, data, sizeof(v));
+    return std::make_shared<DataValueUint32>(v);
+  }
+  void store(uint8_t *data) { memcpy(data, &value, sizeof(value)); }
   std::string print() { return std::to_string(value); }
 };
 
@@ -76,6 +149,16 @@ struct DataValueInt32 : DataValue {
 
   DataValueInt32(int32_t value) : value(value) {}
   std::shared_ptr<DataValue> convert_to(const std::string &data_type);
+  std::shared_ptr<DataValue> copy() {
+    return std::make_shared<DataValueInt32>(value);
+  }
+  size_t get_size() { return sizeof(value); }
+  std::shared_ptr<DataValue> load(const uint8_t *data) {
+    int32_t v;
+    memcpy(&v, data, sizeof(v));
+    return std::make_shared<DataValueInt32>(v);
+  }
+  void store(uint8_t *data) { memcpy(data, &value, sizeof(value)); }
   std::string print() { return std::to_string(value); }
 };
 
@@ -83,6 +166,16 @@ struct DataValueUint64 : DataValue {
   uint64_t value;
 
   DataValueUint64(uint64_t value) : value(value) {}
+  std::shared_ptr<DataValue> copy() {
+    return std::make_shared<DataValueUint64>(value);
+  }
+  size_t get_size() { return sizeof(value); }
+  std::shared_ptr<DataValue> load(const uint8_t *data) {
+    uint64_t v;
+    memcpy(&v, data, sizeof(v));
+    return std::make_shared<DataValueUint64>(v);
+  }
+  void store(uint8_t *data) { memcpy(data, &value, sizeof(value)); }
   std::string print() { return std::to_string(value); }
 };
 
@@ -90,52 +183,187 @@ struct DataValueInt64 : DataValue {
   int64_t value;
 
   DataValueInt64(int64_t value) : value(value) {}
+  std::shared_ptr<DataValue> copy() {
+    return std::make_shared<DataValueInt64>(value);
+  }
+  size_t get_size() { return sizeof(value); }
+  std::shared_ptr<DataValue> load(const uint8_t *data) {
+    int64_t v;
+    memcpy(&v, data, sizeof(v));
+    return std::make_shared<DataValueInt64>(v);
+  }
+  void store(uint8_t *data) { memcpy(data, &value, sizeof(value)); }
   std::string print() { return std::to_string(value); }
 };
 
 struct DataValueUtf8 : DataValue {
-  std::string value;
+  // Constant text points directly into the program and has no storage
+  const char *text;
+
+  // Text built at runtime is the first length bytes of a buffer shared
+  // between copies. The buffer is only ever appended to, so each value
+  // sharing it still sees the same text
+  std::shared_ptr<std::string> storage;
+
+  size_t length;
+
+  DataValueUtf8(const char *text, size_t length)
+      : text(text), storage(nullptr), length(length) {}
+  DataValueUtf8(std::shared_ptr<std::string> storage, size_t length)
+      : text(nullptr), storage(storage), length(length) {}
+  std::shared_ptr<DataValue> copy() {
+    return std::make_shared<DataValueUtf8>(*this);
+  }
+  const char *get_data() { return storage != nullptr ? storage->data() : text; }
+  bool equals(DataValueUtf8 *other) {
+    return length == other->length &&
+           memcmp(get_data(), other->get_data(), length) == 0;
+  }
+  std::shared_ptr<DataValueUtf8> append(DataValueUtf8 *other) {
+    // If no other value has appended to our buffer, extend it in place. This
+    // makes building text piece by piece linear rather than quadratic
+    if (storage != nullptr && storage.get() != other->storage.get() &&
+        storage->size() == length) {
+      storage->append(other->get_data(), other->length);
+      return std::make_shared<DataValueUtf8>(storage, storage->size());
+    }
 
-  DataValueUtf8(std::string value) : value(value) {}
-  std::string print() { return value; }
+    auto new_storage = std::make_shared<std::string>();
+    new_storage->reserve(length + other->length);
+    new_storage->append(get_data(), length);
+    new_storage->append(other->get_data(), other->length);
+    return std::make_shared<DataValueUtf8>(new_storage, new_storage->size());
+  }
+  std::string print() { return std::string(get_data(), length); }
 };
 
 struct DataValueArray : DataValue {
+  // Default element value, used to load and store elements
+  std::shared_ptr<DataValue> element;
+
+  // Elements stored contiguously, if they can be stored inline. This is
+  // shared between copies until one of them is modified
+  std::shared_ptr<std::vector<uint8_t>> data;
+
+  // Elements stored as references, if they can't be stored inline
   std::vector<std::shared_ptr<DataValue>> values;
 
-  DataValueArray() {}
-  DataValueArray(std::vector<std::shared_ptr<DataValue>> &values)
-      : values(values) {}
+  DataValueArray(std::shared_ptr<DataValue> element)
+      : element(element), data(std::make_shared<std::vector<uint8_t>>()) {}
+  std::shared_ptr<DataValue> copy() {
+    auto array = std::make_shared<DataValueArray>(element);
+    array->data = data;
+    for (auto i = values.begin(); i != values.end(); i++)
+      array->values.push_back((*i)->copy());
+    return array;
+  }
+  const uint8_t *get_data() { return data->data(); }
+  uint8_t *get_writable_data() {
+    if (data.use_count() > 1)
+      data = std::make_shared<std::vector<uint8_t>>(*data);
+    return data->data();
+  }
+  size_t get_length() {
+    auto element_size = element->get_size();
+    return element_size > 0 ? data->size() / element_size : values.size();
+  }
+  std::shared_ptr<DataValue> get_element(size_t index) {
+    auto element_size = element->get_size();
+    if (element_size > 0)
+      return element->load(get_data() + index * element_size);
+    else
+      return values[index];
+  }
+  void set_element(size_t index, std::shared_ptr<DataValue> &value) {
+    auto element_size = element->get_size();
+    if (element_size > 0)
+      value->store(get_writable_data() + index * element_size);
+    else
+      values[index] = value->copy();
+  }
+  void append(std::shared_ptr<DataValue> &value) {
+    auto element_size = element->get_size();
+    if (element_size > 0) {
+      get_writable_data();
+      data->resize(data->size() + element_size);
+      value->store(data->data() + data->size() - element_size);
+    } else
+      values.push_back(value);
+  }
   std::string print() {
     std::string text = "[";
-    for (auto i = values.begin(); i != values.end(); i++) {
-      auto value = *i;
-      if (i != values.begin())
+    auto length = get_length();
+    for (size_t i = 0; i < length; i++) {
+      if (i != 0)
         text += ", ";
-      text += value->print();
+      text += get_element(i)->print();
     }
     text += "]";
     return text;
   }
 };
 
-struct DataValueObject : DataValue {
-  std::vector<std::shared_ptr<DataValue>> values;
+struct ObjectLayout;
 
-  DataValueObject() {}
+struct DataValueObject : DataValue {
+  ObjectLayout *layout;
+
+  // Fields stored inline, laid out like a C struct
+  std::vector<uint8_t> data;
+
+  // Fields that are stored as references, indexed by field
+  std::vector<std::shared_ptr<DataValue>> references;
+
+  DataValueObject(ObjectLayout *layout, size_t size)
+      : layout(layout), data(size) {}
+  std::shared_ptr<DataValue> copy() {
+    auto object = std::make_shared<DataValueObject>(layout, 0);
+    object->data = data;
+    if (!references.empty()) {
+      object->references.resize(references.size());
+      for (size_t i = 0; i < references.size(); i++)
+        if (references[i] != nullptr)
+          object->references[i] = references[i]->copy();
+    }
+    return object;
+  }
   std::string print() { return "{FIXME}"; }
 };
 
+// Memory layout shared by all objects of a type
+struct ObjectLayout {
+  std::vector<size_t> offsets;
+
+  // Default value of each field, used to load inline fields
+  std::vector<std::shared_ptr<DataValue>> fields;
+
+  // Object containing default values, copied to make new objects
+  std::shared_ptr<DataValueObject> default_object;
+
+  ObjectLayout(OperationTypeDefinition *type_definition);
+
+  std::shared_ptr<DataValue> load(DataValueObject *object, size_t index);
+  void store(DataValueObject *object, size_t index,
+             std::shared_ptr<DataValue> &value);
+};
+
 struct DataValueFunction : DataValue {
-  std::shared_ptr<OperationFunctionDefinition> function;
+  // Owned by the module being run
+  OperationFunctionDefinition *function;
 
-  DataValueFunction(std::shared_ptr<OperationFunctionDefinition> &function)
+  DataValueFunction(OperationFunctionDefinition *function)
       : function(function) {}
+  std::shared_ptr<DataValue> copy() {
+    return std::make_shared<DataValueFunction>(function);
+  }
   std::string print() { return "<method>"; }
 };
 
 struct DataValuePrintFunction : DataValue {
   DataValuePrintFunction() {}
+  std::shared_ptr<DataValue> copy() {
+    return std::make_shared<DataValuePrintFunction>();
+  }
   std::string print() { return "<print>"; }
 };
 
@@ -168,21 +396,21 @@ make_signed_integer_value(const std::string &data_type, int64_t value) {
 }
 
 static std::shared_ptr<DataValue>
-make_default_value(std::shared_ptr<OperationDataType> &data_type) {
-  if (data_type->is_array)
-    return std::make_shared<DataValueArray>();
+make_default_value(const std::string &type_name) {
+  if (type_name.size() >= 2 &&
+      type_name.compare(type_name.size() - 2, 2, "[]") == 0)
+    return std::make_shared<DataValueArray>(
+        make_default_value(type_name.substr(0, type_name.size() - 2)));
 
-  auto type_name = data_type->get_data_type();
   if (type_name == "bool")
     return std::make_shared<DataValueBool>(false);
   else if (type_name == "uint8" || type_name == "uint16" ||
            type_name == "uint32" || type_name == "uint64")
     return make_unsigned_integer_value(type_name, 0);
-  else if (type_name == "int8" || type_name == "int16" ||
-           type_name == "int32" || type_name == "int64")
+  else if (data_type_is_signed(type_name))
     return make_signed_integer_value(type_name, 0);
   else if (type_name == "utf8")
-    return std::make_shared<DataValueUtf8>("");
+    return std::make_shared<DataValueUtf8>("", 0);
   else
     return std::make_shared<DataValueNone>();
 }
@@ -191,6 +419,42 @@ std::shared_ptr<DataValue> DataValue::convert_to(const std::string &data_type) {
   return std::make_shared<DataValueNone>();
 };
 
+std::shared_ptr<DataValue> DataValue::load(const uint8_t *data) {
+  return std::make_shared<DataValueNone>();
+}
+
+ObjectLayout::ObjectLayout(OperationTypeDefinition *type_definition)
+    : offsets(type_definition->field_offsets) {
+  default_object =
+      std::make_shared<DataValueObject>(this, type_definition->size);
+  for (auto i = type_definition->fields.begin();
+       i != type_definition->fields.end(); i++) {
+    auto index = i - type_definition->fields.begin();
+    auto value = make_default_value((*i)->get_data_type());
+    fields.push_back(value);
+    store(default_object.get(), index, value);
+  }
+}
+
+std::shared_ptr<DataValue> ObjectLayout::load(DataValueObject *object,
+                                              size_t index) {
+  if (fields[index]->get_size() > 0)
+    return fields[index]->load(object->data.data() + offsets[index]);
+  else
+    return object->references[index];
+}
+
+void ObjectLayout::store(DataValueObject *object, size_t index,
+                         std::shared_ptr<DataValue> &value) {
+  if (fields[index]->get_size() > 0) {
+    value->store(object->data.data() + offsets[index]);
+  } else {
+    if (object->references.empty())
+      object->references.resize(offsets.size());
+    object->references[index] = value->copy();
+  }
+}
+
 std::shared_ptr<DataValue>
 DataValueUint8::convert_to(const std::string &data_type) {
   if (data_type == "uint16" || data_type == "uint32" || data_type == "uint64")
@@ -253,122 +517,161 @@ struct Variable {
       : name(name), value(value) {}
 };
 
+// All state changed while running a program. The module is only read, and the
+// runner uses plain pointers into it so running doesn't touch any shared
+// reference counts. Each run has its own state, so one module can be run on
+// many threads at once
 struct ProgramState {
   const char *data;
 
+  // Where printed text and errors are written
+  ElfOutput &output;
+  ElfOutput &errors;
+
   std::vector<Variable *> variables;
 
+  std::map<OperationTypeDefinition *, ObjectLayout *> object_layouts;
+  std::map<OperationArrayConstant *, std::shared_ptr<DataValueArray>>
+      constant_arrays;
+
   std::shared_ptr<DataValue> return_value;
 
-  std::shared_ptr<OperationAssert> failed_assertion;
+  OperationAssert *failed_assertion;
+
+  // Set if a function body failed to parse when called
+  bool failed_parse;
 
-  ProgramState(const char *data)
-      : data(data), return_value(nullptr), failed_assertion(nullptr) {}
+  // Set if an operation couldn't be completed, which stops the program
+  bool failed_run;
+
+  ProgramState(const char *data, ElfOutput &output, ElfOutput &errors)
+      : data(data), output(output), errors(errors), return_value(nullptr),
+        failed_assertion(nullptr), failed_parse(false), failed_run(false) {}
 
   ~ProgramState() {
     for (auto i = variables.begin(); i != variables.end(); i++)
       delete *i;
+    for (auto i = object_layouts.begin(); i != object_layouts.end(); i++)
+      delete i->second;
   }
 
+  void run_error(std::shared_ptr<Token> &token, const std::string &message);
   void run_sequence(std::vector<std::shared_ptr<Operation>> &body);
+  std::shared_ptr<DataValue> run_module(OperationModule *module);
   std::shared_ptr<DataValue>
-  run_module(std::shared_ptr<OperationModule> &module);
-  std::shared_ptr<DataValue>
-  run_function(std::shared_ptr<OperationFunctionDefinition> &function);
+  run_function(OperationFunctionDefinition *function);
   void add_variable(std::string name, std::shared_ptr<DataValue> value);
+  void remove_variables(size_t length);
+  ObjectLayout *get_object_layout(OperationTypeDefinition *type_definition);
   std::shared_ptr<DataValue> run_variable_definition(
-      std::shared_ptr<OperationVariableDefinition> &operation);
-  std::shared_ptr<DataValue>
-  run_assignment(std::shared_ptr<OperationAssignment> &operation);
-  std::shared_ptr<DataValue> run_if(std::shared_ptr<OperationIf> &operation);
-  std::shared_ptr<DataValue>
-  run_while(std::shared_ptr<OperationWhile> &operation);
-  std::shared_ptr<DataValue>
-  run_symbol(std::shared_ptr<OperationSymbol> &operation);
-  std::shared_ptr<DataValue>
-  run_call(std::shared_ptr<OperationCall> &operation);
+      OperationVariableDefinition *operation);
+  std::shared_ptr<DataValue> run_assignment(OperationAssignment *operation);
   std::shared_ptr<DataValue>
-  run_return(std::shared_ptr<OperationReturn> &operation);
+  run_member_assignment(OperationMember *target, Operation *value);
+  std::shared_ptr<DataValue> run_if(OperationIf *operation);
+  std::shared_ptr<DataValue> run_while(OperationWhile *operation);
+  std::shared_ptr<DataValue> run_symbol(OperationSymbol *operation);
+  std::shared_ptr<DataValue> run_call(OperationCall *operation);
+  std::shared_ptr<DataValue> run_function_call(OperationCall *operation);
+  std::shared_ptr<DataValue> run_array_method(OperationCall *operation);
+  std::shared_ptr<DataValue> run_return(OperationReturn *operation);
+  std::shared_ptr<DataValue> run_assert(OperationAssert *operation);
+  std::shared_ptr<DataValue> run_true(OperationTrue *operation);
+  std::shared_ptr<DataValue> run_false(OperationFalse *operation);
   std::shared_ptr<DataValue>
-  run_assert(std::shared_ptr<OperationAssert> &operation);
+  run_number_constant(OperationNumberConstant *operation);
   std::shared_ptr<DataValue>
-  run_true(std::shared_ptr<OperationTrue> &operation);
+  run_text_constant(OperationTextConstant *operation);
   std::shared_ptr<DataValue>
-  run_false(std::shared_ptr<OperationFalse> &operation);
+  run_array_constant(OperationArrayConstant *operation);
+  std::shared_ptr<DataValue> run_index(OperationIndex *operation);
   std::shared_ptr<DataValue>
-  run_number_constant(std::shared_ptr<OperationNumberConstant> &operation);
+  run_index_assignment(OperationIndex *target, Operation *value);
+  std::shared_ptr<DataValue> run_member(OperationMember *operation);
   std::shared_ptr<DataValue>
-  run_text_constant(std::shared_ptr<OperationTextConstant> &operation);
-  std::shared_ptr<DataValue>
-  run_array_constant(std::shared_ptr<OperationArrayConstant> &operation);
-  std::shared_ptr<DataValue>
-  run_index(std::shared_ptr<OperationIndex> &operation);
-  std::shared_ptr<DataValue>
-  run_member(std::shared_ptr<OperationMember> &operation);
-  std::shared_ptr<DataValue>
-  run_binary_boolean(std::shared_ptr<OperationBinary> &operation,
+  run_binary_boolean(OperationBinary *operation,
                      std::shared_ptr<DataValueBool> &a,
                      std::shared_ptr<DataValueBool> &b);
   std::shared_ptr<DataValue>
-  run_binary_uint8(std::shared_ptr<OperationBinary> &operation,
+  run_binary_uint8(OperationBinary *operation,
                    std::shared_ptr<DataValueUint8> &a,
                    std::shared_ptr<DataValueUint8> &b);
   std::shared_ptr<DataValue>
-  run_binary_int8(std::shared_ptr<OperationBinary> &operation,
+  run_binary_int8(OperationBinary *operation,
                   std::shared_ptr<DataValueInt8> &a,
                   std::shared_ptr<DataValueInt8> &b);
   std::shared_ptr<DataValue>
-  run_binary_uint16(std::shared_ptr<OperationBinary> &operation,
+  run_binary_uint16(OperationBinary *operation,
                     std::shared_ptr<DataValueUint16> &a,
                     std::shared_ptr<DataValueUint16> &b);
   std::shared_ptr<DataValue>
-  run_binary_int16(std::shared_ptr<OperationBinary> &operation,
+  run_binary_int16(OperationBinary *operation,
                    std::shared_ptr<DataValueInt16> &a,
                    std::shared_ptr<DataValueInt16> &b);
   std::shared_ptr<DataValue>
-  run_binary_uint32(std::shared_ptr<OperationBinary> &operation,
+  run_binary_uint32(OperationBinary *operation,
                     std::shared_ptr<DataValueUint32> &a,
                     std::shared_ptr<DataValueUint32> &b);
   std::shared_ptr<DataValue>
-  run_binary_int32(std::shared_ptr<OperationBinary> &operation,
+  run_binary_int32(OperationBinary *operation,
                    std::shared_ptr<DataValueInt32> &a,
                    std::shared_ptr<DataValueInt32> &b);
   std::shared_ptr<DataValue>
-  run_binary_uint64(std::shared_ptr<OperationBinary> &operation,
+  run_binary_uint64(OperationBinary *operation,
                     std::shared_ptr<DataValueUint64> &a,
                     std::shared_ptr<DataValueUint64> &b);
   std::shared_ptr<DataValue>
-  run_binary_int64(std::shared_ptr<OperationBinary> &operation,
+  run_binary_int64(OperationBinary *operation,
                    std::shared_ptr<DataValueInt64> &a,
                    std::shared_ptr<DataValueInt64> &b);
   std::shared_ptr<DataValue>
-  run_binary_text(std::shared_ptr<OperationBinary> &operation,
+  run_binary_text(OperationBinary *operation,
                   std::shared_ptr<DataValueUtf8> &a,
                   std::shared_ptr<DataValueUtf8> &b);
+  std::shared_ptr<DataValue> run_binary(OperationBinary *operation);
+  std::shared_ptr<DataValue> run_convert(OperationConvert *operation);
+  std::shared_ptr<DataValue> run_operation(Operation *operation);
   std::shared_ptr<DataValue>
-  run_binary(std::shared_ptr<OperationBinary> &operation);
-  std::shared_ptr<DataValue>
-  run_convert(std::shared_ptr<OperationConvert> &operation);
-  std::shared_ptr<DataValue>
-  run_operation(std::shared_ptr<Operation> &operation);
+  run_operation(std::shared_ptr<Operation> &operation) {
+    return run_operation(operation.get());
+  }
 };
 
+void ProgramState::run_error(std::shared_ptr<Token> &token,
+                             const std::string &message) {
+  // The source length isn't known here, so only the line number is shown
+  LineTable lines;
+  size_t line_number, column;
+  lines.get_position(data, token->offset, &line_number, &column);
+  auto text = "Line " + std::to_string(line_number) + ":\n" + message + "\n";
+  errors.write(text.data(), text.size());
+  failed_run = true;
+}
+
 void ProgramState::run_sequence(std::vector<std::shared_ptr<Operation>> &body) {
-  for (auto i = body.begin();
-       i != body.end() && failed_assertion == NULL && return_value == NULL;
+  for (auto i = body.begin(); i != body.end() && failed_assertion == NULL &&
+                              return_value == NULL && !failed_parse &&
+                              !failed_run;
        i++) {
     run_operation(*i);
   }
 }
 
-std::shared_ptr<DataValue>
-ProgramState::run_module(std::shared_ptr<OperationModule> &module) {
+std::shared_ptr<DataValue> ProgramState::run_module(OperationModule *module) {
   run_sequence(module->children);
   return std::make_shared<DataValueNone>();
 }
 
 std::shared_ptr<DataValue> ProgramState::run_function(
-    std::shared_ptr<OperationFunctionDefinition> &function) {
+    OperationFunctionDefinition *function) {
+  if (function->body_source != nullptr) {
+    auto f = function->shared_from_this();
+    if (!elf_parse_function_body(f, errors)) {
+      failed_parse = true;
+      return std::make_shared<DataValueNone>();
+    }
+  }
+
   run_sequence(function->children);
 
   auto result = return_value;
@@ -385,31 +688,38 @@ void ProgramState::add_variable(std::string name,
   variables.push_back(new Variable(name, value));
 }
 
+void ProgramState::remove_variables(size_t length) {
+  for (auto i = variables.begin() + length; i != variables.end(); i++)
+    delete *i;
+  variables.resize(length);
+}
+
+ObjectLayout *ProgramState::get_object_layout(
+    OperationTypeDefinition *type_definition) {
+  auto i = object_layouts.find(type_definition);
+  if (i != object_layouts.end())
+    return i->second;
+
+  auto layout = new ObjectLayout(type_definition);
+  object_layouts[type_definition] = layout;
+
+  return layout;
+}
+
 std::shared_ptr<DataValue> ProgramState::run_variable_definition(
-    std::shared_ptr<OperationVariableDefinition> &operation) {
+    OperationVariableDefinition *operation) {
   auto variable_name = operation->name->get_text();
 
-  auto type_definition = std::dynamic_pointer_cast<OperationTypeDefinition>(
-      operation->data_type->type_definition);
+  auto type_definition = dynamic_cast<OperationTypeDefinition *>(
+      operation->data_type->type_definition.get());
   if (type_definition != nullptr) {
-    auto value = std::make_shared<DataValueObject>();
-    for (auto i = type_definition->children.begin();
-         i != type_definition->children.end(); i++) {
-      auto variable_definition =
-          std::dynamic_pointer_cast<OperationVariableDefinition>(*i);
-      if (variable_definition == nullptr)
-        continue;
-
-      auto v = make_default_value(variable_definition->data_type);
-      value->values.push_back(v);
-    }
-
+    auto value = get_object_layout(type_definition)->default_object->copy();
     add_variable(variable_name, value);
   } else if (operation->value != nullptr) {
     auto value = run_operation(operation->value);
     add_variable(variable_name, value);
   } else {
-    auto value = make_default_value(operation->data_type);
+    auto value = make_default_value(operation->get_data_type());
     add_variable(variable_name, value);
   }
 
@@ -417,7 +727,16 @@ std::shared_ptr<DataValue> ProgramState::run_variable_definition(
 }
 
 std::shared_ptr<DataValue>
-ProgramState::run_assignment(std::shared_ptr<OperationAssignment> &operation) {
+ProgramState::run_assignment(OperationAssignment *operation) {
+  // Fields and array elements are loaded as copies, so need to be written
+  // back into the object or array
+  auto member = dynamic_cast<OperationMember *>(operation->target.get());
+  if (member != nullptr)
+    return run_member_assignment(member, operation->value.get());
+  auto index = dynamic_cast<OperationIndex *>(operation->target.get());
+  if (index != nullptr)
+    return run_index_assignment(index, operation->value.get());
+
   auto target_value = run_operation(operation->target);
   auto value = run_operation(operation->value);
 
@@ -470,13 +789,23 @@ ProgramState::run_assignment(std::shared_ptr<OperationAssignment> &operation) {
       std::dynamic_pointer_cast<DataValueUtf8>(target_value);
   auto value_utf8 = std::dynamic_pointer_cast<DataValueUtf8>(value);
   if (target_value_utf8 != nullptr && value_utf8 != nullptr)
-    target_value_utf8->value = value_utf8->value;
+    *target_value_utf8 = *value_utf8;
 
   return std::make_shared<DataValueNone>();
 }
 
 std::shared_ptr<DataValue>
-ProgramState::run_if(std::shared_ptr<OperationIf> &operation) {
+ProgramState::run_member_assignment(OperationMember *target, Operation *value) {
+  auto object_value = std::dynamic_pointer_cast<DataValueObject>(
+      run_operation(target->value));
+  auto v = run_operation(value);
+  if (object_value != nullptr && target->field_index >= 0)
+    object_value->layout->store(object_value.get(), target->field_index, v);
+
+  return std::make_shared<DataValueNone>();
+}
+
+std::shared_ptr<DataValue> ProgramState::run_if(OperationIf *operation) {
   auto value = run_operation(operation->condition);
   auto bool_value = std::dynamic_pointer_cast<DataValueBool>(value);
   if (bool_value == nullptr)
@@ -492,9 +821,8 @@ ProgramState::run_if(std::shared_ptr<OperationIf> &operation) {
   return std::make_shared<DataValueNone>();
 }
 
-std::shared_ptr<DataValue>
-ProgramState::run_while(std::shared_ptr<OperationWhile> &operation) {
-  while (true) {
+std::shared_ptr<DataValue> ProgramState::run_while(OperationWhile *operation) {
+  while (!failed_run) {
     auto value = run_operation(operation->condition);
     auto bool_value = std::dynamic_pointer_cast<DataValueBool>(value);
     if (bool_value == nullptr)
@@ -505,19 +833,21 @@ ProgramState::run_while(std::shared_ptr<OperationWhile> &operation) {
 
     run_sequence(operation->children);
   }
+
+  return std::make_shared<DataValueNone>();
 }
 
 std::shared_ptr<DataValue>
-ProgramState::run_symbol(std::shared_ptr<OperationSymbol> &operation) {
+ProgramState::run_symbol(OperationSymbol *operation) {
   auto name = operation->name->get_text();
 
-  auto function_definition =
-      std::dynamic_pointer_cast<OperationFunctionDefinition>(
-          operation->definition);
+  auto function_definition = dynamic_cast<OperationFunctionDefinition *>(
+      operation->definition.get());
   if (function_definition != nullptr)
     return std::make_shared<DataValueFunction>(function_definition);
 
-  for (auto i = variables.begin(); i != variables.end(); i++) {
+  // Search newest first so the innermost function call takes precedence
+  for (auto i = variables.rbegin(); i != variables.rend(); i++) {
     auto variable = *i;
     if (variable->name == name)
       return variable->value;
@@ -526,8 +856,12 @@ ProgramState::run_symbol(std::shared_ptr<OperationSymbol> &operation) {
   return std::make_shared<DataValueNone>();
 }
 
-std::shared_ptr<DataValue>
-ProgramState::run_call(std::shared_ptr<OperationCall> &operation) {
+std::shared_ptr<DataValue> ProgramState::run_call(OperationCall *operation) {
+  if (operation->function != nullptr)
+    return run_function_call(operation);
+  if (operation->array_method != nullptr)
+    return run_array_method(operation);
+
   auto value = run_operation(operation->value);
 
   std::vector<std::shared_ptr<DataValue>> parameter_values;
@@ -535,9 +869,21 @@ ProgramState::run_call(std::shared_ptr<OperationCall> &operation) {
        i++)
     parameter_values.push_back(run_operation(*i));
 
+  if (failed_parse || failed_run)
+    return std::make_shared<DataValueNone>();
+
   if (std::dynamic_pointer_cast<DataValuePrintFunction>(value) != nullptr) {
-    auto text = parameter_values[0]->print();
-    printf("%s\n", text.c_str());
+    // Write text directly to avoid copying it
+    auto utf8_value =
+        std::dynamic_pointer_cast<DataValueUtf8>(parameter_values[0]);
+    if (utf8_value != nullptr) {
+      output.write(utf8_value->get_data(), utf8_value->length);
+      output.write("\n", 1);
+      return std::make_shared<DataValueNone>();
+    }
+
+    auto text = parameter_values[0]->print() + "\n";
+    output.write(text.data(), text.size());
     return std::make_shared<DataValueNone>();
   }
 
@@ -545,26 +891,139 @@ ProgramState::run_call(std::shared_ptr<OperationCall> &operation) {
   if (function_value == nullptr)
     return std::make_shared<DataValueNone>();
 
-  // FIXME: Use a stack, these variables shouldn't remain after the call
+  auto frame_start = variables.size();
   for (auto i = parameter_values.begin(); i != parameter_values.end(); i++) {
-    auto parameter_definition =
+    auto &parameter_definition =
         function_value->function->parameters[i - parameter_values.begin()];
     auto variable_name = parameter_definition->name->get_text();
     add_variable(variable_name, *i);
   }
 
-  return run_function(function_value->function);
+  auto result = run_function(function_value->function);
+  remove_variables(frame_start);
+
+  return result;
+}
+
+std::shared_ptr<DataValue>
+ProgramState::run_function_call(OperationCall *operation) {
+  auto function = operation->function.get();
+
+  // Evaluate the parameters directly into the new frame. They are left unnamed
+  // until all are evaluated so the parameter expressions can't see them
+  auto frame_start = variables.size();
+  for (auto i = operation->parameters.begin(); i != operation->parameters.end();
+       i++)
+    add_variable("", run_operation(*i));
+  for (size_t i = 0; i < function->parameters.size(); i++)
+    variables[frame_start + i]->name =
+        function->parameters[i]->name->get_text();
+
+  auto result = run_function(function);
+  remove_variables(frame_start);
+
+  return result;
+}
+
+static bool get_array_type(const std::string &data_type, ArrayType *type) {
+  if (data_type == "uint8")
+    *type = ARRAY_TYPE_UINT8;
+  else if (data_type == "int8")
+    *type = ARRAY_TYPE_INT8;
+  else if (data_type == "uint16")
+    *type = ARRAY_TYPE_UINT16;
+  else if (data_type == "int16")
+    *type = ARRAY_TYPE_INT16;
+  else if (data_type == "uint32")
+    *type = ARRAY_TYPE_UINT32;
+  else if (data_type == "int32")
+    *type = ARRAY_TYPE_INT32;
+  else if (data_type == "uint64")
+    *type = ARRAY_TYPE_UINT64;
+  else if (data_type == "int64")
+    *type = ARRAY_TYPE_INT64;
+  else
+    return false;
+  return true;
 }
 
 std::shared_ptr<DataValue>
-ProgramState::run_return(std::shared_ptr<OperationReturn> &operation) {
+ProgramState::run_array_method(OperationCall *operation) {
+  auto &method = operation->array_method;
+
+  auto member = dynamic_cast<OperationMember *>(operation->value.get());
+  auto array = std::dynamic_pointer_cast<DataValueArray>(
+      run_operation(member->value));
+  ArrayType type;
+  if (array == nullptr || !get_array_type(method->element_type, &type))
+    return std::make_shared<DataValueNone>();
+
+  std::vector<std::shared_ptr<DataValue>> parameter_values;
+  for (auto i = operation->parameters.begin(); i != operation->parameters.end();
+       i++)
+    parameter_values.push_back(run_operation(*i));
+
+  std::shared_ptr<DataValueArray> other;
+  size_t length = array->get_length();
+  if (parameter_values.size() > 0)
+    other = std::dynamic_pointer_cast<DataValueArray>(parameter_values[0]);
+
+  // Element-wise operations need an element in other for each one in array
+  if ((method->name == "add" || method->name == "subtract") &&
+      other != nullptr && other->get_length() != length) {
+    run_error(member->member,
+              "Can't " + method->name + " arrays of different lengths");
+    return std::make_shared<DataValueNone>();
+  }
+
+  if (method->name == "add" && other != nullptr) {
+    elf_array_add(type, array->get_writable_data(), other->get_data(),
+                  length);
+  } else if (method->name == "subtract" && other != nullptr) {
+    elf_array_subtract(type, array->get_writable_data(), other->get_data(),
+                       length);
+  } else if (method->name == "fill") {
+    uint8_t value[8];
+    parameter_values[0]->store(value);
+    elf_array_fill(type, array->get_writable_data(), value, length);
+  } else if (method->name == "equals" && other != nullptr) {
+    return std::make_shared<DataValueBool>(
+        other->get_length() == length &&
+        elf_array_equal(type, array->get_data(), other->get_data(), length));
+  } else if (method->name == "sum") {
+    auto sum = elf_array_sum(type, array->get_data(), length);
+    if (elf_array_type_is_signed(type))
+      return std::make_shared<DataValueInt64>(sum);
+    else
+      return std::make_shared<DataValueUint64>(sum);
+  } else if (method->name == "min" || method->name == "max") {
+    // There's no value to return for an empty array
+    if (length == 0) {
+      auto extreme = method->name == "min" ? "minimum" : "maximum";
+      run_error(member->member, std::string("Can't find the ") + extreme +
+                                    " of an empty array");
+      return std::make_shared<DataValueNone>();
+    }
+    uint8_t result[8];
+    if (method->name == "min")
+      elf_array_min(type, array->get_data(), length, result);
+    else
+      elf_array_max(type, array->get_data(), length, result);
+    return array->element->load(result);
+  }
+
+  return std::make_shared<DataValueNone>();
+}
+
+std::shared_ptr<DataValue>
+ProgramState::run_return(OperationReturn *operation) {
   auto value = run_operation(operation->value);
   return_value = value;
   return value;
 }
 
 std::shared_ptr<DataValue>
-ProgramState::run_assert(std::shared_ptr<OperationAssert> &operation) {
+ProgramState::run_assert(OperationAssert *operation) {
   auto value = run_operation(operation->expression);
   auto bool_value = std::dynamic_pointer_cast<DataValueBool>(value);
   if (bool_value == nullptr || !bool_value->value)
@@ -572,18 +1031,16 @@ ProgramState::run_assert(std::shared_ptr<OperationAssert> &operation) {
   return value;
 }
 
-std::shared_ptr<DataValue>
-ProgramState::run_true(std::shared_ptr<OperationTrue> &operation) {
+std::shared_ptr<DataValue> ProgramState::run_true(OperationTrue *operation) {
   return std::make_shared<DataValueBool>(true);
 }
 
-std::shared_ptr<DataValue>
-ProgramState::run_false(std::shared_ptr<OperationFalse> &operation) {
+std::shared_ptr<DataValue> ProgramState::run_false(OperationFalse *operation) {
   return std::make_shared<DataValueBool>(false);
 }
 
 std::shared_ptr<DataValue> ProgramState::run_number_constant(
-    std::shared_ptr<OperationNumberConstant> &operation) {
+    OperationNumberConstant *operation) {
   // FIXME: Catch overflow (numbers > 64 bit not supported)
 
   int64_t sign = operation->sign_token != nullptr ? -1 : 1;
@@ -609,21 +1066,62 @@ std::shared_ptr<DataValue> ProgramState::run_number_constant(
 }
 
 std::shared_ptr<DataValue> ProgramState::run_text_constant(
-    std::shared_ptr<OperationTextConstant> &operation) {
-  return std::make_shared<DataValueUtf8>(operation->value);
+    OperationTextConstant *operation) {
+  return std::make_shared<DataValueUtf8>(operation->value.data(),
+                                         operation->value.size());
 }
 
 std::shared_ptr<DataValue> ProgramState::run_array_constant(
-    std::shared_ptr<OperationArrayConstant> &operation) {
-  std::vector<std::shared_ptr<DataValue>> values;
-  for (auto i = operation->values.begin(); i != operation->values.end(); i++)
-    values.push_back(run_operation(*i));
+    OperationArrayConstant *operation) {
+  // Constant arrays are only built once, and copies share their storage
+  if (operation->is_constant()) {
+    auto i = constant_arrays.find(operation);
+    if (i != constant_arrays.end())
+      return i->second->copy();
+  }
 
-  return std::make_shared<DataValueArray>(values);
+  auto array_type = operation->get_data_type();
+  auto array = std::make_shared<DataValueArray>(
+      make_default_value(array_type.substr(0, array_type.size() - 2)));
+  for (auto i = operation->values.begin(); i != operation->values.end(); i++) {
+    auto value = run_operation(*i);
+    array->append(value);
+  }
+
+  if (operation->is_constant()) {
+    constant_arrays[operation] = array;
+    return array->copy();
+  }
+
+  return array;
 }
 
-std::shared_ptr<DataValue>
-ProgramState::run_index(std::shared_ptr<OperationIndex> &operation) {
+// Arrays can be indexed by any unsigned integer
+static bool get_index(std::shared_ptr<DataValue> &value, uint64_t *index) {
+  auto uint8_value = std::dynamic_pointer_cast<DataValueUint8>(value);
+  if (uint8_value != nullptr) {
+    *index = uint8_value->value;
+    return true;
+  }
+  auto uint16_value = std::dynamic_pointer_cast<DataValueUint16>(value);
+  if (uint16_value != nullptr) {
+    *index = uint16_value->value;
+    return true;
+  }
+  auto uint32_value = std::dynamic_pointer_cast<DataValueUint32>(value);
+  if (uint32_value != nullptr) {
+    *index = uint32_value->value;
+    return true;
+  }
+  auto uint64_value = std::dynamic_pointer_cast<DataValueUint64>(value);
+  if (uint64_value != nullptr) {
+    *index = uint64_value->value;
+    return true;
+  }
+  return false;
+}
+
+std::shared_ptr<DataValue> ProgramState::run_index(OperationIndex *operation) {
   auto value = run_operation(operation->value);
   auto index_value = run_operation(operation->index);
 
@@ -631,53 +1129,45 @@ ProgramState::run_index(std::shared_ptr<OperationIndex> &operation) {
   if (array_value == nullptr)
     return std::make_shared<DataValueNone>();
 
-  auto uint8_index = std::dynamic_pointer_cast<DataValueUint8>(index_value);
-  if (uint8_index != nullptr)
-    return array_value->values[uint8_index->value];
+  uint64_t index;
+  if (get_index(index_value, &index) && index < array_value->get_length())
+    return array_value->get_element(index);
 
   return std::make_shared<DataValueNone>();
 }
 
 std::shared_ptr<DataValue>
-ProgramState::run_member(std::shared_ptr<OperationMember> &operation) {
+ProgramState::run_index_assignment(OperationIndex *target, Operation *value) {
+  auto array_value =
+      std::dynamic_pointer_cast<DataValueArray>(run_operation(target->value));
+  auto index_value = run_operation(target->index);
+  auto v = run_operation(value);
+  if (array_value == nullptr)
+    return std::make_shared<DataValueNone>();
+
+  uint64_t index;
+  if (get_index(index_value, &index) && index < array_value->get_length())
+    array_value->set_element(index, v);
+
+  return std::make_shared<DataValueNone>();
+}
+
+std::shared_ptr<DataValue>
+ProgramState::run_member(OperationMember *operation) {
   auto value = run_operation(operation->value);
 
   auto object_value = std::dynamic_pointer_cast<DataValueObject>(value);
   if (object_value == nullptr)
     return std::make_shared<DataValueNone>();
 
-  auto primitive_definition =
-      std::dynamic_pointer_cast<OperationPrimitiveDefinition>(
-          operation->type_definition);
-  if (primitive_definition != nullptr) {
+  if (operation->field_index < 0)
     return std::make_shared<DataValueNone>();
-  }
-
-  auto type_definition = std::dynamic_pointer_cast<OperationTypeDefinition>(
-      operation->type_definition);
-  if (type_definition != nullptr) {
-    auto member_name = operation->get_member_name();
-    size_t index = 0;
-    for (auto i = type_definition->children.begin();
-         i != type_definition->children.end(); i++) {
-      auto vd = std::dynamic_pointer_cast<OperationVariableDefinition>(*i);
-      if (vd == nullptr)
-        continue;
-
-      if (vd->name->has_text(member_name))
-        return object_value->values[index];
-
-      index++;
-      if (index >= object_value->values.size())
-        break;
-    }
-  }
 
-  return std::make_shared<DataValueNone>();
+  return object_value->layout->load(object_value.get(), operation->field_index);
 }
 
 std::shared_ptr<DataValue>
-ProgramState::run_binary_boolean(std::shared_ptr<OperationBinary> &operation,
+ProgramState::run_binary_boolean(OperationBinary *operation,
                                  std::shared_ptr<DataValueBool> &a,
                                  std::shared_ptr<DataValueBool> &b) {
   switch (operation->op->type) {
@@ -700,7 +1190,7 @@ ProgramState::run_binary_boolean(std::shared_ptr<OperationBinary> &operation,
 }
 
 std::shared_ptr<DataValue>
-ProgramState::run_binary_uint8(std::shared_ptr<OperationBinary> &operation,
+ProgramState::run_binary_uint8(OperationBinary *operation,
                                std::shared_ptr<DataValueUint8> &a,
                                std::shared_ptr<DataValueUint8> &b) {
   switch (operation->op->type) {
@@ -730,7 +1220,7 @@ ProgramState::run_binary_uint8(std::shared_ptr<OperationBinary> &operation,
 }
 
 std::shared_ptr<DataValue>
-ProgramState::run_binary_int8(std::shared_ptr<OperationBinary> &operation,
+ProgramState::run_binary_int8(OperationBinary *operation,
                               std::shared_ptr<DataValueInt8> &a,
                               std::shared_ptr<DataValueInt8> &b) {
   switch (operation->op->type) {
@@ -760,7 +1250,7 @@ ProgramState::run_binary_int8(std::shared_ptr<OperationBinary> &operation,
 }
 
 std::shared_ptr<DataValue>
-ProgramState::run_binary_uint16(std::shared_ptr<OperationBinary> &operation,
+ProgramState::run_binary_uint16(OperationBinary *operation,
                                 std::shared_ptr<DataValueUint16> &a,
                                 std::shared_ptr<DataValueUint16> &b) {
   switch (operation->op->type) {
@@ -790,7 +1280,7 @@ ProgramState::run_binary_uint16(std::shared_ptr<OperationBinary> &operation,
 }
 
 std::shared_ptr<DataValue>
-ProgramState::run_binary_int16(std::shared_ptr<OperationBinary> &operation,
+ProgramState::run_binary_int16(OperationBinary *operation,
                                std::shared_ptr<DataValueInt16> &a,
                                std::shared_ptr<DataValueInt16> &b) {
   switch (operation->op->type) {
@@ -820,7 +1310,7 @@ ProgramState::run_binary_int16(std::shared_ptr<OperationBinary> &operation,
 }
 
 std::shared_ptr<DataValue>
-ProgramState::run_binary_uint32(std::shared_ptr<OperationBinary> &operation,
+ProgramState::run_binary_uint32(OperationBinary *operation,
                                 std::shared_ptr<DataValueUint32> &a,
                                 std::shared_ptr<DataValueUint32> &b) {
   switch (operation->op->type) {
@@ -850,7 +1340,7 @@ ProgramState::run_binary_uint32(std::shared_ptr<OperationBinary> &operation,
 }
 
 std::shared_ptr<DataValue>
-ProgramState::run_binary_int32(std::shared_ptr<OperationBinary> &operation,
+ProgramState::run_binary_int32(OperationBinary *operation,
                                std::shared_ptr<DataValueInt32> &a,
                                std::shared_ptr<DataValueInt32> &b) {
   switch (operation->op->type) {
@@ -880,7 +1370,7 @@ ProgramState::run_binary_int32(std::shared_ptr<OperationBinary> &operation,
 }
 
 std::shared_ptr<DataValue>
-ProgramState::run_binary_uint64(std::shared_ptr<OperationBinary> &operation,
+ProgramState::run_binary_uint64(OperationBinary *operation,
                                 std::shared_ptr<DataValueUint64> &a,
                                 std::shared_ptr<DataValueUint64> &b) {
   switch (operation->op->type) {
@@ -910,7 +1400,7 @@ ProgramState::run_binary_uint64(std::shared_ptr<OperationBinary> &operation,
 }
 
 std::shared_ptr<DataValue>
-ProgramState::run_binary_int64(std::shared_ptr<OperationBinary> &operation,
+ProgramState::run_binary_int64(OperationBinary *operation,
                                std::shared_ptr<DataValueInt64> &a,
                                std::shared_ptr<DataValueInt64> &b) {
   switch (operation->op->type) {
@@ -940,23 +1430,23 @@ ProgramState::run_binary_int64(std::shared_ptr<OperationBinary> &operation,
 }
 
 std::shared_ptr<DataValue>
-ProgramState::run_binary_text(std::shared_ptr<OperationBinary> &operation,
+ProgramState::run_binary_text(OperationBinary *operation,
                               std::shared_ptr<DataValueUtf8> &a,
                               std::shared_ptr<DataValueUtf8> &b) {
   switch (operation->op->type) {
   case TOKEN_TYPE_EQUAL:
-    return std::make_shared<DataValueBool>(a->value == b->value);
+    return std::make_shared<DataValueBool>(a->equals(b.get()));
   case TOKEN_TYPE_NOT_EQUAL:
-    return std::make_shared<DataValueBool>(a->value != b->value);
+    return std::make_shared<DataValueBool>(!a->equals(b.get()));
   case TOKEN_TYPE_ADD:
-    return std::make_shared<DataValueUtf8>(a->value + b->value);
+    return a->append(b.get());
   default:
     return std::make_shared<DataValueNone>();
   }
 }
 
 std::shared_ptr<DataValue>
-ProgramState::run_binary(std::shared_ptr<OperationBinary> &operation) {
+ProgramState::run_binary(OperationBinary *operation) {
   auto a = run_operation(operation->a);
   auto b = run_operation(operation->b);
 
@@ -1007,114 +1497,110 @@ ProgramState::run_binary(std::shared_ptr<OperationBinary> &operation) {
 }
 
 std::shared_ptr<DataValue>
-ProgramState::run_convert(std::shared_ptr<OperationConvert> &operation) {
+ProgramState::run_convert(OperationConvert *operation) {
   auto value = run_operation(operation->op);
   return value->convert_to(operation->data_type);
 }
 
-std::shared_ptr<DataValue>
-ProgramState::run_operation(std::shared_ptr<Operation> &operation) {
-  auto op_module = std::dynamic_pointer_cast<OperationModule>(operation);
+std::shared_ptr<DataValue> ProgramState::run_operation(Operation *operation) {
+  auto op_module = dynamic_cast<OperationModule *>(operation);
   if (op_module != nullptr)
     return run_module(op_module);
 
   auto op_variable_definition =
-      std::dynamic_pointer_cast<OperationVariableDefinition>(operation);
+      dynamic_cast<OperationVariableDefinition *>(operation);
   if (op_variable_definition != nullptr)
     return run_variable_definition(op_variable_definition);
 
-  auto op_assignment =
-      std::dynamic_pointer_cast<OperationAssignment>(operation);
+  auto op_assignment = dynamic_cast<OperationAssignment *>(operation);
   if (op_assignment != nullptr)
     return run_assignment(op_assignment);
 
-  auto op_if = std::dynamic_pointer_cast<OperationIf>(operation);
+  auto op_if = dynamic_cast<OperationIf *>(operation);
   if (op_if != nullptr)
     return run_if(op_if);
 
-  auto op_else = std::dynamic_pointer_cast<OperationElse>(operation);
+  auto op_else = dynamic_cast<OperationElse *>(operation);
   if (op_else != nullptr)
     return std::make_shared<DataValueNone>(); // Resolved in IF
 
-  auto op_while = std::dynamic_pointer_cast<OperationWhile>(operation);
+  auto op_while = dynamic_cast<OperationWhile *>(operation);
   if (op_while != nullptr)
     return run_while(op_while);
 
   auto op_function_definition =
-      std::dynamic_pointer_cast<OperationFunctionDefinition>(operation);
+      dynamic_cast<OperationFunctionDefinition *>(operation);
   if (op_function_definition != nullptr)
     return std::make_shared<DataValueNone>(); // Resolved at compile time
 
-  auto op_type_definition =
-      std::dynamic_pointer_cast<OperationTypeDefinition>(operation);
+  auto op_type_definition = dynamic_cast<OperationTypeDefinition *>(operation);
   if (op_type_definition != nullptr)
     return std::make_shared<DataValueNone>(); // Resolved at compile time
 
-  auto op_print_function =
-      std::dynamic_pointer_cast<OperationPrintFunction>(operation);
+  auto op_print_function = dynamic_cast<OperationPrintFunction *>(operation);
   if (op_print_function != nullptr)
     return std::make_shared<DataValuePrintFunction>();
 
-  auto op_symbol = std::dynamic_pointer_cast<OperationSymbol>(operation);
+  auto op_symbol = dynamic_cast<OperationSymbol *>(operation);
   if (op_symbol != nullptr)
     return run_symbol(op_symbol);
 
-  auto op_call = std::dynamic_pointer_cast<OperationCall>(operation);
+  auto op_call = dynamic_cast<OperationCall *>(operation);
   if (op_call != nullptr)
     return run_call(op_call);
 
-  auto op_return = std::dynamic_pointer_cast<OperationReturn>(operation);
+  auto op_return = dynamic_cast<OperationReturn *>(operation);
   if (op_return != nullptr)
     return run_return(op_return);
 
-  auto op_assert = std::dynamic_pointer_cast<OperationAssert>(operation);
+  auto op_assert = dynamic_cast<OperationAssert *>(operation);
   if (op_assert != nullptr)
     return run_assert(op_assert);
 
-  auto op_true = std::dynamic_pointer_cast<OperationTrue>(operation);
+  auto op_true = dynamic_cast<OperationTrue *>(operation);
   if (op_true != nullptr)
     return run_true(op_true);
 
-  auto op_false = std::dynamic_pointer_cast<OperationFalse>(operation);
+  auto op_false = dynamic_cast<OperationFalse *>(operation);
   if (op_false != nullptr)
     return run_false(op_false);
 
-  auto op_number_constant =
-      std::dynamic_pointer_cast<OperationNumberConstant>(operation);
+  auto op_number_constant = dynamic_cast<OperationNumberConstant *>(operation);
   if (op_number_constant != nullptr)
     return run_number_constant(op_number_constant);
 
-  auto op_text_constant =
-      std::dynamic_pointer_cast<OperationTextConstant>(operation);
+  auto op_text_constant = dynamic_cast<OperationTextConstant *>(operation);
   if (op_text_constant != nullptr)
     return run_text_constant(op_text_constant);
 
-  auto op_array_constant =
-      std::dynamic_pointer_cast<OperationArrayConstant>(operation);
+  auto op_array_constant = dynamic_cast<OperationArrayConstant *>(operation);
   if (op_array_constant != nullptr)
     return run_array_constant(op_array_constant);
 
-  auto op_index = std::dynamic_pointer_cast<OperationIndex>(operation);
+  auto op_index = dynamic_cast<OperationIndex *>(operation);
   if (op_index != nullptr)
     return run_index(op_index);
 
-  auto op_member = std::dynamic_pointer_cast<OperationMember>(operation);
+  auto op_member = dynamic_cast<OperationMember *>(operation);
   if (op_member != nullptr)
     return run_member(op_member);
 
-  auto op_binary = std::dynamic_pointer_cast<OperationBinary>(operation);
+  auto op_binary = dynamic_cast<OperationBinary *>(operation);
   if (op_binary != nullptr)
     return run_binary(op_binary);
 
-  auto op_convert = std::dynamic_pointer_cast<OperationConvert>(operation);
+  auto op_convert = dynamic_cast<OperationConvert *>(operation);
   if (op_convert != nullptr)
     return run_convert(op_convert);
 
   return std::make_shared<DataValueNone>();
 }
 
-void elf_run(const char *data, std::shared_ptr<OperationModule> module) {
-  ProgramState state(data);
+bool elf_run(const char *data, std::shared_ptr<OperationModule> module,
+             ElfOutput &output, ElfOutput &errors) {
+  ProgramState state(data, output, errors);
+
+  state.run_module(module.get());
 
-  state.run_module(module);
+  return !state.failed_parse && !state.failed_run;
 }
@@ -37,6 +37,7 @@ typedef enum {
   TOKEN_TYPE_COMMA,
   TOKEN_TYPE_OPEN_BRACE,
   TOKEN_TYPE_CLOSE_BRACE,
+  TOKEN_TYPE_INVALID,
   TOKEN_TYPE_EOF,
 } TokenType;
 
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2020 Robert Ancell.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ */
+
+#include "elf-utf8.h"
+
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static bool is_continuation(uint8_t c) { return (c & 0xC0) == 0x80; }
+
+size_t elf_utf8_get_sequence_length(const char *data, size_t length) {
+  if (length == 0)
+    return 0;
+
+  auto d = reinterpret_cast<const uint8_t *>(data);
+  uint8_t c = d[0];
+  if (c < 0x80)
+    return 1;
+
+  // Second byte ranges exclude overlong encodings, surrogates and values
+  // above U+10FFFF (RFC 3629)
+  size_t sequence_length;
+  uint8_t min = 0x80, max = 0xBF;
+  if (c >= 0xC2 && c <= 0xDF)
+    sequence_length = 2;
+  else if (c >= 0xE0 && c <= 0xEF) {
+    sequence_length = 3;
+    if (c == 0xE0)
+      min = 0xA0;
+    else if (c == 0xED)
+      max = 0x9F;
+  } else if (c >= 0xF0 && c <= 0xF4) {
+    sequence_length = 4;
+    if (c == 0xF0)
+      min = 0x90;
+    else if (c == 0xF4)
+      max = 0x8F;
+  } else
+    return 0;
+
+  if (length < sequence_length || d[1] < min || d[1] > max)
+    return 0;
+  for (size_t i = 2; i < sequence_length; i++)
+    if (!is_continuation(d[i]))
+      return 0;
+
+  return sequence_length;
+}
+
+size_t elf_utf8_validate(const char *data, size_t length) {
+  size_t offset = 0;
+  while (offset < length) {
+#if defined(__SSE2__)
+    // Skip ASCII 32 bytes at a time, this is most source code
+    while (offset + 32 <= length) {
+      auto a = _mm_loadu_si128(
+          reinterpret_cast<const __m128i *>(data + offset));
+      auto b = _mm_loadu_si128(
+          reinterpret_cast<const __m128i *>(data + offset + 16));
+      if (_mm_movemask_epi8(_mm_or_si128(a, b)) != 0)
+        break;
+      offset += 32;
+    }
+#endif
+
+    // Skip remaining ASCII
+    while (offset < length && static_cast<uint8_t>(data[offset]) < 0x80)
+      offset++;
+    if (offset == length)
+      break;
+
+    auto sequence_length =
+        elf_utf8_get_sequence_length(data + offset, length - offset);
+    if (sequence_length == 0)
+      return offset;
+    offset += sequence_length;
+  }
+
+  return length;
+}
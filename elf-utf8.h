@@ -9,8 +9,10 @@
 
 #pragma once
 
-#include <memory>
+#include <stdlib.h>
 
-#include "elf-operation.h"
+// Number of bytes in the UTF-8 sequence at data, or 0 if not valid
+size_t elf_utf8_get_sequence_length(const char *data, size_t length);
 
-void elf_run(const char *data, std::shared_ptr<OperationModule> module);
+// Offset of the first byte that isn't valid UTF-8, or length if all valid
+size_t elf_utf8_validate(const char *data, size_t length);
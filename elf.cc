@@ -7,7 +7,7 @@
  * (at your option) any later version.
  */
 
-#include <elf.h>
+#include <atomic>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -15,11 +15,13 @@
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <string>
+#include <thread>
 #include <unistd.h>
+#include <vector>
 
-#include "elf-parser.h"
-#include "elf-runner.h"
-#include "x86_64.h"
+#include "elf-io.h"
+#include "elf-lang.h"
 
 static int mmap_file(std::string filename, char **data, size_t *data_length) {
   int fd = open(filename.c_str(), O_RDONLY);
@@ -46,6 +48,10 @@ static int mmap_file(std::string filename, char **data, size_t *data_length) {
       printf("Failed to map file: %s\n", strerror(errno));
       return -1;
     }
+
+    // Source is read from start to end once, so let the kernel read ahead and
+    // drop pages we've passed
+    madvise(data_, data_length_, MADV_SEQUENTIAL);
   }
 
   *data = data_;
@@ -138,136 +144,153 @@ static int run_tutorial(void) {
   return 0;
 }
 
-static int run_elf_source(std::string filename) {
+static bool read_stdin(std::string &data) {
+  if (!elf_read_fd(STDIN_FILENO, data)) {
+    printf("Failed to read from stdin: %s\n", strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+// The whole program is read before it's parsed, as tokens and operations point
+// into the source text, so memory use grows with the size of the input
+static int run_elf_stdin(bool eager, size_t inline_threshold) {
+  std::string data;
+  if (!read_stdin(data))
+    return 1;
+
+  ElfFileOutput output(stdout);
+  auto module = elf_prepare(data.data(), data.size(), eager, inline_threshold,
+                            output);
+  if (module == NULL)
+    return 1;
+
+  if (!elf_run(data.data(), module, output, output))
+    return 1;
+
+  return 0;
+}
+
+static int run_elf_source(std::string filename, bool eager,
+                          size_t inline_threshold) {
+  if (filename == "-")
+    return run_elf_stdin(eager, inline_threshold);
+
   char *data;
   size_t data_length;
   int fd = mmap_file(filename, &data, &data_length);
   if (fd < 0)
     return 1;
 
-  auto module = elf_parse(data, data_length);
+  ElfFileOutput output(stdout);
+  auto module = elf_prepare(data, data_length, eager, inline_threshold, output);
   if (module == NULL) {
     munmap_file(fd, data, data_length);
     return 1;
   }
 
-  elf_run(data, module);
+  auto result = elf_run(data, module, output, output);
 
   munmap_file(fd, data, data_length);
 
-  return 0;
+  return result ? 0 : 1;
 }
 
-static void write_binary(int fd, std::vector<uint8_t> &text,
-                         std::vector<uint8_t> &rodata) {
-  const char *section_names[] = {"", ".shrtrtab", ".text", ".rodata", NULL};
-  size_t shrtrtab_length = 0;
-  for (int i = 0; section_names[i] != NULL; i++)
-    shrtrtab_length += strlen(section_names[i]) + 1;
-
-  char padding[16] = {0};
-  size_t text_padding_length = text.size() % 16;
-  if (text_padding_length > 0)
-    text_padding_length = 16 - text_padding_length;
-  size_t rodata_padding_length = rodata.size() % 16;
-  if (rodata_padding_length > 0)
-    rodata_padding_length = 16 - rodata_padding_length;
-  size_t shrtrtab_padding_length = shrtrtab_length % 16;
-  if (shrtrtab_padding_length > 0)
-    shrtrtab_padding_length = 16 - shrtrtab_padding_length;
-
-  Elf64_Ehdr elf_header = {0};
-  elf_header.e_ident[EI_MAG0] = ELFMAG0;
-  elf_header.e_ident[EI_MAG1] = ELFMAG1;
-  elf_header.e_ident[EI_MAG2] = ELFMAG2;
-  elf_header.e_ident[EI_MAG3] = ELFMAG3;
-  elf_header.e_ident[EI_CLASS] = ELFCLASS64;
-  elf_header.e_ident[EI_DATA] = ELFDATA2LSB;
-  elf_header.e_ident[EI_VERSION] = EV_CURRENT;
-  elf_header.e_type = ET_EXEC;
-  elf_header.e_machine = EM_X86_64;
-  elf_header.e_version = EV_CURRENT;
-  elf_header.e_entry = 0x8000000 + sizeof(Elf64_Ehdr) + sizeof(Elf64_Phdr);
-  elf_header.e_phoff = sizeof(elf_header);
-  elf_header.e_shoff = sizeof(Elf64_Ehdr) + sizeof(Elf64_Phdr) + text.size() +
-                       text_padding_length + rodata.size() +
-                       rodata_padding_length + shrtrtab_length +
-                       shrtrtab_padding_length;
-  elf_header.e_ehsize = sizeof(Elf64_Ehdr);
-  elf_header.e_phentsize = sizeof(Elf64_Phdr);
-  elf_header.e_phnum = 1;
-  elf_header.e_shentsize = sizeof(Elf64_Shdr);
-  elf_header.e_shnum = 4;    // Matches length of section_names
-  elf_header.e_shstrndx = 3; // ".shrtrtab" from section header table
-
-  ssize_t n_written = 0;
-  n_written += write(fd, &elf_header, sizeof(elf_header));
-
-  Elf64_Phdr program_header = {0};
-  program_header.p_type = PT_LOAD;
-  program_header.p_flags = PF_R | PF_X;
-  program_header.p_offset = 0;
-  program_header.p_vaddr = 0x8000000;
-  program_header.p_paddr = 0x8000000;
-  program_header.p_filesz = sizeof(Elf64_Ehdr) + sizeof(Elf64_Phdr) +
-                            text.size() + text_padding_length + rodata.size() +
-                            rodata_padding_length;
-  program_header.p_memsz = program_header.p_filesz;
-
-  n_written += write(fd, &program_header, sizeof(program_header));
-
-  ssize_t text_offset = n_written;
-  n_written += write(fd, text.data(), text.size());
-  n_written += write(fd, padding, text_padding_length);
-
-  ssize_t rodata_offset = n_written;
-  n_written += write(fd, rodata.data(), rodata.size());
-  n_written += write(fd, padding, rodata_padding_length);
-
-  ssize_t shrtrtab_offset = n_written;
-  ssize_t null_name_offset = n_written - shrtrtab_offset;
-  n_written += write(fd, section_names[0], strlen(section_names[0]) + 1);
-  ssize_t shrtrtab_name_offset = n_written - shrtrtab_offset;
-  n_written += write(fd, section_names[1], strlen(section_names[1]) + 1);
-  ssize_t text_name_offset = n_written - shrtrtab_offset;
-  n_written += write(fd, section_names[2], strlen(section_names[2]) + 1);
-  ssize_t rodata_name_offset = n_written - shrtrtab_offset;
-  n_written += write(fd, section_names[3], strlen(section_names[3]) + 1);
-  n_written += write(fd, padding, shrtrtab_padding_length);
-
-  Elf64_Shdr null_section_header = {0};
-  null_section_header.sh_name = null_name_offset;
-  null_section_header.sh_type = SHT_NULL;
-  n_written += write(fd, &null_section_header, sizeof(null_section_header));
-
-  Elf64_Shdr text_section_header = {0};
-  text_section_header.sh_name = text_name_offset;
-  text_section_header.sh_type = SHT_PROGBITS;
-  text_section_header.sh_flags = SHF_ALLOC | SHF_EXECINSTR;
-  text_section_header.sh_addr = 0x8000000 + text_offset;
-  text_section_header.sh_offset = text_offset;
-  text_section_header.sh_size = text.size();
-  n_written += write(fd, &text_section_header, sizeof(text_section_header));
-
-  Elf64_Shdr rodata_section_header = {0};
-  rodata_section_header.sh_name = rodata_name_offset;
-  rodata_section_header.sh_type = SHT_PROGBITS;
-  rodata_section_header.sh_flags = SHF_ALLOC;
-  rodata_section_header.sh_addr = 0x80000000 + rodata_offset;
-  rodata_section_header.sh_offset = rodata_offset;
-  rodata_section_header.sh_size = rodata.size();
-  n_written += write(fd, &rodata_section_header, sizeof(rodata_section_header));
-
-  Elf64_Shdr shrtrtab_section_header = {0};
-  shrtrtab_section_header.sh_name = shrtrtab_name_offset;
-  shrtrtab_section_header.sh_type = SHT_STRTAB;
-  shrtrtab_section_header.sh_offset = shrtrtab_offset;
-  shrtrtab_section_header.sh_size = shrtrtab_length;
-  n_written +=
-      write(fd, &shrtrtab_section_header, sizeof(shrtrtab_section_header));
+struct BatchResult {
+  std::string filename;
+
+  // What the program printed, including any errors
+  ElfStringOutput output;
+
+  int exit_status;
+
+  BatchResult(std::string filename) : filename(filename), exit_status(1) {}
+};
+
+static void run_batch_file(BatchResult &result, bool eager,
+                           size_t inline_threshold) {
+  auto &output = result.output;
+
+  // Read rather than map the file, as many small files are run
+  std::string data;
+  int fd = open(result.filename.c_str(), O_RDONLY);
+  if (fd < 0 || !elf_read_fd(fd, data)) {
+    auto message = "Failed to read file \"" + result.filename +
+                   "\": " + strerror(errno) + "\n";
+    output.write(message.data(), message.size());
+    if (fd >= 0)
+      close(fd);
+    return;
+  }
+  close(fd);
+
+  // Each file has its own module, so lazily parsed bodies are only changed by
+  // the thread running it
+  auto module = elf_prepare(data.data(), data.size(), eager, inline_threshold,
+                            output);
+  if (module == NULL)
+    return;
+
+  if (elf_run(data.data(), module, output, output))
+    result.exit_status = 0;
+}
+
+// Runs many programs in one process, so the cost of starting Elf is only paid
+// once. One JSON object is written per line for each file, in the order given
+static int run_elf_batch(std::vector<std::string> &filenames, bool eager,
+                         size_t inline_threshold, int n_jobs) {
+  // Read filenames from stdin, one per line
+  if (filenames.empty()) {
+    std::string data;
+    if (!read_stdin(data))
+      return 1;
+    size_t start = 0;
+    while (start < data.size()) {
+      auto end = data.find('\n', start);
+      if (end == std::string::npos)
+        end = data.size();
+      if (end > start)
+        filenames.push_back(data.substr(start, end - start));
+      start = end + 1;
+    }
+  }
+
+  std::vector<BatchResult> results;
+  for (auto i = filenames.begin(); i != filenames.end(); i++)
+    results.push_back(BatchResult(*i));
+
+  // Workers take the next file to run until all are done
+  std::atomic<size_t> next_result(0);
+  auto worker = [&results, &next_result, eager, inline_threshold]() {
+    while (true) {
+      auto index = next_result++;
+      if (index >= results.size())
+        return;
+      run_batch_file(results[index], eager, inline_threshold);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int i = 1; i < n_jobs; i++)
+    threads.push_back(std::thread(worker));
+  worker();
+  for (auto i = threads.begin(); i != threads.end(); i++)
+    i->join();
+
+  int exit_status = 0;
+  for (auto i = results.begin(); i != results.end(); i++) {
+    printf("{\"file\": \"%s\", \"exit_status\": %d, \"stdout\": \"%s\"}\n",
+           elf_json_escape(i->filename).c_str(), i->exit_status,
+           elf_json_escape(i->output.text).c_str());
+    if (i->exit_status != 0)
+      exit_status = 1;
+  }
+
+  return exit_status;
 }
 
-static int compile_elf_source(std::string filename) {
+static int compile_elf_source(std::string filename,
+                              const ElfCompileOptions &options,
+                              size_t inline_threshold) {
   if (filename.length() < 5 &&
       filename.compare(0, filename.size() - 4, ".elf") != 0) {
     printf("Elf program doesn't have standard extension, can't determine name "
@@ -282,12 +305,19 @@ static int compile_elf_source(std::string filename) {
   if (fd < 0)
     return 1;
 
-  auto module = elf_parse(data, data_length);
+  ElfFileOutput output(stdout);
+  auto module = elf_prepare(data, data_length, true, inline_threshold, output);
   if (module == NULL) {
     munmap_file(fd, data, data_length);
     return 1;
   }
 
+  std::vector<uint8_t> binary;
+  if (!elf_compile(module, binary, output, options)) {
+    munmap_file(fd, data, data_length);
+    return 1;
+  }
+
   int binary_fd = open(binary_name.c_str(), O_WRONLY | O_CREAT,
                        S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
   if (binary_fd < 0) {
@@ -295,13 +325,12 @@ static int compile_elf_source(std::string filename) {
     return 1;
   }
 
-  std::vector<uint8_t> text;
-  x86_64_mov32_val(text, X86_64_REG_ACCUMULATOR, 0x3C); // exit
-  x86_64_mov32_val(text, X86_64_REG_DESTINATION, 1);    // status = 1
-  x86_64_syscall(text);
-  std::vector<uint8_t> rodata;
-  rodata.push_back(0x00);
-  write_binary(binary_fd, text, rodata);
+  if (write(binary_fd, binary.data(), binary.size()) < 0) {
+    printf("Failed to write program to '%s': %s\n", binary_name.c_str(),
+           strerror(errno));
+    close(binary_fd);
+    return 1;
+  }
 
   close(binary_fd);
 
@@ -314,6 +343,31 @@ static int compile_elf_source(std::string filename) {
   return 0;
 }
 
+static int print_elf_ir(std::string filename, const ElfCompileOptions &options,
+                        size_t inline_threshold) {
+  char *data;
+  size_t data_length;
+  int fd = mmap_file(filename, &data, &data_length);
+  if (fd < 0)
+    return 1;
+
+  ElfFileOutput output(stdout);
+  auto module = elf_prepare(data, data_length, true, inline_threshold, output);
+  if (module == NULL) {
+    munmap_file(fd, data, data_length);
+    return 1;
+  }
+
+  std::string text;
+  auto result = elf_get_ir(module, options, text, output);
+  munmap_file(fd, data, data_length);
+  if (!result)
+    return 1;
+  printf("%s", text.c_str());
+
+  return 0;
+}
+
 int main(int argc, char **argv) {
   std::string command = "help";
   if (argc > 1)
@@ -322,21 +376,60 @@ int main(int argc, char **argv) {
   if (command == "tutorial") {
     return run_tutorial();
   } else if (command == "run") {
-    if (argc < 3) {
+    bool eager = false;
+    bool batch = false;
+    int n_jobs = 1;
+    size_t inline_threshold = ELF_DEFAULT_INLINE_THRESHOLD;
+    std::vector<std::string> filenames;
+    for (int i = 2; i < argc; i++) {
+      if (strcmp(argv[i], "--eager") == 0)
+        eager = true;
+      else if (strncmp(argv[i], "--inline-threshold=", 19) == 0)
+        inline_threshold = strtoul(argv[i] + 19, NULL, 10);
+      else if (strcmp(argv[i], "--batch") == 0)
+        batch = true;
+      else if (strncmp(argv[i], "--jobs=", 7) == 0)
+        n_jobs = atoi(argv[i] + 7);
+      else
+        filenames.push_back(argv[i]);
+    }
+    if (n_jobs < 1) {
+      printf("Number of jobs must be at least one\n");
+      return 1;
+    }
+    if (batch)
+      return run_elf_batch(filenames, eager, inline_threshold, n_jobs);
+    const char *filename = NULL;
+    if (!filenames.empty())
+      filename = filenames.back().c_str();
+    if (filename == NULL) {
       printf("Need file to run, run elf help for more information\n");
       return 1;
     }
-    const char *filename = argv[2];
 
-    return run_elf_source(filename);
-  } else if (command == "compile") {
-    if (argc < 3) {
+    return run_elf_source(filename, eager, inline_threshold);
+  } else if (command == "compile" || command == "ir") {
+    ElfCompileOptions options;
+    size_t inline_threshold = ELF_DEFAULT_INLINE_THRESHOLD;
+    const char *filename = NULL;
+    for (int i = 2; i < argc; i++) {
+      if (strcmp(argv[i], "--stack-only") == 0)
+        options.allocate_registers = false;
+      else if (strncmp(argv[i], "--inline-threshold=", 19) == 0)
+        inline_threshold = strtoul(argv[i] + 19, NULL, 10);
+      else if (strcmp(argv[i], "--no-optimize") == 0)
+        options.optimize = false;
+      else
+        filename = argv[i];
+    }
+    if (filename == NULL) {
       printf("Need file to compile, run elf help for more information\n");
       return 1;
     }
-    const char *filename = argv[2];
 
-    return compile_elf_source(filename);
+    if (command == "ir")
+      return print_elf_ir(filename, options, inline_threshold);
+    return compile_elf_source(filename, options, inline_threshold);
   } else if (command == "version") {
     printf("%s\n", VERSION);
     return 0;
@@ -348,8 +441,23 @@ int main(int argc, char **argv) {
         "\n"
         "Usage:\n"
         "  elf tutorial        - Get an introduction to Elf\n"
-        "  elf run <file>      - Run an elf program\n"
+        "  elf run <file>      - Run an elf program, - to read from stdin\n"
+        "    --eager           - Check all functions before running\n"
+        "    --batch           - Run many files, or files listed on stdin,\n"
+        "                        and write JSON results\n"
+        "    --jobs=<n>        - Number of files to run at once in batch mode\n"
+        "    --inline-threshold=<n>\n"
+        "                      - Largest function to inline, 0 to not inline.\n"
+        "                        Only functions checked with --eager are\n"
+        "                        inlined\n"
         "  elf compile <file>  - Compile an elf program\n"
+        "    --stack-only      - Don't keep values in registers\n"
+        "    --no-optimize     - Don't optimise the program\n"
+        "    --inline-threshold=<n>\n"
+        "                      - Largest function to inline, 0 to not inline\n"
+        "  elf ir <file>       - Show the intermediate representation the\n"
+        "                        compiler uses for a program\n"
+        "    --no-optimize     - Show it before optimising\n"
         "  elf version         - Show the version of the Elf tool\n"
         "  elf help            - Show help information\n");
     return 0;
@@ -0,0 +1,195 @@
+/*
+ * Copyright (C) 2020 Robert Ancell.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "elf-lang.h"
+#include "elf-parser.h"
+
+// Checks that editing a document gives the same result as parsing the edited
+// text from scratch
+
+// Replaces the first occurrence of old_text with new_text
+struct DocumentEdit {
+  const char *old_text;
+  const char *new_text;
+};
+
+struct DocumentTest {
+  const char *name;
+  const char *text;
+  std::vector<DocumentEdit> edits;
+};
+
+static std::vector<DocumentTest> document_tests = {
+    {"edit-function-body",
+     "uint8 add (uint8 a, uint8 b) {\n"
+     "   return a + b\n"
+     "}\n"
+     "print (add (1, 2))\n",
+     {{"a + b", "a * b"}, {"add (1, 2)", "add (30, 4)"}}},
+    {"edit-variable-value",
+     "uint8 x = 1\n"
+     "print (x)\n"
+     "print ('done')\n",
+     {{"= 1", "= 200"}, {"print ('done')", "print ('finished')"}}},
+    {"rename-function",
+     "uint8 add (uint8 a, uint8 b) {\n"
+     "   return a + b\n"
+     "}\n"
+     "print (add (1, 2))\n",
+     {{"uint8 add", "uint8 sum"}, {"print (add", "print (sum"}}},
+    {"rename-variable",
+     "uint8 x = 1\n"
+     "print (x)\n",
+     {{"uint8 x", "uint8 y"}, {"print (x)", "print (y)"}}},
+    {"change-variable-type",
+     "uint8 x = 1\n"
+     "print (x)\n",
+     {{"uint8 x = 1", "uint16 x = 300"}}},
+    {"edit-type",
+     "type Point {\n"
+     "  uint8 x\n"
+     "  uint8 y\n"
+     "}\n"
+     "Point p\n"
+     "p.x = 1\n"
+     "p.y = 2\n"
+     "print (p.x)\n"
+     "print (p.y)\n",
+     {{"uint8 y", "uint16 y"}, {"p.y = 2", "p.y = 300"}, {"uint8 x", "bool x"},
+      {"p.x = 1", "p.x = true"}}},
+    {"fix-parse-error",
+     "uint8 add (uint8 a, uint8 b) {\n"
+     "   return a + b\n"
+     "}\n"
+     "print (add (1, 2))\n",
+     {{"a + b", "a +"}, {"a +", "a - b"}, {"print (add (1, 2))", "print ((("},
+      {"print (((", "print (add (5, 2))"}}},
+    {"add-and-remove-statements",
+     "uint8 x = 1\n"
+     "print (x)\n",
+     {{"print (x)\n", "print (x)\nprint (x)\nuint8 y = 2\nprint (y)\n"},
+      {"uint8 y = 2\nprint (y)\n", ""}}},
+    {"edit-else",
+     "if true {\n"
+     "   print ('yes')\n"
+     "} else {\n"
+     "   print ('no')\n"
+     "}\n",
+     {{"'no'", "'never'"}, {"if true", "if false"}}},
+};
+
+static bool tokens_match(std::shared_ptr<Token> &a, std::shared_ptr<Token> &b) {
+  return a->type == b->type && a->offset == b->offset &&
+         a->length == b->length && a->get_text() == b->get_text();
+}
+
+// Returns an empty string if the document is the same as one parsed from its
+// text, otherwise describes the difference
+static std::string compare_document(std::shared_ptr<Document> &document,
+                                    bool edit_parsed) {
+  ElfStringOutput errors;
+  auto expected = elf_parse_document(document->text, errors);
+  if (!edit_parsed) {
+    if (expected->module != nullptr)
+      return "edit failed, but text parses";
+    return "";
+  }
+  if (expected->module == nullptr)
+    return "edit succeeded, but text doesn't parse";
+  if (document->module == nullptr || document->is_dirty)
+    return "edit succeeded, but document not parsed";
+
+  auto &statements = document->statements;
+  auto &expected_statements = expected->statements;
+  if (statements.size() != expected_statements.size())
+    return "got " + std::to_string(statements.size()) + " statements, " +
+           "expected " + std::to_string(expected_statements.size());
+  if (document->module->children.size() != statements.size())
+    return "module has different number of children to statements";
+  for (size_t i = 0; i < statements.size(); i++) {
+    auto &statement = statements[i];
+    auto &expected_statement = expected_statements[i];
+    auto prefix = "statement " + std::to_string(i) + ": ";
+    if (statement.start != expected_statement.start ||
+        statement.end != expected_statement.end)
+      return prefix + "range differs";
+    if (statement.definition != expected_statement.definition)
+      return prefix + "defines \"" + statement.definition + "\", expected \"" +
+             expected_statement.definition + "\"";
+    if (statement.tokens.size() != expected_statement.tokens.size())
+      return prefix + "number of tokens differs";
+    for (size_t j = 0; j < statement.tokens.size(); j++) {
+      auto &token = statement.tokens[j];
+      if (token->data != document->text.c_str())
+        return prefix + "token doesn't point to document text";
+      if (!tokens_match(token, expected_statement.tokens[j]))
+        return prefix + "token '" + token->get_text() + "' at offset " +
+               std::to_string(token->offset) + " doesn't match";
+    }
+  }
+
+  // Definitions are resolved correctly if the program does the same thing
+  ElfStringOutput output, expected_output;
+  auto ran = elf_run(document->text.c_str(), document->module, output, output);
+  auto expected_ran = elf_run(expected->text.c_str(), expected->module,
+                              expected_output, expected_output);
+  if (ran != expected_ran || output.text != expected_output.text)
+    return "program output \"" + output.text + "\", expected \"" +
+           expected_output.text + "\"";
+
+  return "";
+}
+
+static bool run_document_test(DocumentTest &test) {
+  ElfStringOutput errors;
+  auto document = elf_parse_document(test.text, errors);
+  if (document->module == nullptr) {
+    printf("FAIL %s: initial text doesn't parse\n%s", test.name,
+           errors.text.c_str());
+    return false;
+  }
+
+  for (size_t i = 0; i < test.edits.size(); i++) {
+    auto &edit = test.edits[i];
+    auto offset = document->text.find(edit.old_text);
+    if (offset == std::string::npos) {
+      printf("FAIL %s: edit %zu, \"%s\" not in document\n", test.name, i,
+             edit.old_text);
+      return false;
+    }
+
+    ElfStringOutput edit_errors;
+    auto parsed =
+        elf_document_edit(document, offset, std::string(edit.old_text).size(),
+                          edit.new_text, edit_errors);
+    auto message = compare_document(document, parsed);
+    if (message != "") {
+      printf("FAIL %s: edit %zu, %s\n", test.name, i, message.c_str());
+      return false;
+    }
+  }
+
+  printf("PASS %s\n", test.name);
+  return true;
+}
+
+int main(int argc, char **argv) {
+  size_t n_failed = 0;
+  for (auto i = document_tests.begin(); i != document_tests.end(); i++)
+    if (!run_document_test(*i))
+      n_failed++;
+  printf("%zu tests, %zu failed\n", document_tests.size(), n_failed);
+
+  return n_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
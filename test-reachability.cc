@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2020 Robert Ancell.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "elf-lang.h"
+#include "elf-operation.h"
+
+// Checks which statements and functions are left in a module after
+// elf_prepare() removes the code that can never run
+
+struct ReachabilityTest {
+  const char *name;
+  const char *text;
+  bool eager;
+
+  // Outline of the module that is left, see get_outline()
+  const char *outline;
+};
+
+static std::vector<ReachabilityTest> reachability_tests = {
+    {"dead-statements",
+     "uint8 double (uint8 value) {\n"
+     "   return value * 2\n"
+     "   print ('Bad News')\n"
+     "}\n"
+     "if 3 == 3 {\n"
+     "   print ('Hello')\n"
+     "} else {\n"
+     "   print ('Bad News')\n"
+     "}\n"
+     "while 2 < 1 {\n"
+     "   print ('Bad News')\n"
+     "}\n"
+     "if 1 != 1 {\n"
+     "   print ('Bad News')\n"
+     "}\n"
+     "print (double (4))\n",
+     true,
+     "function double\n"
+     "  RETURN(BINARY)\n"
+     "CALL\n"
+     "CALL\n"},
+    {"uncalled-functions",
+     "unused () {\n"
+     "   print ('Bad News')\n"
+     "}\n"
+     "helper () {\n"
+     "   print ('Hello')\n"
+     "}\n"
+     "called () {\n"
+     "   helper ()\n"
+     "}\n"
+     "only_called_by_unused () {\n"
+     "   print ('Bad News')\n"
+     "}\n"
+     "also_unused () {\n"
+     "   only_called_by_unused ()\n"
+     "}\n"
+     "called ()\n",
+     true,
+     "function helper\n"
+     "  CALL\n"
+     "function called\n"
+     "  CALL\n"
+     "CALL\n"},
+    {"called-in-dead-code",
+     "unused () {\n"
+     "   print ('Bad News')\n"
+     "}\n"
+     "if false {\n"
+     "   unused ()\n"
+     "}\n"
+     "print ('Hello')\n",
+     true,
+     "CALL\n"},
+    {"called-in-condition",
+     "bool ready () {\n"
+     "   return true\n"
+     "}\n"
+     "if ready () {\n"
+     "   print ('Hello')\n"
+     "}\n",
+     true,
+     "function ready\n"
+     "  RETURN(TRUE)\n"
+     "IF\n"
+     "  CALL\n"},
+    // Bodies that aren't parsed yet may call any function, so none are removed
+    {"lazy-bodies-kept",
+     "unused () {\n"
+     "   print ('Bad News')\n"
+     "}\n"
+     "called () {\n"
+     "   print ('Hello')\n"
+     "}\n"
+     "if false {\n"
+     "   unused ()\n"
+     "}\n"
+     "called ()\n",
+     false,
+     "function unused\n"
+     "function called\n"
+     "CALL\n"},
+};
+
+// Describes each statement on its own line, with the statements inside it
+// indented below
+static void get_outline(std::vector<std::shared_ptr<Operation>> &body,
+                        const std::string &indent, std::string &outline) {
+  for (auto i = body.begin(); i != body.end(); i++) {
+    auto function = std::dynamic_pointer_cast<OperationFunctionDefinition>(*i);
+    if (function != nullptr)
+      outline += indent + "function " + function->name->get_text() + "\n";
+    else
+      outline += indent + (*i)->to_string() + "\n";
+    get_outline((*i)->children, indent + "  ", outline);
+  }
+}
+
+static bool run_reachability_test(ReachabilityTest &test) {
+  ElfStringOutput errors;
+  std::string text = test.text;
+  auto module = elf_prepare(text.data(), text.size(), test.eager, 0, errors);
+  if (module == nullptr) {
+    printf("FAIL %s: doesn't parse\n%s", test.name, errors.text.c_str());
+    return false;
+  }
+
+  std::string outline;
+  get_outline(module->children, "", outline);
+  if (outline != test.outline) {
+    printf("FAIL %s: got outline\n%sexpected\n%s", test.name, outline.c_str(),
+           test.outline);
+    return false;
+  }
+
+  printf("PASS %s\n", test.name);
+  return true;
+}
+
+int main(int argc, char **argv) {
+  size_t n_failed = 0;
+  for (auto i = reachability_tests.begin(); i != reachability_tests.end(); i++)
+    if (!run_reachability_test(*i))
+      n_failed++;
+  printf("%zu tests, %zu failed\n", reachability_tests.size(), n_failed);
+
+  return n_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
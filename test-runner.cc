@@ -7,20 +7,28 @@
  * (at your option) any later version.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <dirent.h>
 #include <fcntl.h>
 #include <fstream>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <string>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <thread>
 #include <unistd.h>
 #include <vector>
 
+#include "elf-lang.h"
+
 static bool fd_readall(int fd, std::vector<uint8_t> &buffer) {
   while (true) {
-    uint8_t read_buffer[1024];
-    auto n_read = read(fd, read_buffer, 1024);
+    uint8_t read_buffer[65536];
+    auto n_read = read(fd, read_buffer, sizeof(read_buffer));
     if (n_read < 0) {
       printf("Failed to read\n");
       return false;
@@ -31,75 +39,299 @@ static bool fd_readall(int fd, std::vector<uint8_t> &buffer) {
   }
 }
 
+// Returns false if the file doesn't exist, e.g. a test without expected output
 static bool file_readall(std::string &pathname, std::vector<uint8_t> &buffer) {
   auto fd = open(pathname.c_str(), O_RDONLY);
-  if (fd < 0) {
-    printf("Failed to open %s\n", pathname.c_str());
+  if (fd < 0)
     return false;
+
+  auto result = fd_readall(fd, buffer);
+  close(fd);
+  return result;
+}
+
+static int read_expected_exit_status(std::string &pathname) {
+  int expected_exit_status = 0;
+  std::ifstream s(pathname);
+  s >> expected_exit_status;
+  return expected_exit_status;
+}
+
+struct TestResult {
+  std::string name;
+  bool passed;
+
+  // Why the test failed
+  std::string message;
+
+  double duration_ms;
+
+  TestResult(std::string name) : name(name), passed(false), duration_ms(0) {}
+};
+
+static void run_test_in_process(const std::string &directory,
+                                TestResult &result) {
+  auto source_path = directory + "/" + result.name;
+  auto expected_stdout_path = source_path + ".stdout";
+  auto expected_exit_status_path = source_path + ".exit_status";
+
+  std::vector<uint8_t> source;
+  if (!file_readall(source_path, source)) {
+    result.message = "Failed to read " + source_path;
+    return;
   }
 
-  return fd_readall(fd, buffer);
+  // Same as elf run, which writes errors to stdout
+  auto start_time = std::chrono::steady_clock::now();
+  ElfStringOutput output;
+  auto data = reinterpret_cast<const char *>(source.data());
+  auto module = elf_prepare(data, source.size(), false,
+                            ELF_DEFAULT_INLINE_THRESHOLD, output);
+  int exit_status = 1;
+  if (module != nullptr && elf_run(data, module, output, output))
+    exit_status = 0;
+  auto end_time = std::chrono::steady_clock::now();
+  result.duration_ms =
+      std::chrono::duration<double, std::milli>(end_time - start_time).count();
+
+  std::vector<uint8_t> expected_stdout_data;
+  file_readall(expected_stdout_path, expected_stdout_data);
+  int expected_exit_status =
+      read_expected_exit_status(expected_exit_status_path);
+
+  if (exit_status != expected_exit_status)
+    result.message = "Elf exited with status " + std::to_string(exit_status);
+  else if (output.text != std::string(expected_stdout_data.begin(),
+                                      expected_stdout_data.end()))
+    result.message = "stdout does not match expected";
+  else
+    result.passed = true;
 }
 
-int main(int argc, char **argv) {
-  if (argc != 3) {
-    printf("Usage: test-runner <path-to-elf> <file>\n");
+// Runs every test in a directory using the Elf library, without starting a
+// process for each test. Each test's output is captured separately
+static int run_in_process(const char *directory, int n_jobs) {
+  auto dir = opendir(directory);
+  if (dir == nullptr) {
+    printf("Failed to open %s\n", directory);
     return EXIT_FAILURE;
   }
-  const char *elf_path = argv[1];
-  const char *source_path = argv[2];
-  auto expected_stdout_path = std::string(source_path) + ".stdout";
-  auto expected_exit_status_path = std::string(source_path) + ".exit_status";
+  std::vector<std::string> names;
+  while (true) {
+    auto entry = readdir(dir);
+    if (entry == nullptr)
+      break;
+    std::string name = entry->d_name;
+    if (name.size() > 4 && name.compare(name.size() - 4, 4, ".elf") == 0)
+      names.push_back(name);
+  }
+  closedir(dir);
+  std::sort(names.begin(), names.end());
+
+  std::vector<TestResult> results;
+  for (auto i = names.begin(); i != names.end(); i++)
+    results.push_back(TestResult(*i));
+
+  // Workers take the next test to run until all are done
+  auto start_time = std::chrono::steady_clock::now();
+  std::string dir_path = directory;
+  std::atomic<size_t> next_result(0);
+  auto worker = [&results, &next_result, &dir_path]() {
+    while (true) {
+      auto index = next_result++;
+      if (index >= results.size())
+        return;
+      run_test_in_process(dir_path, results[index]);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int i = 1; i < n_jobs; i++)
+    threads.push_back(std::thread(worker));
+  worker();
+  for (auto i = threads.begin(); i != threads.end(); i++)
+    i->join();
+  auto end_time = std::chrono::steady_clock::now();
+
+  size_t n_failed = 0;
+  for (auto i = results.begin(); i != results.end(); i++) {
+    if (i->passed) {
+      printf("PASS %9.3f ms  %s\n", i->duration_ms, i->name.c_str());
+    } else {
+      printf("FAIL %9.3f ms  %s: %s\n", i->duration_ms, i->name.c_str(),
+             i->message.c_str());
+      n_failed++;
+    }
+  }
+  printf("%zu tests, %zu failed, %.3f ms\n", results.size(), n_failed,
+         std::chrono::duration<double, std::milli>(end_time - start_time)
+             .count());
+
+  return n_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
+// Runs a program capturing stdout. Returns false if it couldn't be run or
+// didn't exit normally
+static bool run_process(const char *name, std::vector<std::string> &args,
+                        std::vector<uint8_t> &stdout_data, int *exit_status) {
   // Make pipe to capture stdout
   int stdout_pipe[2];
   if (pipe(stdout_pipe) < 0) {
     printf("Failed to make pipe\n");
-    return EXIT_FAILURE;
+    return false;
   }
 
-  // Run Elf with the given file
   pid_t pid = fork();
   if (pid == 0) {
     close(stdout_pipe[0]);
     dup2(stdout_pipe[1], STDOUT_FILENO);
-    execl(elf_path, elf_path, "run", source_path, nullptr);
+    std::vector<char *> argv;
+    for (auto i = args.begin(); i != args.end(); i++)
+      argv.push_back(const_cast<char *>(i->c_str()));
+    argv.push_back(nullptr);
+    execv(argv[0], argv.data());
     exit(EXIT_FAILURE);
   }
   close(stdout_pipe[1]);
 
-  // Read result from Elf
-  std::vector<uint8_t> stdout_data;
-  if (!fd_readall(stdout_pipe[0], stdout_data)) {
-    printf("Failed to read Elf output\n");
-    return EXIT_FAILURE;
+  // Read result from the program
+  auto read_result = fd_readall(stdout_pipe[0], stdout_data);
+  close(stdout_pipe[0]);
+  if (!read_result) {
+    printf("Failed to read %s output\n", name);
+    return false;
   }
 
-  // Get expected result
-  std::vector<uint8_t> expected_stdout_data;
-  file_readall(expected_stdout_path, expected_stdout_data);
-  int expected_exit_status = 0;
-  std::ifstream s(expected_exit_status_path);
-  s >> expected_exit_status;
-
-  // Wait for Elf to complete
+  // Wait for the program to complete
   int status;
   if (waitpid(pid, &status, 0) < 0) {
-    printf("Failed to wait for Elf to exit\n");
-    return EXIT_FAILURE;
+    printf("Failed to wait for %s to exit\n", name);
+    return false;
   }
   if (WIFEXITED(status)) {
-    int exit_status = WEXITSTATUS(status);
-    if (exit_status != expected_exit_status) {
-      printf("Elf exited with status %d\n", exit_status);
-      return EXIT_FAILURE;
-    }
+    *exit_status = WEXITSTATUS(status);
+    return true;
   } else if (WIFSIGNALED(status)) {
     int term_signal = WTERMSIG(status);
-    printf("Elf terminated with signal %d\n", term_signal);
-    return EXIT_FAILURE;
+    printf("%s terminated with signal %d\n", name, term_signal);
+    return false;
   } else
+    return false;
+}
+
+// Compiles the program and runs the executable. The source is linked into a
+// temporary directory, as elf compile writes the executable next to it
+static bool run_compiled(const char *elf_path, const char *source_path,
+                         bool stack_only, std::vector<uint8_t> &stdout_data,
+                         int *exit_status) {
+  char work_dir[] = "/tmp/elf-test-XXXXXX";
+  if (mkdtemp(work_dir) == nullptr) {
+    printf("Failed to make temporary directory\n");
+    return false;
+  }
+  auto absolute_source_path = realpath(source_path, nullptr);
+  if (absolute_source_path == nullptr) {
+    printf("Failed to find %s\n", source_path);
+    rmdir(work_dir);
+    return false;
+  }
+  std::string name = absolute_source_path;
+  name = name.substr(name.rfind('/') + 1);
+  auto link_path = std::string(work_dir) + "/" + name;
+  auto binary_path = link_path.substr(0, link_path.size() - 4);
+  auto linked = symlink(absolute_source_path, link_path.c_str()) == 0;
+  free(absolute_source_path);
+  if (!linked) {
+    printf("Failed to link %s\n", source_path);
+    rmdir(work_dir);
+    return false;
+  }
+
+  std::vector<std::string> compile_args = {elf_path, "compile"};
+  if (stack_only)
+    compile_args.push_back("--stack-only");
+  compile_args.push_back(link_path);
+  std::vector<uint8_t> compile_stdout_data;
+  int compile_exit_status;
+  auto result = run_process("Elf", compile_args, compile_stdout_data,
+                            &compile_exit_status);
+  if (result && compile_exit_status != 0) {
+    printf("Elf failed to compile program:\n%s",
+           std::string(compile_stdout_data.begin(), compile_stdout_data.end())
+               .c_str());
+    result = false;
+  }
+  if (result) {
+    std::vector<std::string> args = {binary_path};
+    result = run_process("Compiled program", args, stdout_data, exit_status);
+  }
+
+  unlink(binary_path.c_str());
+  unlink(link_path.c_str());
+  rmdir(work_dir);
+  return result;
+}
+
+int main(int argc, char **argv) {
+  if (argc >= 3 && strcmp(argv[1], "--in-process") == 0) {
+    int n_jobs = std::thread::hardware_concurrency();
+    if (argc >= 4 && strncmp(argv[3], "--jobs=", 7) == 0)
+      n_jobs = atoi(argv[3] + 7);
+    if (n_jobs < 1)
+      n_jobs = 1;
+    return run_in_process(argv[2], n_jobs);
+  }
+
+  bool compile = false, stack_only = false, ir = false;
+  int arg_index = 1;
+  for (; arg_index < argc && strncmp(argv[arg_index], "--", 2) == 0;
+       arg_index++) {
+    if (strcmp(argv[arg_index], "--compile") == 0)
+      compile = true;
+    else if (strcmp(argv[arg_index], "--stack-only") == 0)
+      stack_only = true;
+    else if (strcmp(argv[arg_index], "--ir") == 0)
+      ir = true;
+    else
+      break;
+  }
+  if (argc - arg_index != 2) {
+    printf("Usage: test-runner [--compile [--stack-only] | --ir] "
+           "<path-to-elf> <file>\n"
+           "       test-runner --in-process <directory> [--jobs=<n>]\n");
     return EXIT_FAILURE;
+  }
+  const char *elf_path = argv[arg_index];
+  const char *source_path = argv[arg_index + 1];
+  auto expected_stdout_path = std::string(source_path) + ".stdout";
+  auto expected_exit_status_path = std::string(source_path) + ".exit_status";
+
+  // Run Elf with the given file, or the program it compiles to. Compiled
+  // programs are checked against the same output as the interpreter
+  std::vector<uint8_t> stdout_data;
+  int exit_status;
+  bool ran;
+  if (compile)
+    ran = run_compiled(elf_path, source_path, stack_only, stdout_data,
+                       &exit_status);
+  else {
+    std::vector<std::string> args = {elf_path, ir ? "ir" : "run",
+                                     source_path};
+    ran = run_process("Elf", args, stdout_data, &exit_status);
+  }
+  if (!ran)
+    return EXIT_FAILURE;
+
+  // Get expected result
+  std::vector<uint8_t> expected_stdout_data;
+  file_readall(expected_stdout_path, expected_stdout_data);
+  int expected_exit_status =
+      read_expected_exit_status(expected_exit_status_path);
+
+  if (exit_status != expected_exit_status) {
+    printf("%s exited with status %d\n", compile ? "Compiled program" : "Elf",
+           exit_status);
+    return EXIT_FAILURE;
+  }
 
   if (stdout_data != expected_stdout_data) {
     printf("stdout does not match expected\n");
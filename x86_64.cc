@@ -12,152 +12,219 @@
 #define ADDRESS_16_PREFIX 0x66
 #define ADDRESS_64_PREFIX 0x48 // REX.W
 
-static void write_uint32(std::vector<uint8_t> &buffer, uint32_t value) {
-  buffer.push_back((value >> 0) & 0xFF);
-  buffer.push_back((value >> 8) & 0xFF);
-  buffer.push_back((value >> 16) & 0xFF);
-  buffer.push_back((value >> 24) & 0xFF);
+void CodeBuffer::write_uint32(uint32_t value) {
+  uint8_t bytes[4] = {uint8_t(value), uint8_t(value >> 8), uint8_t(value >> 16),
+                      uint8_t(value >> 24)};
+  write(bytes, 4);
 }
 
-static void write_uint64(std::vector<uint8_t> &buffer, uint64_t value) {
-  buffer.push_back((value >> 0) & 0xFF);
-  buffer.push_back((value >> 8) & 0xFF);
-  buffer.push_back((value >> 16) & 0xFF);
-  buffer.push_back((value >> 24) & 0xFF);
-  buffer.push_back((value >> 32) & 0xFF);
-  buffer.push_back((value >> 40) & 0xFF);
-  buffer.push_back((value >> 48) & 0xFF);
-  buffer.push_back((value >> 56) & 0xFF);
+void CodeBuffer::write_uint64(uint64_t value) {
+  uint8_t bytes[8];
+  for (int i = 0; i < 8; i++)
+    bytes[i] = uint8_t(value >> (i * 8));
+  write(bytes, 8);
 }
 
-void x86_64_mov8_val(std::vector<uint8_t> &buffer, int reg, uint8_t value) {
-  buffer.push_back(0xB0 + reg);
-  buffer.push_back(value);
+void CodeBuffer::add_label(const std::string &name) {
+  auto offset = data.size();
+  labels[name] = offset;
+
+  // Displacements are relative to the end of the jump instruction, which is
+  // where the displacement ends
+  for (auto i = fixups.begin(); i != fixups.end();) {
+    if (i->label != name) {
+      i++;
+      continue;
+    }
+    uint32_t displacement = offset - (i->offset + 4);
+    for (int j = 0; j < 4; j++)
+      data[i->offset + j] = uint8_t(displacement >> (j * 8));
+    i = fixups.erase(i);
+  }
+}
+
+void CodeBuffer::write_label_offset32(const std::string &label) {
+  auto i = labels.find(label);
+  if (i != labels.end()) {
+    write_uint32(i->second - (data.size() + 4));
+    return;
+  }
+
+  fixups.push_back(CodeFixup(label, data.size()));
+  write_uint32(0);
+}
+
+void x86_64_mov8_val(CodeBuffer &buffer, int reg, uint8_t value) {
+  buffer.write_uint8(0xB0 + reg);
+  buffer.write_uint8(value);
+}
+
+// REX prefix to select 64 bit operands (w) and access registers 8-15 in the
+// ModRM reg and rm fields
+static void write_rex(CodeBuffer &buffer, bool w, int reg, int rm) {
+  uint8_t rex = 0x40 | (w ? 0x08 : 0) | (reg >= 8 ? 0x04 : 0) |
+                (rm >= 8 ? 0x01 : 0);
+  if (rex != 0x40)
+    buffer.write_uint8(rex);
 }
 
-void x86_64_mov32_val(std::vector<uint8_t> &buffer, int reg, uint32_t value) {
-  buffer.push_back(0xB8 + reg);
-  write_uint32(buffer, value);
+static void write_modrm_reg(CodeBuffer &buffer, int reg, int rm) {
+  buffer.write_uint8(0xC0 | ((reg & 0x7) << 3) | (rm & 0x7));
 }
 
-void x86_64_mov32_reg(std::vector<uint8_t> &buffer, int reg1, int reg2) {
-  buffer.push_back(0x89);
-  buffer.push_back(0xC0 | (reg1 << 3) | reg2);
+// Operand at base + offset
+static void write_modrm_mem(CodeBuffer &buffer, int reg, int base,
+                            int32_t offset) {
+  buffer.write_uint8(0x80 | ((reg & 0x7) << 3) | (base & 0x7));
+  if ((base & 0x7) == X86_64_REG_STACK_POINTER)
+    buffer.write_uint8(0x24); // SIB with no index
+  buffer.write_uint32(offset);
 }
 
-void x86_64_mov32_mem(std::vector<uint8_t> &buffer, int reg, uint32_t offset) {
-  buffer.push_back(0x89);
-  buffer.push_back(0x0 | (reg << 3) | 0x5);
-  write_uint32(buffer, offset);
+// Opcode for an operation with a 32 bit immediate and the accumulator
+static uint8_t get_accumulator_opcode(int op) { return (op << 3) | 0x05; }
+
+void x86_64_mov32_val(CodeBuffer &buffer, int reg, uint32_t value) {
+  write_rex(buffer, false, 0, reg);
+  buffer.write_uint8(0xB8 + (reg & 0x7));
+  buffer.write_uint32(value);
+}
+
+void x86_64_mov32_reg(CodeBuffer &buffer, int reg1, int reg2) {
+  write_rex(buffer, false, reg1, reg2);
+  buffer.write_uint8(0x89);
+  write_modrm_reg(buffer, reg1, reg2);
+}
+
+void x86_64_mov32_mem(CodeBuffer &buffer, int reg, uint32_t offset) {
+  write_rex(buffer, false, reg, 0);
+  buffer.write_uint8(0x89);
+  buffer.write_uint8(0x0 | ((reg & 0x7) << 3) | 0x5);
+  buffer.write_uint32(offset);
 }
 
-void x86_64_mov64_val(std::vector<uint8_t> &buffer, int reg, uint64_t value) {
-  buffer.push_back(ADDRESS_64_PREFIX);
-  buffer.push_back(0xB8 + reg);
-  write_uint64(buffer, value);
+void x86_64_mov64_val(CodeBuffer &buffer, int reg, uint64_t value) {
+  write_rex(buffer, true, 0, reg);
+  buffer.write_uint8(0xB8 + (reg & 0x7));
+  buffer.write_uint64(value);
 }
 
-void x86_64_mov64_reg(std::vector<uint8_t> &buffer, int reg1, int reg2) {
-  buffer.push_back(ADDRESS_64_PREFIX);
-  buffer.push_back(0x89);
-  buffer.push_back(0xC0 | (reg1 << 3) | reg2);
+void x86_64_mov64_reg(CodeBuffer &buffer, int reg1, int reg2) {
+  write_rex(buffer, true, reg1, reg2);
+  buffer.write_uint8(0x89);
+  write_modrm_reg(buffer, reg1, reg2);
 }
 
-void x86_64_mov64_mem(std::vector<uint8_t> &buffer, int reg, uint32_t offset) {
-  buffer.push_back(ADDRESS_64_PREFIX);
-  buffer.push_back(0x89);
-  buffer.push_back(0x0 | (reg << 3) | 0x5);
-  write_uint32(buffer, offset);
+void x86_64_mov64_mem(CodeBuffer &buffer, int reg, uint32_t offset) {
+  write_rex(buffer, true, reg, 0);
+  buffer.write_uint8(0x89);
+  buffer.write_uint8(0x0 | ((reg & 0x7) << 3) | 0x5);
+  buffer.write_uint32(offset);
 }
 
-void x86_64_op32(std::vector<uint8_t> &buffer, int op, int reg1, int reg2) {
-  buffer.push_back(0x01);
-  buffer.push_back(0xC0 | (reg1 << 3) | reg2);
+void x86_64_mov64_load(CodeBuffer &buffer, int reg, int base, int32_t offset) {
+  write_rex(buffer, true, reg, base);
+  buffer.write_uint8(0x8B);
+  write_modrm_mem(buffer, reg, base, offset);
 }
 
-void x86_64_op32_val(std::vector<uint8_t> &buffer, int op, int reg,
-                     uint32_t value) {
+void x86_64_mov64_store(CodeBuffer &buffer, int base, int32_t offset,
+                        int reg) {
+  write_rex(buffer, true, reg, base);
+  buffer.write_uint8(0x89);
+  write_modrm_mem(buffer, reg, base, offset);
+}
+
+void x86_64_mov8_store(CodeBuffer &buffer, int base, int32_t offset,
+                       int reg) {
+  // Without a REX prefix registers 4-7 are the high bytes of the first four
+  if (reg >= 4 && reg < 8 && base < 8)
+    buffer.write_uint8(0x40);
+  else
+    write_rex(buffer, false, reg, base);
+  buffer.write_uint8(0x88);
+  write_modrm_mem(buffer, reg, base, offset);
+}
+
+void x86_64_op32(CodeBuffer &buffer, int op, int reg1, int reg2) {
+  write_rex(buffer, false, reg1, reg2);
+  buffer.write_uint8((op << 3) | 0x01);
+  write_modrm_reg(buffer, reg1, reg2);
+}
+
+void x86_64_op32_val(CodeBuffer &buffer, int op, int reg, uint32_t value) {
   if (reg == X86_64_REG_ACCUMULATOR) {
-    if (op == X86_64_OP_ADD)
-      buffer.push_back(0x05);
-    else if (op == X86_64_OP_OR)
-      buffer.push_back(0x0D);
-    else if (op == X86_64_OP_ADC)
-      buffer.push_back(0x15);
-    else if (op == X86_64_OP_SBB)
-      buffer.push_back(0x1D);
-    else if (op == X86_64_OP_AND)
-      buffer.push_back(0x25);
-    else if (op == X86_64_OP_SUB)
-      buffer.push_back(0x2D);
-    else if (op == X86_64_OP_XOR)
-      buffer.push_back(0x35);
-    else if (op == X86_64_OP_CMP)
-      buffer.push_back(0x3D);
+    buffer.write_uint8(get_accumulator_opcode(op));
   } else {
-    buffer.push_back(0x81);
-    buffer.push_back(0x0 | (op << 3) | reg);
+    write_rex(buffer, false, 0, reg);
+    buffer.write_uint8(0x81);
+    write_modrm_reg(buffer, op, reg);
   }
-  write_uint32(buffer, value);
+  buffer.write_uint32(value);
 }
 
-void x86_64_op64(std::vector<uint8_t> &buffer, int op, int reg1, int reg2) {
-  buffer.push_back(ADDRESS_64_PREFIX);
-  buffer.push_back(0x01);
-  buffer.push_back(0xC0 | (reg1 << 3) | reg2);
+void x86_64_op64(CodeBuffer &buffer, int op, int reg1, int reg2) {
+  write_rex(buffer, true, reg1, reg2);
+  buffer.write_uint8((op << 3) | 0x01);
+  write_modrm_reg(buffer, reg1, reg2);
 }
 
-void x86_64_op64_val(std::vector<uint8_t> &buffer, int op, int reg,
-                     uint64_t value) {
-  buffer.push_back(ADDRESS_64_PREFIX);
+void x86_64_op64_val(CodeBuffer &buffer, int op, int reg, uint32_t value) {
+  write_rex(buffer, true, 0, reg);
   if (reg == X86_64_REG_ACCUMULATOR) {
-    if (op == X86_64_OP_ADD)
-      buffer.push_back(0x05);
-    else if (op == X86_64_OP_OR)
-      buffer.push_back(0x0D);
-    else if (op == X86_64_OP_ADC)
-      buffer.push_back(0x15);
-    else if (op == X86_64_OP_SBB)
-      buffer.push_back(0x1D);
-    else if (op == X86_64_OP_AND)
-      buffer.push_back(0x25);
-    else if (op == X86_64_OP_SUB)
-      buffer.push_back(0x2D);
-    else if (op == X86_64_OP_XOR)
-      buffer.push_back(0x35);
-    else if (op == X86_64_OP_CMP)
-      buffer.push_back(0x3D);
+    buffer.write_uint8(get_accumulator_opcode(op));
   } else {
-    buffer.push_back(0x81);
-    buffer.push_back(0x0 | (op << 3) | reg);
+    buffer.write_uint8(0x81);
+    write_modrm_reg(buffer, op, reg);
   }
-  write_uint64(buffer, value);
+  buffer.write_uint32(value);
+}
+
+void x86_64_imul64(CodeBuffer &buffer, int reg1, int reg2) {
+  write_rex(buffer, true, reg2, reg1);
+  buffer.write_uint8(0x0F);
+  buffer.write_uint8(0xAF);
+  write_modrm_reg(buffer, reg2, reg1);
+}
+
+void x86_64_neg64(CodeBuffer &buffer, int reg) {
+  write_rex(buffer, true, 0, reg);
+  buffer.write_uint8(0xF7);
+  write_modrm_reg(buffer, 3, reg);
 }
 
-void x86_64_push64(std::vector<uint8_t> &buffer, int reg) {
-  buffer.push_back(0x50 + reg);
+void x86_64_div64(CodeBuffer &buffer, int reg) {
+  write_rex(buffer, true, 0, reg);
+  buffer.write_uint8(0xF7);
+  write_modrm_reg(buffer, 6, reg);
 }
 
-void x86_64_push_val8(std::vector<uint8_t> &buffer, uint8_t value) {
-  buffer.push_back(0x6A);
-  buffer.push_back(value);
+void x86_64_push64(CodeBuffer &buffer, int reg) {
+  write_rex(buffer, false, 0, reg);
+  buffer.write_uint8(0x50 + (reg & 0x7));
 }
 
-void x86_64_push_val32(std::vector<uint8_t> &buffer, uint32_t value) {
-  buffer.push_back(0x68);
-  write_uint32(buffer, value);
+void x86_64_push_val8(CodeBuffer &buffer, uint8_t value) {
+  buffer.write_uint8(0x6A);
+  buffer.write_uint8(value);
 }
 
-void x86_64_pop64(std::vector<uint8_t> &buffer, int reg) {
-  buffer.push_back(0x58 + reg);
+void x86_64_push_val32(CodeBuffer &buffer, uint32_t value) {
+  buffer.write_uint8(0x68);
+  buffer.write_uint32(value);
 }
 
-void x86_64_jmp8(std::vector<uint8_t> &buffer, uint8_t offset) {
-  buffer.push_back(0xEB);
-  buffer.push_back(offset);
+void x86_64_pop64(CodeBuffer &buffer, int reg) {
+  write_rex(buffer, false, 0, reg);
+  buffer.write_uint8(0x58 + (reg & 0x7));
 }
 
-void x86_64_jmp8_cond(std::vector<uint8_t> &buffer, int cond, uint8_t offset) {
+void x86_64_jmp8(CodeBuffer &buffer, uint8_t offset) {
+  buffer.write_uint8(0xEB);
+  buffer.write_uint8(offset);
+}
+
+void x86_64_jmp8_cond(CodeBuffer &buffer, int cond, uint8_t offset) {
   uint8_t opcode = 0;
   switch (cond) {
   case X86_64_COND_OVERFLOW:
@@ -209,18 +276,18 @@ void x86_64_jmp8_cond(std::vector<uint8_t> &buffer, int cond, uint8_t offset) {
     opcode = 0x7F;
     break;
   }
-  buffer.push_back(opcode);
-  buffer.push_back(offset);
+  buffer.write_uint8(opcode);
+  buffer.write_uint8(offset);
 }
 
-void x86_64_jmp32(std::vector<uint8_t> &buffer, uint32_t offset) {
-  buffer.push_back(0xE9);
-  write_uint32(buffer, offset);
+void x86_64_jmp32(CodeBuffer &buffer, uint32_t offset) {
+  buffer.write_uint8(0xE9);
+  buffer.write_uint32(offset);
 }
 
-void x86_64_jmp32_cond(std::vector<uint8_t> &buffer, int cond,
+void x86_64_jmp32_cond(CodeBuffer &buffer, int cond,
                        uint32_t offset) {
-  buffer.push_back(0x0F);
+  buffer.write_uint8(0x0F);
   uint8_t opcode = 0;
   switch (cond) {
   case X86_64_COND_OVERFLOW:
@@ -272,11 +339,50 @@ void x86_64_jmp32_cond(std::vector<uint8_t> &buffer, int cond,
     opcode = 0x8F;
     break;
   }
-  buffer.push_back(opcode);
-  write_uint32(buffer, offset);
+  buffer.write_uint8(opcode);
+  buffer.write_uint32(offset);
+}
+
+// Short jumps have a signed 8 bit displacement from the end of the instruction
+static bool get_short_displacement(CodeBuffer &buffer, const std::string &label,
+                                   int8_t *displacement) {
+  auto i = buffer.labels.find(label);
+  if (i == buffer.labels.end())
+    return false;
+
+  int64_t d = int64_t(i->second) - int64_t(buffer.size() + 2);
+  if (d < INT8_MIN || d > INT8_MAX)
+    return false;
+
+  *displacement = d;
+  return true;
+}
+
+void x86_64_jmp(CodeBuffer &buffer, const std::string &label) {
+  int8_t displacement;
+  if (get_short_displacement(buffer, label, &displacement)) {
+    x86_64_jmp8(buffer, displacement);
+    return;
+  }
+
+  buffer.write_uint8(0xE9);
+  buffer.write_label_offset32(label);
+}
+
+void x86_64_jmp_cond(CodeBuffer &buffer, int cond, const std::string &label) {
+  int8_t displacement;
+  if (get_short_displacement(buffer, label, &displacement)) {
+    x86_64_jmp8_cond(buffer, cond, displacement);
+    return;
+  }
+
+  // Replace the displacement with one to the label
+  x86_64_jmp32_cond(buffer, cond, 0);
+  buffer.data.resize(buffer.size() - 4);
+  buffer.write_label_offset32(label);
 }
 
-void x86_64_syscall(std::vector<uint8_t> &buffer) {
-  buffer.push_back(0x0F);
-  buffer.push_back(0x05);
+void x86_64_syscall(CodeBuffer &buffer) {
+  buffer.write_uint8(0x0F);
+  buffer.write_uint8(0x05);
 }
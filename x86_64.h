@@ -9,7 +9,9 @@
 
 #pragma once
 
+#include <map>
 #include <stdint.h>
+#include <string>
 #include <vector>
 
 // Registers
@@ -58,40 +60,113 @@
 #define X86_64_COND_LESS_EQUAL 14
 #define X86_64_COND_GREATER 15
 
-void x86_64_mov8_val(std::vector<uint8_t> &buffer, int reg, uint8_t value);
+// A relative jump to a label that hasn't been added yet
+struct CodeFixup {
+  std::string label;
 
-void x86_64_mov32_val(std::vector<uint8_t> &buffer, int reg, uint32_t value);
+  // Offset of the 32 bit displacement to patch
+  size_t offset;
 
-void x86_64_mov32_mem(std::vector<uint8_t> &buffer, int reg, uint32_t offset);
+  CodeFixup(const std::string &label, size_t offset)
+      : label(label), offset(offset) {}
+};
 
-void x86_64_mov64_val(std::vector<uint8_t> &buffer, int reg, uint64_t value);
+// Machine code being generated, with labels that jumps can refer to before
+// they are added
+struct CodeBuffer {
+  std::vector<uint8_t> data;
 
-void x86_64_mov64_mem(std::vector<uint8_t> &buffer, int reg, uint32_t offset);
+  // Offset of each label that has been added
+  std::map<std::string, size_t> labels;
 
-void x86_64_op32(std::vector<uint8_t> &buffer, int op, int reg1, int reg2);
+  std::vector<CodeFixup> fixups;
 
-void x86_64_op32_val(std::vector<uint8_t> &buffer, int op, int reg,
-                     uint32_t value);
+  CodeBuffer(size_t capacity = 4096) { data.reserve(capacity); }
 
-void x86_64_op64(std::vector<uint8_t> &buffer, int op, int reg1, int reg2);
+  size_t size() { return data.size(); }
 
-void x86_64_op64_val(std::vector<uint8_t> &buffer, int op, int reg,
-                     uint64_t value);
+  void write_uint8(uint8_t value) { data.push_back(value); }
+  void write(const uint8_t *bytes, size_t length) {
+    data.insert(data.end(), bytes, bytes + length);
+  }
+  void write_uint32(uint32_t value);
+  void write_uint64(uint64_t value);
 
-void x86_64_push64(std::vector<uint8_t> &buffer, int reg);
+  // Marks the current offset, and patches any jumps already made to it
+  void add_label(const std::string &name);
 
-void x86_64_push_val8(std::vector<uint8_t> &buffer, uint8_t value);
+  // Writes a 32 bit displacement to a label, patched when the label is added
+  void write_label_offset32(const std::string &label);
 
-void x86_64_push_val32(std::vector<uint8_t> &buffer, uint32_t value);
+  // True if all jumps have been patched
+  bool is_complete() { return fixups.empty(); }
+};
 
-void x86_64_pop64(std::vector<uint8_t> &buffer, int reg);
+void x86_64_mov8_val(CodeBuffer &buffer, int reg, uint8_t value);
 
-void x86_64_jmp8(std::vector<uint8_t> &buffer, uint8_t offset);
+void x86_64_mov32_val(CodeBuffer &buffer, int reg, uint32_t value);
 
-void x86_64_jmp8_cond(std::vector<uint8_t> &buffer, int cond, uint8_t offset);
+void x86_64_mov32_reg(CodeBuffer &buffer, int reg1, int reg2);
 
-void x86_64_jmp32(std::vector<uint8_t> &buffer, uint32_t offset);
+void x86_64_mov32_mem(CodeBuffer &buffer, int reg, uint32_t offset);
 
-void x86_64_jmp32_cond(std::vector<uint8_t> &buffer, int cond, uint32_t offset);
+void x86_64_mov64_val(CodeBuffer &buffer, int reg, uint64_t value);
 
-void x86_64_syscall(std::vector<uint8_t> &buffer);
+// reg2 = reg1
+void x86_64_mov64_reg(CodeBuffer &buffer, int reg1, int reg2);
+
+void x86_64_mov64_mem(CodeBuffer &buffer, int reg, uint32_t offset);
+
+// reg = [base + offset]
+void x86_64_mov64_load(CodeBuffer &buffer, int reg, int base, int32_t offset);
+
+// [base + offset] = reg
+void x86_64_mov64_store(CodeBuffer &buffer, int base, int32_t offset,
+                        int reg);
+
+// Stores the low byte of reg at [base + offset]
+void x86_64_mov8_store(CodeBuffer &buffer, int base, int32_t offset, int reg);
+
+// reg2 = reg2 op reg1
+void x86_64_op32(CodeBuffer &buffer, int op, int reg1, int reg2);
+
+void x86_64_op32_val(CodeBuffer &buffer, int op, int reg, uint32_t value);
+
+void x86_64_op64(CodeBuffer &buffer, int op, int reg1, int reg2);
+
+// value is sign extended to 64 bits
+void x86_64_op64_val(CodeBuffer &buffer, int op, int reg, uint32_t value);
+
+// reg2 = reg2 * reg1
+void x86_64_imul64(CodeBuffer &buffer, int reg1, int reg2);
+
+// reg = -reg
+void x86_64_neg64(CodeBuffer &buffer, int reg);
+
+// Unsigned divide of rdx:rax by reg, rax = quotient, rdx = remainder
+void x86_64_div64(CodeBuffer &buffer, int reg);
+
+void x86_64_push64(CodeBuffer &buffer, int reg);
+
+void x86_64_push_val8(CodeBuffer &buffer, uint8_t value);
+
+void x86_64_push_val32(CodeBuffer &buffer, uint32_t value);
+
+void x86_64_pop64(CodeBuffer &buffer, int reg);
+
+void x86_64_jmp8(CodeBuffer &buffer, uint8_t offset);
+
+void x86_64_jmp8_cond(CodeBuffer &buffer, int cond, uint8_t offset);
+
+void x86_64_jmp32(CodeBuffer &buffer, uint32_t offset);
+
+void x86_64_jmp32_cond(CodeBuffer &buffer, int cond, uint32_t offset);
+
+// Jumps to a label, using the short form if it has already been added and is
+// close enough. Jumps to later labels use the near form, as their distance is
+// not known yet
+void x86_64_jmp(CodeBuffer &buffer, const std::string &label);
+
+void x86_64_jmp_cond(CodeBuffer &buffer, int cond, const std::string &label);
+
+void x86_64_syscall(CodeBuffer &buffer);